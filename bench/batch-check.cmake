@@ -0,0 +1,30 @@
+# Run a job file with `tam --batch` and check the line printed for each job
+# and the summary against the ones expected, ignoring the run times. The
+# jobs run under a step budget, and once more under a time limit, which
+# stops the job that never halts either way.
+#
+# Run by the `batch-check` target with TAM, JOB_FILE, EXPECTED and WORK_DIR
+# set, WORK_DIR being where the paths in the report are relative to.
+
+execute_process(COMMAND ${TAM} --batch ${JOB_FILE} -j 2 --max-steps 100000
+  WORKING_DIRECTORY ${WORK_DIR}
+  OUTPUT_VARIABLE Out ERROR_VARIABLE Err RESULT_VARIABLE Result)
+string(REGEX REPLACE " *[0-9]+\\.[0-9]+ ms" " - ms" Out "${Out}")
+file(READ ${EXPECTED} ExpectedOut)
+
+if(NOT Out STREQUAL ExpectedOut)
+  message(FATAL_ERROR "batch report differs from ${EXPECTED}:\n${Out}${Err}")
+endif()
+# some jobs fail on purpose
+if(NOT Result EQUAL 1)
+  message(FATAL_ERROR "tam --batch exited with ${Result}, expected 1")
+endif()
+
+execute_process(COMMAND ${TAM} --batch ${JOB_FILE} -j 2 --timeout 0.1
+  WORKING_DIRECTORY ${WORK_DIR}
+  OUTPUT_VARIABLE Out ERROR_VARIABLE Err RESULT_VARIABLE Result)
+if(NOT Out MATCHES "\nERROR +14 [^\n]* spin.tam: time limit exceeded" OR
+   NOT Result EQUAL 1)
+  message(FATAL_ERROR "--timeout did not stop the job:\n${Out}${Err}")
+endif()
+message(STATUS "batch: ok")
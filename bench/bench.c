@@ -0,0 +1,216 @@
+#include <glob.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <tam/error.h>
+#include <tam/tam.h>
+#include <time.h>
+
+/// @brief Timings for one program of the corpus.
+typedef struct BenchResult {
+    const char *Name; ///< File the program was loaded from
+    const char *Base; ///< `Name` without its directory
+    uint64_t Steps;   ///< Instructions executed by one run
+    double Best;      ///< Fastest run in seconds
+    double Median;    ///< Median run in seconds
+    double Mean;      ///< Mean run in seconds
+    long PeakRss;     ///< Peak resident set of the process afterwards, in KiB
+} BenchResult;
+
+/// Current value of the monotonic clock in seconds.
+static double now(void) {
+    struct timespec Ts;
+    clock_gettime(CLOCK_MONOTONIC, &Ts);
+    return Ts.tv_sec + Ts.tv_nsec * 1e-9;
+}
+
+static int compareTimes(const void *A, const void *B) {
+    double X = *(const double *)A;
+    double Y = *(const double *)B;
+    return (X > Y) - (X < Y);
+}
+
+/// @brief Time a program over a number of runs, after some untimed ones.
+/// @param Emulator emulator to run it on
+/// @param[in,out] Result result with `Name` set, to fill in
+/// @param Warmup number of runs to discard
+/// @param Reps number of runs to time
+/// @param Jit nonzero to run the program with runEmulatorJit()
+/// @param Ir nonzero to run the program with runEmulatorIR()
+/// @param[out] Times space for `Reps` run times
+/// @return 0 on success, otherwise the error that stopped a run
+static int benchProgram(TamEmulator *Emulator, BenchResult *Result,
+                        int Warmup, int Reps, int Jit, int Ir,
+                        double *Times) {
+    TamProgram *Program;
+    int ErrCode = loadProgramImage(Result->Name, &Program);
+    if (ErrCode) {
+        fprintf(stderr, "%s: %s\n", Result->Name, errorMessage(ErrCode));
+        return ErrCode;
+    }
+
+    // output is kept in memory so that printing it costs nothing
+    TamBuffer Output = {0};
+    for (int Rep = -Warmup; Rep < Reps && !ErrCode; ++Rep) {
+        attachProgram(Emulator, Program);
+        setInputMemory(&Emulator->IO, "", 0);
+        setOutputMemory(&Emulator->IO, &Output);
+        Output.Size = 0;
+
+        double Start = now();
+        ErrCode = Jit  ? runEmulatorJit(Emulator, 0)
+                  : Ir ? runEmulatorIR(Emulator, 0)
+                       : runEmulator(Emulator, 0);
+        double Elapsed = now() - Start;
+        if (ErrCode) {
+            fprintf(stderr, "%s: %s at loc %04x\n", Result->Name,
+                    errorMessage(ErrCode), Emulator->Registers[CP]);
+        } else if (Rep >= 0) {
+            Times[Rep] = Elapsed;
+        }
+    }
+    Result->Steps = Emulator->Steps;
+    setOutputFd(&Emulator->IO, 1);
+    free(Output.Data);
+    releaseProgram(Program);
+    if (ErrCode) {
+        return ErrCode;
+    }
+
+    double Total = 0;
+    for (int Rep = 0; Rep < Reps; ++Rep) {
+        Total += Times[Rep];
+    }
+    qsort(Times, Reps, sizeof(double), compareTimes);
+    Result->Best = Times[0];
+    Result->Median = Reps % 2 ? Times[Reps / 2]
+                              : (Times[Reps / 2 - 1] + Times[Reps / 2]) / 2;
+    Result->Mean = Total / Reps;
+
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    Result->PeakRss = Usage.ru_maxrss;
+    return 0;
+}
+
+/// @brief Write results as JSON, for tracking them from run to run.
+/// @param Filename file to write
+/// @param Results results to write
+/// @param Count number of results
+/// @param Warmup number of untimed runs of each program
+/// @param Reps number of timed runs of each program
+/// @param Jit nonzero if the programs ran with the JIT compiler
+/// @param Ir nonzero if the programs ran as register code
+/// @return 0 on success, -1 if the file could not be written
+static int writeResults(const char *Filename, const BenchResult *Results,
+                        int Count, int Warmup, int Reps, int Jit, int Ir) {
+    FILE *Out = fopen(Filename, "w");
+    if (!Out) {
+        return -1;
+    }
+    fprintf(Out, "{\n  \"timestamp\": %lld,\n", (long long)time(NULL));
+    fprintf(Out, "  \"warmup\": %d,\n  \"repetitions\": %d,\n", Warmup, Reps);
+    fprintf(Out, "  \"jit\": %s,\n", Jit ? "true" : "false");
+    fprintf(Out, "  \"ir\": %s,\n", Ir ? "true" : "false");
+    fprintf(Out, "  \"benchmarks\": [\n");
+    for (int i = 0; i < Count; ++i) {
+        const BenchResult *R = &Results[i];
+        fprintf(Out,
+                "    {\"name\": \"%s\", \"instructions\": %llu, "
+                "\"best_ns\": %.0f, \"median_ns\": %.0f, \"mean_ns\": %.0f, "
+                "\"ns_per_instruction\": %.4f, "
+                "\"instructions_per_second\": %.0f, \"peak_rss_kib\": %ld}%s\n",
+                R->Base, (unsigned long long)R->Steps, R->Best * 1e9,
+                R->Median * 1e9, R->Mean * 1e9, R->Median * 1e9 / R->Steps,
+                R->Steps / R->Median, R->PeakRss, i + 1 < Count ? "," : "");
+    }
+    fprintf(Out, "  ]\n}\n");
+    return fclose(Out) ? -1 : 0;
+}
+
+int main(int argc, const char **argv) {
+    int Warmup = 1;
+    int Reps = 5;
+    const char *JsonFile = NULL;
+    int Jit = 0;
+    int Ir = 0;
+    int Arg = 1;
+
+    for (; Arg < argc && argv[Arg][0] == '-'; ++Arg) {
+        if (strcmp(argv[Arg], "-j") == 0) {
+            Jit = 1;
+        } else if (strcmp(argv[Arg], "-i") == 0) {
+            Ir = 1;
+        } else if (Arg + 1 == argc) {
+            break;
+        } else if (strcmp(argv[Arg], "-r") == 0) {
+            Reps = atoi(argv[++Arg]);
+        } else if (strcmp(argv[Arg], "-w") == 0) {
+            Warmup = atoi(argv[++Arg]);
+        } else if (strcmp(argv[Arg], "-o") == 0) {
+            JsonFile = argv[++Arg];
+        } else {
+            break;
+        }
+    }
+
+    if ((Arg < argc && argv[Arg][0] == '-') || Reps < 1 || Warmup < 0 ||
+        (Jit && Ir)) {
+        fprintf(stderr, "usage: tam_bench [-j | -i] [-w warmup] [-r reps] "
+                        "[-o results.json] [program.tam...]\n");
+        return 1;
+    }
+
+    // with no programs named, run the whole corpus
+    glob_t Corpus = {0};
+    const char **Programs = argv + Arg;
+    int Count = argc - Arg;
+    if (!Count) {
+        if (glob(TAM_BENCH_DIR "/*.tam", 0, NULL, &Corpus) != 0) {
+            fprintf(stderr, "no programs found in %s\n", TAM_BENCH_DIR);
+            return 1;
+        }
+        Programs = (const char **)Corpus.gl_pathv;
+        Count = Corpus.gl_pathc;
+    }
+
+    BenchResult *Results = calloc(Count, sizeof(BenchResult));
+    double *Times = malloc(Reps * sizeof(double));
+    TamEmulator *Emulator = newEmulator();
+    if (!Results || !Times || !Emulator) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("%-24s %12s %10s %10s %10s %8s %9s\n", "program", "instrs",
+           "best ms", "median ms", "Minstr/s", "ns/instr", "RSS KiB");
+    int ErrCode = 0;
+    for (int i = 0; i < Count && !ErrCode; ++i) {
+        BenchResult *R = &Results[i];
+        R->Name = Programs[i];
+        R->Base = strrchr(R->Name, '/') ? strrchr(R->Name, '/') + 1 : R->Name;
+        if ((ErrCode = benchProgram(Emulator, R, Warmup, Reps, Jit, Ir,
+                                     Times))) {
+            break;
+        }
+
+        printf("%-24s %12llu %10.3f %10.3f %10.2f %8.3f %9ld\n", R->Base,
+               (unsigned long long)R->Steps, R->Best * 1e3, R->Median * 1e3,
+               R->Steps / R->Median * 1e-6, R->Median * 1e9 / R->Steps,
+               R->PeakRss);
+    }
+
+    if (!ErrCode && JsonFile &&
+        writeResults(JsonFile, Results, Count, Warmup, Reps, Jit, Ir)) {
+        fprintf(stderr, "could not write %s\n", JsonFile);
+        ErrCode = 1;
+    }
+
+    freeEmulator(Emulator);
+    free(Times);
+    free(Results);
+    globfree(&Corpus);
+    return ErrCode;
+}
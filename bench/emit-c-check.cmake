@@ -0,0 +1,59 @@
+# Translate every program in the corpus with `tam --emit-c`, compile the
+# result and check that it behaves exactly as the interpreter does.
+#
+# Run by the `emit-c-check` target with TAM, CC, INCLUDE_DIR, LIBRARY,
+# PROGRAM_DIR and WORK_DIR set.
+
+file(GLOB Programs ${PROGRAM_DIR}/*.tam)
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+set(Failures 0)
+foreach(Program ${Programs})
+  get_filename_component(Name ${Program} NAME_WE)
+  set(Source ${WORK_DIR}/${Name}.c)
+  set(Binary ${WORK_DIR}/${Name})
+
+  # programs that read input have it beside them
+  string(REGEX REPLACE "\\.tam$" ".in" Input ${Program})
+  if(NOT EXISTS ${Input})
+    set(Input /dev/null)
+  endif()
+
+  execute_process(COMMAND ${TAM} --emit-c ${Source} ${Program}
+    RESULT_VARIABLE Result)
+  if(NOT Result EQUAL 0)
+    message(SEND_ERROR "${Name}: translation failed")
+    math(EXPR Failures "${Failures} + 1")
+    continue()
+  endif()
+
+  execute_process(
+    COMMAND ${CC} -O2 -o ${Binary} ${Source} -I${INCLUDE_DIR} ${LIBRARY}
+            -lpthread
+    RESULT_VARIABLE Result)
+  if(NOT Result EQUAL 0)
+    message(SEND_ERROR "${Name}: translation does not compile")
+    math(EXPR Failures "${Failures} + 1")
+    continue()
+  endif()
+
+  execute_process(COMMAND ${TAM} ${Program} INPUT_FILE ${Input}
+    OUTPUT_VARIABLE ExpectedOut ERROR_VARIABLE ExpectedErr
+    RESULT_VARIABLE ExpectedResult)
+  execute_process(COMMAND ${Binary} INPUT_FILE ${Input}
+    OUTPUT_VARIABLE ActualOut ERROR_VARIABLE ActualErr
+    RESULT_VARIABLE ActualResult)
+  if(NOT ActualOut STREQUAL ExpectedOut OR
+     NOT ActualErr STREQUAL ExpectedErr OR
+     NOT ActualResult STREQUAL ExpectedResult)
+    message(SEND_ERROR "${Name}: translation behaves differently "
+      "(exit ${ActualResult}, expected ${ExpectedResult})")
+    math(EXPR Failures "${Failures} + 1")
+  else()
+    message(STATUS "${Name}: ok")
+  endif()
+endforeach()
+
+if(Failures)
+  message(FATAL_ERROR "${Failures} translated programs differ")
+endif()
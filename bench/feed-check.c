@@ -0,0 +1,134 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tam/error.h>
+#include <tam/tam.h>
+
+/// Build a TAM instruction word.
+#define INSTR(Op, R, N, D)                                                     \
+    ((uint32_t)(Op) << 28 | (uint32_t)(R) << 24 | (uint32_t)(N) << 16 |        \
+     (uint32_t)(D)&0xffff)
+
+/// @brief A program that reads two numbers and a character with `getint`
+/// and `get`, prints the numbers, and then prints whether `eof` is true.
+static const uint32_t Program[] = {
+    INSTR(10, 0, 0, 2),  // 0:  PUSH 2
+    INSTR(1, 4, 0, 0),   // 1:  LOADA 0[SB]
+    INSTR(6, 2, 0, 25),  // 2:  CALL getint
+    INSTR(1, 4, 0, 1),   // 3:  LOADA 1[SB]
+    INSTR(6, 2, 0, 25),  // 4:  CALL getint
+    INSTR(0, 4, 1, 0),   // 5:  LOAD(1) 0[SB]
+    INSTR(6, 2, 0, 26),  // 6:  CALL putint
+    INSTR(0, 4, 1, 1),   // 7:  LOAD(1) 1[SB]
+    INSTR(6, 2, 0, 26),  // 8:  CALL putint
+    INSTR(1, 4, 0, 0),   // 9:  LOADA 0[SB]
+    INSTR(6, 2, 0, 21),  // 10: CALL get
+    INSTR(6, 2, 0, 20),  // 11: CALL eof
+    INSTR(6, 2, 0, 26),  // 12: CALL putint
+    INSTR(15, 0, 0, 0),  // 13: HALT
+};
+
+/// @brief One step of the check: input to hand over, or null for the end
+/// of the input, and how the run that follows should stop.
+typedef struct Stage {
+    const char *Feed;   ///< Bytes to feed, or null to call endInput()
+    int ErrCode;        ///< Error the run should stop with
+    ADDRESS Loc;        ///< Where CP should be left
+    uint64_t Steps;     ///< Instructions executed in all by then
+    const char *Output; ///< Everything written by then
+} Stage;
+
+/// `getint` waits for the character after the number, even when what it
+/// has so far is a whole number, and `eof` only says yes after endInput().
+static const Stage Stages[] = {
+    {"", ErrNeedsInput, 2, 2, ""},
+    {"1", ErrNeedsInput, 2, 2, ""},
+    {"2", ErrNeedsInput, 2, 2, ""},
+    {" -3", ErrNeedsInput, 4, 4, ""},
+    {"4\n", ErrNeedsInput, 11, 11, "12-34"},
+    {NULL, OK, 14, 14, "12-341"},
+};
+
+/// Ways of running the program, each of which must stop in the same places.
+static const struct {
+    const char *Name;
+    int (*Run)(TamEmulator *, uint64_t);
+} Engines[] = {
+    {"interpreter", runEmulator},
+    {"jit", runEmulatorJit},
+    {"ir", runEmulatorIR},
+};
+
+/// @brief Feed the program its input in pieces on one engine, checking
+/// where each run stops.
+/// @return the number of stages that went wrong
+static int checkEngine(TamEmulator *Emulator, int Engine) {
+    uint8_t Code[sizeof(Program)];
+    for (size_t i = 0; i < sizeof(Program) / sizeof(Program[0]); ++i) {
+        Code[4 * i] = Program[i] >> 24;
+        Code[4 * i + 1] = Program[i] >> 16;
+        Code[4 * i + 2] = Program[i] >> 8;
+        Code[4 * i + 3] = Program[i];
+    }
+    int ErrCode = loadProgramFromMemory(Emulator, Code, sizeof(Code));
+    if (ErrCode) {
+        fprintf(stderr, "feed-check: %s\n", errorMessage(ErrCode));
+        return 1;
+    }
+
+    TamBuffer Output = {0};
+    setInputFeed(&Emulator->IO);
+    setOutputMemory(&Emulator->IO, &Output);
+    int Failures = 0;
+    for (size_t i = 0; i < sizeof(Stages) / sizeof(Stages[0]); ++i) {
+        const Stage *S = &Stages[i];
+        if (!S->Feed) {
+            endInput(&Emulator->IO);
+        } else if (feedInput(&Emulator->IO, S->Feed, strlen(S->Feed))) {
+            fprintf(stderr, "feed-check: out of memory\n");
+            return Failures + 1;
+        }
+        ErrCode = Engines[Engine].Run(Emulator, 0);
+        flushOutput(&Emulator->IO);
+
+        size_t Len = strlen(S->Output);
+        if (ErrCode != S->ErrCode || Emulator->Registers[CP] != S->Loc ||
+            Emulator->Steps != S->Steps || Output.Size != Len ||
+            memcmp(Output.Data, S->Output, Len) != 0) {
+            fprintf(stderr,
+                    "feed-check: %s, stage %zu: stopped with %d at loc %04x "
+                    "after %llu instructions, output \"%.*s\"; expected %d at "
+                    "loc %04x after %llu, output \"%s\"\n",
+                    Engines[Engine].Name, i, ErrCode,
+                    Emulator->Registers[CP],
+                    (unsigned long long)Emulator->Steps, (int)Output.Size,
+                    Output.Data ? Output.Data : "", S->ErrCode, S->Loc,
+                    (unsigned long long)S->Steps, S->Output);
+            ++Failures;
+            break;
+        }
+    }
+    resetEmulator(Emulator);
+    free(Output.Data);
+    return Failures;
+}
+
+int main(void) {
+    TamEmulator *Emulator = newEmulator();
+    if (!Emulator) {
+        fprintf(stderr, "feed-check: out of memory\n");
+        return 1;
+    }
+
+    int Failures = 0;
+    for (size_t i = 0; i < sizeof(Engines) / sizeof(Engines[0]); ++i) {
+        int Failed = checkEngine(Emulator, i);
+        if (!Failed) {
+            printf("-- feed-check: %s: ok\n", Engines[i].Name);
+        }
+        Failures += Failed;
+    }
+    freeEmulator(Emulator);
+    return Failures != 0;
+}
@@ -0,0 +1,71 @@
+# Rewrite every program in the given directories with `tam-opt` and check
+# that the result writes the same output, exits with the same code, is no
+# longer and executes no more instructions than the original.
+#
+# Run by the `opt-check` target with TAM, TAM_OPT, PROGRAM_DIRS and WORK_DIR
+# set.
+
+set(Programs)
+foreach(Dir ${PROGRAM_DIRS})
+  file(GLOB DirPrograms ${Dir}/*.tam)
+  list(APPEND Programs ${DirPrograms})
+endforeach()
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# Run a program with `tam --stats`, setting <Prefix>Out, <Prefix>Result and
+# <Prefix>Steps.
+function(runProgram Prefix Program Input)
+  execute_process(COMMAND ${TAM} --stats ${Program} INPUT_FILE ${Input}
+    OUTPUT_VARIABLE Out ERROR_VARIABLE Err RESULT_VARIABLE Result)
+  string(REGEX MATCH "instructions executed: ([0-9]+)" Match "${Err}")
+  set(${Prefix}Out "${Out}" PARENT_SCOPE)
+  set(${Prefix}Result "${Result}" PARENT_SCOPE)
+  set(${Prefix}Steps "${CMAKE_MATCH_1}" PARENT_SCOPE)
+endfunction()
+
+set(Failures 0)
+foreach(Program ${Programs})
+  get_filename_component(Dir ${Program} DIRECTORY)
+  get_filename_component(DirName ${Dir} NAME)
+  get_filename_component(Name ${Program} NAME_WE)
+  set(Name ${DirName}-${Name})
+  set(Optimized ${WORK_DIR}/${Name}.tam)
+
+  # programs that read input have it beside them
+  string(REGEX REPLACE "\\.tam$" ".in" Input ${Program})
+  if(NOT EXISTS ${Input})
+    set(Input /dev/null)
+  endif()
+
+  execute_process(COMMAND ${TAM_OPT} ${Program} ${Optimized}
+    RESULT_VARIABLE Result)
+  if(NOT Result EQUAL 0)
+    message(SEND_ERROR "${Name}: tam-opt failed")
+    math(EXPR Failures "${Failures} + 1")
+    continue()
+  endif()
+
+  runProgram(Expected ${Program} ${Input})
+  runProgram(Actual ${Optimized} ${Input})
+  file(SIZE ${Program} ExpectedSize)
+  file(SIZE ${Optimized} ActualSize)
+  if(NOT ActualOut STREQUAL ExpectedOut OR
+     NOT ActualResult STREQUAL ExpectedResult)
+    message(SEND_ERROR "${Name}: optimised program behaves differently "
+      "(exit ${ActualResult}, expected ${ExpectedResult})")
+    math(EXPR Failures "${Failures} + 1")
+  elseif(ActualSize GREATER ExpectedSize OR
+         ActualSteps GREATER ExpectedSteps)
+    message(SEND_ERROR "${Name}: optimised program is bigger or slower "
+      "(${ActualSize} bytes, ${ActualSteps} instructions; was "
+      "${ExpectedSize} bytes, ${ExpectedSteps} instructions)")
+    math(EXPR Failures "${Failures} + 1")
+  else()
+    message(STATUS "${Name}: ok, ${ActualSteps} instructions, was "
+      "${ExpectedSteps}")
+  endif()
+endforeach()
+
+if(Failures)
+  message(FATAL_ERROR "${Failures} optimised programs differ")
+endif()
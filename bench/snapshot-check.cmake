@@ -0,0 +1,61 @@
+# Run every program in the given directories straight through, then again
+# stopped half way with `--save-snapshot` and carried on with
+# `--load-snapshot`, and check that both write the same output and exit
+# with the same code.
+#
+# Run by the `snapshot-check` target with TAM, PROGRAM_DIRS and WORK_DIR
+# set.
+
+set(Programs)
+foreach(Dir ${PROGRAM_DIRS})
+  file(GLOB DirPrograms ${Dir}/*.tam)
+  list(APPEND Programs ${DirPrograms})
+endforeach()
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+set(Failures 0)
+foreach(Program ${Programs})
+  get_filename_component(Dir ${Program} DIRECTORY)
+  get_filename_component(DirName ${Dir} NAME)
+  get_filename_component(Name ${Program} NAME_WE)
+  set(Name ${DirName}-${Name})
+  set(Snapshot ${WORK_DIR}/${Name}.snap)
+
+  # input is not part of a snapshot, so every run reads none
+  execute_process(COMMAND ${TAM} --stats ${Program} INPUT_FILE /dev/null
+    OUTPUT_VARIABLE ExpectedOut ERROR_VARIABLE Err
+    RESULT_VARIABLE ExpectedResult)
+  string(REGEX MATCH "instructions executed: ([0-9]+)" Match "${Err}")
+  math(EXPR After "${CMAKE_MATCH_1} / 2")
+  if(After EQUAL 0)
+    message(STATUS "${Name}: skipped, too short to stop half way")
+    continue()
+  endif()
+
+  file(REMOVE ${Snapshot})
+  execute_process(
+    COMMAND ${TAM} --save-snapshot ${Snapshot} --snapshot-after ${After}
+            ${Program}
+    INPUT_FILE /dev/null OUTPUT_VARIABLE FirstOut ERROR_QUIET)
+  if(NOT EXISTS ${Snapshot})
+    message(SEND_ERROR "${Name}: no snapshot after ${After} instructions")
+    math(EXPR Failures "${Failures} + 1")
+    continue()
+  endif()
+  execute_process(COMMAND ${TAM} --load-snapshot ${Snapshot}
+    INPUT_FILE /dev/null OUTPUT_VARIABLE SecondOut ERROR_QUIET
+    RESULT_VARIABLE ActualResult)
+
+  if(NOT "${FirstOut}${SecondOut}" STREQUAL ExpectedOut OR
+     NOT ActualResult STREQUAL ExpectedResult)
+    message(SEND_ERROR "${Name}: restored run behaves differently "
+      "(exit ${ActualResult}, expected ${ExpectedResult})")
+    math(EXPR Failures "${Failures} + 1")
+  else()
+    message(STATUS "${Name}: ok, restored after ${After} instructions")
+  endif()
+endforeach()
+
+if(Failures)
+  message(FATAL_ERROR "${Failures} restored programs differ")
+endif()
@@ -13,6 +13,12 @@ typedef enum TamError {
     ErrStackOverflow,
     ErrStackUnderflow,
     ErrUnrecognisedOpcode,
+    ErrStepLimit,
+    ErrDivisionByZero,
+    ErrFileWrite,
+    ErrNeedsInput,
+    ErrStepBudget,
+    ErrTimeout,
 } TamError;
 
 static const char *errorMessage(TamError Err) {
@@ -35,6 +41,18 @@ static const char *errorMessage(TamError Err) {
         return "stack underflow";
     case ErrUnrecognisedOpcode:
         return "unrecognised opcode";
+    case ErrStepLimit:
+        return "step limit reached";
+    case ErrDivisionByZero:
+        return "division by zero";
+    case ErrFileWrite:
+        return "there was a problem while writing the output file";
+    case ErrNeedsInput:
+        return "waiting for input";
+    case ErrStepBudget:
+        return "step budget exhausted";
+    case ErrTimeout:
+        return "time limit exceeded";
     }
 }
 
@@ -0,0 +1,135 @@
+#ifndef TAM_IO_H__
+#define TAM_IO_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/// Size of the buffers used for file descriptor and callback I/O.
+#define TAM_IO_BUFFER_SIZE 65536
+
+/// @brief Callback that supplies input to a program.
+/// @param Context pointer given to setInputCallback()
+/// @param[out] Buf buffer to fill
+/// @param Size size of `Buf`
+/// @return number of bytes read, 0 at end of input, or -1 on error
+typedef long (*TamReadFn)(void *Context, char *Buf, size_t Size);
+
+/// @brief Callback that receives output from a program.
+/// @param Context pointer given to setOutputCallback()
+/// @param Buf bytes written by the program
+/// @param Size number of bytes in `Buf`
+/// @return 0 on success, -1 on error
+typedef int (*TamWriteFn)(void *Context, const char *Buf, size_t Size);
+
+/// @brief A growable block of memory that collects program output.
+typedef struct TamBuffer {
+    char *Data;      ///< Output so far, not null-terminated
+    size_t Size;     ///< Number of bytes of output
+    size_t Capacity; ///< Number of bytes allocated
+} TamBuffer;
+
+/// @brief Where an I/O stream reads from or writes to.
+typedef enum TamIOKind {
+    TamIOFd,       ///< A file descriptor
+    TamIOMemory,   ///< A block of memory
+    TamIOCallback, ///< A user-supplied function
+    TamIOFeed,     ///< Bytes handed over by feedInput() as they arrive
+} TamIOKind;
+
+/// @brief Buffered input and output for the I/O primitives.
+///
+/// Every emulator owns one of these. By default it reads standard input and
+/// writes standard output through file descriptors 0 and 1. Output is
+/// buffered until the buffer fills, the program reads more input, or the
+/// program stops running.
+typedef struct TamIO {
+    TamIOKind InKind;     ///< Input backend
+    int InFd;             ///< Input file descriptor
+    TamReadFn Read;       ///< Input callback
+    void *ReadContext;    ///< Pointer passed to `Read`
+    const char *In;       ///< Buffered input
+    size_t InPos;         ///< Index of the next unread byte of `In`
+    size_t InLen;         ///< Number of bytes in `In`
+    int InEof;            ///< Set once the backend has no more input
+    char *InStore;        ///< Buffer behind `In` for fds, callbacks and feeds
+    size_t InCapacity;    ///< Number of bytes allocated for `InStore`
+    /// Flag that, once set, stops any further reads, so that a wait for
+    /// input interrupted by a signal is not resumed; or null
+    const atomic_int *Stop;
+    int InStopped;        ///< Set when `Stop` has ended a wait for input
+    TamIOKind OutKind;    ///< Output backend
+    int OutFd;            ///< Output file descriptor
+    TamWriteFn Write;     ///< Output callback
+    void *WriteContext;   ///< Pointer passed to `Write`
+    TamBuffer *OutMemory; ///< Output buffer for the memory backend
+    char *Out;            ///< Pending output
+    size_t OutLen;        ///< Number of bytes in `Out`
+} TamIO;
+
+/// @brief Read program input from a file descriptor.
+/// @param[in,out] IO stream to configure
+/// @param Fd descriptor to read, which stays owned by the caller
+void setInputFd(TamIO *IO, int Fd);
+
+/// @brief Read program input from memory.
+/// @param[in,out] IO stream to configure
+/// @param Data input bytes, which must outlive any run that reads them
+/// @param Size number of bytes of input
+void setInputMemory(TamIO *IO, const char *Data, size_t Size);
+
+/// @brief Read program input through a callback.
+/// @param[in,out] IO stream to configure
+/// @param Read function to call whenever the input buffer is empty
+/// @param Context pointer to pass to `Read`
+void setInputCallback(TamIO *IO, TamReadFn Read, void *Context);
+
+/// @brief Read program input from bytes handed over by feedInput().
+///
+/// Nothing ever waits for input. When a program reaches `get`, `getint`,
+/// `eol`, `eof` or `geteol` without enough input fed to finish it, the run
+/// stops with `ErrNeedsInput` before the primitive, and carries on from
+/// there when run again once more has been fed. Enough means a byte for
+/// `get`, `eol` and `eof`, a newline for `geteol`, and for `getint` the
+/// character after the number. endInput() says no more is coming, after
+/// which a program sees the end of the input as it would from a file.
+/// @param[in,out] IO stream to configure
+void setInputFeed(TamIO *IO);
+
+/// @brief Add bytes to the end of the input of a stream set up by
+/// setInputFeed().
+/// @param[in,out] IO stream to feed
+/// @param Data bytes to add, which are copied
+/// @param Size number of bytes in `Data`
+/// @return 0 on success, -1 if the buffer could not grow to hold them
+int feedInput(TamIO *IO, const char *Data, size_t Size);
+
+/// @brief Mark the end of the input of a stream set up by setInputFeed().
+/// @param[in,out] IO stream with no more input to come
+void endInput(TamIO *IO);
+
+/// @brief Write program output to a file descriptor.
+/// @param[in,out] IO stream to configure
+/// @param Fd descriptor to write, which stays owned by the caller
+void setOutputFd(TamIO *IO, int Fd);
+
+/// @brief Append program output to a growable buffer.
+/// @param[in,out] IO stream to configure
+/// @param Buffer buffer to append to; the caller frees `Buffer->Data`
+void setOutputMemory(TamIO *IO, TamBuffer *Buffer);
+
+/// @brief Write program output through a callback.
+/// @param[in,out] IO stream to configure
+/// @param Write function to call with each block of output
+/// @param Context pointer to pass to `Write`
+void setOutputCallback(TamIO *IO, TamWriteFn Write, void *Context);
+
+/// @brief Hand any buffered output to the output backend.
+/// @param[in,out] IO stream to flush
+/// @return 0 on success, -1 if the backend reported an error
+int flushOutput(TamIO *IO);
+
+/// @brief Release the buffers held by a stream, flushing it first.
+/// @param[in,out] IO stream to release
+void closeIO(TamIO *IO);
+
+#endif
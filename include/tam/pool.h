@@ -0,0 +1,37 @@
+#ifndef TAM_POOL_H__
+#define TAM_POOL_H__
+
+#include <tam/tam.h>
+
+/// @brief A set of idle emulators kept for reuse.
+///
+/// Allocating and zeroing a fresh emulator costs far more than running a
+/// short program. A pool hands out emulators that have already been reset,
+/// clearing only the memory their last program used. Pools may be shared
+/// between threads.
+typedef struct TamPool TamPool;
+
+/// @brief Create an empty pool.
+/// @param MaxIdle most emulators to keep while they are not in use; any
+/// more that are released are freed
+/// @return pointer to the pool, or null if allocation failed
+TamPool *newPool(int MaxIdle);
+
+/// @brief Free a pool and every idle emulator in it. Emulators still
+/// acquired from the pool must be freed with freeEmulator() instead.
+/// @param Pool pool to free, may be null
+void freePool(TamPool *Pool);
+
+/// @brief Take an emulator from the pool, creating one if none is idle.
+///
+/// The emulator is in the same state as one from newEmulator().
+/// @param[in,out] Pool pool to take from
+/// @return pointer to the emulator, or null if allocation failed
+TamEmulator *acquireEmulator(TamPool *Pool);
+
+/// @brief Reset an emulator with resetEmulator() and return it to the pool.
+/// @param[in,out] Pool pool the emulator came from
+/// @param Emulator emulator to return, may be null
+void releaseEmulator(TamPool *Pool, TamEmulator *Emulator);
+
+#endif
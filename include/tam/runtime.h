@@ -0,0 +1,105 @@
+#ifndef TAM_RUNTIME_H__
+#define TAM_RUNTIME_H__
+
+#include <tam/io.h>
+#include <tam/tam.h>
+
+/// @file
+/// Pieces of the emulator shared with programs translated to C by
+/// `tam --emit-c`, so that both behave identically.
+
+/// @brief Check that a run of words lies entirely outside the free space
+/// between the stack and the heap.
+///
+/// A run that would wrap around the top of memory is never accessible.
+/// @param Base address of the first word
+/// @param N number of words
+/// @param St current value of ST
+/// @param Ht current value of HT
+/// @return 1 if every word may be read or written, 0 otherwise
+static inline int rangeAccessible(ADDRESS Base, int N, ADDRESS St, ADDRESS Ht) {
+    int64_t End = (int64_t)Base + N;
+    if (N <= 0) {
+        return 1;
+    }
+    if (End > MEMORY_SIZE) {
+        return 0;
+    }
+    return End <= St || Base > Ht;
+}
+
+/// @brief The `eol` primitive.
+/// @param[in,out] IO stream to read from
+/// @return 1 if the next input character is a newline, 0 otherwise
+DATA_W primitiveEol(TamIO *IO);
+
+/// @brief The `eof` primitive.
+/// @param[in,out] IO stream to read from
+/// @return 1 if the input is exhausted, 0 otherwise
+DATA_W primitiveEof(TamIO *IO);
+
+/// @brief The `get` primitive, without its store to memory.
+/// @param[in,out] IO stream to read from
+/// @return the next input character as a signed byte, or -1 at end of input
+DATA_W primitiveGet(TamIO *IO);
+
+/// @brief The `geteol` primitive: skip input up to and including the next
+/// newline.
+/// @param[in,out] IO stream to read from
+void primitiveGetEol(TamIO *IO);
+
+/// @brief The `getint` primitive, without its store to memory.
+/// @param[in,out] IO stream to read from
+/// @return the integer read
+DATA_W primitiveGetInt(TamIO *IO);
+
+/// @brief The `put` primitive.
+/// @param[in,out] IO stream to write to
+/// @param C character to write, of which the low byte is written
+void primitivePut(TamIO *IO, DATA_W C);
+
+/// @brief The `putint` primitive.
+/// @param[in,out] IO stream to write to
+/// @param Value integer to write
+void primitivePutInt(TamIO *IO, DATA_W Value);
+
+/// @brief The `new` primitive: allocate a heap object.
+///
+/// The object's block comes off the free list of its size class if there
+/// is one there, and otherwise from the free space below the heap. A block
+/// taken from a free list still holds whatever was in it.
+/// @param[in,out] Heap state of the heap
+/// @param[in] Mem data store holding the heap
+/// @param St current value of ST
+/// @param[in,out] Ht HT, lowered if the heap has to grow
+/// @param Size number of words wanted; an object of no words is given the
+/// address just above HT and takes no space
+/// @param[out] Addr receives the address of the object
+/// @return 0 on success, `ErrStackOverflow` if the heap would run into the
+/// stack
+int primitiveNew(TamHeap *Heap, const DATA_W *Mem, ADDRESS St, ADDRESS *Ht,
+                 DATA_W Size, ADDRESS *Addr);
+
+/// @brief The `dispose` primitive: free a heap object allocated by
+/// primitiveNew().
+///
+/// Disposing of an object twice, or with the wrong size, is not detected,
+/// but can only ever corrupt the heap: blocks on a free list that are found
+/// to be outside it are dropped instead of being handed out.
+/// @param[in,out] Heap state of the heap
+/// @param[out] Mem data store holding the heap
+/// @param[in,out] Ht HT, raised if the object was the lowest on the heap
+/// @param Size number of words in the object, as given to primitiveNew()
+/// @param Addr address of the object
+/// @return 0 on success, `ErrDataAccessViolation` if the object is not
+/// inside the heap
+int primitiveDispose(TamHeap *Heap, DATA_W *Mem, ADDRESS *Ht, DATA_W Size,
+                     ADDRESS Addr);
+
+/// @brief Report an error that stopped a program on standard error, as the
+/// `tam` executable does.
+/// @param ErrCode the error
+/// @param Cp address the error is reported at
+void reportError(int ErrCode, ADDRESS Cp);
+
+#endif
@@ -1,30 +1,210 @@
 #ifndef TAM_TAM_H__
 #define TAM_TAM_H__
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <tam/io.h>
 
-/// Maximum number of addressable words.
-#define MEMORY_SIZE 65536
+/// Width of data words and addresses in bits, fixed when the emulator is
+/// built: 16 as the TAM defines it, or 32 for larger programs.
+#ifndef TAM_WORD_BITS
+#define TAM_WORD_BITS 16
+#endif
 
+/// Maximum number of instructions in a program.
+#define CODE_SIZE 65536
 /// Type of words in the code store.
 #define CODE_W uint32_t
+
+#if TAM_WORD_BITS == 16
+/// Maximum number of addressable words.
+#define MEMORY_SIZE 65536
 /// Type of words in the data store.
 #define DATA_W int16_t
 /// Type of addresses.
 #define ADDRESS uint16_t
+/// Signed type that holds the exact result of arithmetic on two words.
+#define WIDE_W int
+#elif TAM_WORD_BITS == 32
+// every address is inside the data store, as with 16-bit words, so address
+// arithmetic wraps round the store instead of leaving it
+#define MEMORY_SIZE (INT64_C(1) << 32)
+#define DATA_W int32_t
+#define ADDRESS uint32_t
+#define WIDE_W int64_t
+#else
+#error "TAM_WORD_BITS must be 16 or 32"
+#endif
+
+struct Instruction;
+
+/// @brief Native code compiled from a program by runEmulatorJit().
+typedef struct TamJit TamJit;
+
+/// @brief Register code translated from a program by runEmulatorIR().
+typedef struct TamIR TamIR;
+
+/// @brief Basic blocks of a program found by runEmulator() as it runs.
+typedef struct TamBlockCache TamBlockCache;
+
+/// @brief A loaded program, shared read-only by any number of emulators.
+///
+/// Images are reference counted. Each emulator running an image holds a
+/// reference, and the image is freed when the last reference is released.
+/// Nothing in an image changes after it is loaded, so emulators on different
+/// threads may run the same image at once.
+typedef struct TamProgram {
+    atomic_int Refs;                ///< Number of references held
+    int Size;                       ///< Number of instructions
+    const CODE_W *CodeStore;        ///< The instructions as loaded
+    const struct Instruction *Code; ///< Predecoded copy of `CodeStore`
+    const int32_t *Depth; ///< ST - LB at each instruction, where proved
+} TamProgram;
+
+/// @brief Release a reference to a program image, freeing it if that was
+/// the last one.
+/// @param Program image to release, may be null
+void releaseProgram(TamProgram *Program);
+
+/// Number of heap size classes holding a single size each, 1 to this.
+#define HEAP_EXACT_CLASSES 16
+/// Number of heap size classes. Above HEAP_EXACT_CLASSES, each power of two
+/// is split into four classes, so a block is never more than a quarter
+/// bigger than the object it holds.
+#define HEAP_CLASSES (HEAP_EXACT_CLASSES + 4 * (TAM_WORD_BITS - 5))
+
+/// @brief State of the heap behind the `new` and `dispose` primitives.
+///
+/// Objects are carved off downwards from HB by lowering HT, in blocks of the
+/// size of their class. A disposed block goes on the free list of its
+/// class, linked through its first word, unless it is the lowest on the
+/// heap, in which case HT rises back over it. Both take constant time.
+typedef struct TamHeap {
+    ADDRESS Free[HEAP_CLASSES];       ///< First free block of each class, or 0
+    uint32_t FreeCount[HEAP_CLASSES]; ///< Number of blocks on each free list
+    uint64_t LiveWords;   ///< Words in blocks allocated and not yet disposed
+    uint64_t PeakWords;   ///< Highest `LiveWords` has been
+    uint64_t Allocations; ///< Number of successful `new`s
+    uint64_t Disposals;   ///< Number of successful `dispose`s
+} TamHeap;
+
+/// @brief Find the size class of a heap object.
+/// @param Size number of words in the object, at least 1
+/// @return its class, below HEAP_CLASSES
+static inline int heapClass(uint32_t Size) {
+    if (Size <= HEAP_EXACT_CLASSES) {
+        return Size - 1;
+    }
+    // 2^K < Size <= 2^(K+1), and the class is one of the four steps of
+    // 2^(K-2) that fill that range
+    int K = 31 - __builtin_clz(Size - 1);
+    int Step = (Size - 1) >> (K - 2);
+    return HEAP_EXACT_CLASSES + 4 * (K - 4) + (Step - 4);
+}
+
+/// @brief Find the number of words in the blocks of a heap size class.
+/// @param Class a class returned by heapClass()
+/// @return the size of every block in the class
+static inline uint32_t heapClassSize(int Class) {
+    if (Class < HEAP_EXACT_CLASSES) {
+        return Class + 1;
+    }
+    int K = (Class - HEAP_EXACT_CLASSES) / 4 + 4;
+    int Step = (Class - HEAP_EXACT_CLASSES) % 4 + 5;
+    return (uint32_t)Step << (K - 2);
+}
 
 /// @brief A single TAM emulator.
 typedef struct TamEmulator {
-    CODE_W CodeStore[MEMORY_SIZE]; ///< Contains the program to execute
+#if TAM_WORD_BITS == 16
     DATA_W DataStore[MEMORY_SIZE]; ///< Contains the stack and global variables
+#else
+    /// Contains the stack and global variables, in memory reserved by
+    /// reserveDataStore()
+    DATA_W *DataStore;
+#endif
     ADDRESS Registers[16];         ///< Contains register values
+    TamProgram *Program;           ///< Program being run, if any
+    /// Shortcut to `Program->Code`
+    const struct Instruction *Code;
+    uint64_t Steps;                ///< Instructions executed since loading
+    uint64_t Fused; ///< Of those, how many ran inside a superinstruction
+    TamIO IO;       ///< Input and output for the I/O primitives
+    ADDRESS StHigh; ///< Highest ST may have reached since memory was cleared
+    ADDRESS HtLow;  ///< Lowest HT may have reached since memory was cleared
+    TamHeap Heap;   ///< Free lists and counts for `new` and `dispose`
+    /// Most instructions the program may execute in all, counting every run
+    /// since it was loaded, or 0 for no limit
+    uint64_t StepBudget;
+    /// Set, from a timer's signal handler or another thread, to stop the
+    /// program with `ErrTimeout` at its next backward branch, call or
+    /// return, or at an input primitive once a signal interrupts its wait
+    /// for input; it stays set until cleared, which attachProgram() and
+    /// resetEmulator() also do
+    atomic_int TimeUp;
+    TamJit *Jit;    ///< Code compiled from `Program`, if any
+    TamIR *IR;      ///< Register code translated from `Program`, if any
+    /// Blocks of `Program` found so far, if any
+    TamBlockCache *Blocks;
 } TamEmulator;
 
-/// Allocate a new emulator with all memory zeroed.
-/// @return pointer to the emulator
+#if TAM_WORD_BITS != 16
+/// @brief Reserve address space for a data store without committing any
+/// memory to it. Pages are committed, zeroed, as they are first touched.
+/// @return the store, or null if the address space could not be reserved
+DATA_W *reserveDataStore(void);
+
+/// @brief Release a data store reserved by reserveDataStore().
+/// @param Store store to release, may be null
+void releaseDataStore(DATA_W *Store);
+#endif
+
+/// Allocate a new emulator with all memory zeroed, reading standard input
+/// and writing standard output.
+/// @return pointer to the emulator, or null if allocation failed
 static TamEmulator *newEmulator() {
-    return (TamEmulator *)calloc(1, sizeof(TamEmulator));
+    TamEmulator *Emulator = (TamEmulator *)calloc(1, sizeof(TamEmulator));
+#if TAM_WORD_BITS != 16
+    if (Emulator && !(Emulator->DataStore = reserveDataStore())) {
+        free(Emulator);
+        return NULL;
+    }
+#endif
+    if (Emulator) {
+        Emulator->IO.OutFd = 1;
+        Emulator->IO.Stop = &Emulator->TimeUp;
+        Emulator->HtLow = MEMORY_SIZE - 1;
+    }
+    return Emulator;
+}
+
+/// @brief Free code compiled by runEmulatorJit().
+/// @param Jit compiled code to free, may be null
+void freeJit(TamJit *Jit);
+
+/// @brief Free register code translated by runEmulatorIR().
+/// @param IR translated code to free, may be null
+void freeIR(TamIR *IR);
+
+/// @brief Free the blocks found by runEmulator().
+/// @param Cache blocks to free, may be null
+void freeBlockCache(TamBlockCache *Cache);
+
+/// Free an emulator and release its program, flushing its output.
+/// @param Emulator emulator to free, may be null
+static void freeEmulator(TamEmulator *Emulator) {
+    if (Emulator) {
+        closeIO(&Emulator->IO);
+        releaseProgram(Emulator->Program);
+        freeJit(Emulator->Jit);
+        freeIR(Emulator->IR);
+        freeBlockCache(Emulator->Blocks);
+#if TAM_WORD_BITS != 16
+        releaseDataStore(Emulator->DataStore);
+#endif
+    }
+    free(Emulator);
 }
 
 typedef enum Opcode {
@@ -64,21 +244,118 @@ typedef enum Register {
     CP  ///< Code pointer (program counter)
 } Register;
 
-/// @brief A single 32-bit instruction.
+/// @brief A single decoded 32-bit instruction.
+///
+/// Instructions are decoded once when a program is loaded. Where the base
+/// register of an address operand cannot change while the program runs, the
+/// effective address is resolved at the same time and stored in `Target`.
 typedef struct Instruction {
-    Opcode Op;  ///< Opcode
-    Register R; ///< Register
-    uint8_t N;  ///< Unsigned operand
-    int16_t D;  ///< Signed operand
+    uint8_t Op;      ///< Opcode
+    uint8_t R;       ///< Register
+    uint8_t N;       ///< Unsigned operand
+    uint8_t Handler; ///< Interpreter routine chosen by runEmulator()
+    int16_t D;       ///< Signed operand
+    ADDRESS Target;  ///< Resolved address, if `R` is a static register
 } Instruction;
 
-/// @brief Read a TAM binary into an emulator's code store.
+/// @brief Check whether a register may change while a program runs.
+/// @param R register to check
+/// @return 1 if addresses relative to `R` must be computed at run time
+static inline int isDynamicRegister(Register R) {
+    return R == ST || R == HT || R == LB;
+}
+
+/// @brief Read and decode a TAM binary into a new program image.
+/// @param[in] Filename name of file to read from
+/// @param[out] Program receives the image, holding one reference to it
+/// @return 0 if loading succeeded, otherwise the error that stopped it
+int loadProgramImage(const char *Filename, TamProgram **Program);
+
+/// @brief Decode a TAM binary that is already in memory, as
+/// loadProgramImage().
+/// @param[in] Data contents of the binary, big-endian words
+/// @param Size length of `Data` in bytes
+/// @param[out] Program receives the image, holding one reference to it
+/// @return 0 if loading succeeded, otherwise the error that stopped it
+int loadProgramImageFromMemory(const void *Data, size_t Size,
+                               TamProgram **Program);
+
+/// @brief Take another reference to a program image.
+/// @param Program image to retain
+/// @return `Program`
+TamProgram *retainProgram(TamProgram *Program);
+
+/// @brief Reset an emulator's memory and registers and point it at a
+/// program image, ready to run it from the start.
+///
+/// The emulator takes its own reference to the image and drops the one to
+/// its previous program, if any. `TimeUp` is cleared, so a timer for the
+/// new run must be started after this, while `StepBudget` is kept.
+/// @param[in,out] Emulator emulator to prepare
+/// @param Program image to run
+void attachProgram(TamEmulator *Emulator, TamProgram *Program);
+
+/// @brief Read a TAM binary and attach it to an emulator.
 /// @param[in,out] Emulator emulator to load
 /// @param[in] Filename name of file to read from
-/// @return 0 if loading failed, 1 otherwise
+/// @return 0 if loading succeeded, otherwise the error that stopped it
 int loadProgram(TamEmulator *Emulator, const char *Filename);
 
-/// @brief Fetch and decode the next instruction to be executed.
+/// @brief Return an emulator to the state newEmulator() leaves it in.
+///
+/// Only the parts of memory that the last program could have written are
+/// cleared, so this is cheap after a short run. The emulator's program is
+/// released, input and output go back to standard input and output, and
+/// `StepBudget` and `TimeUp` are cleared. Any I/O buffers the emulator
+/// holds are kept for the next program.
+/// @param[in,out] Emulator emulator to reset
+void resetEmulator(TamEmulator *Emulator);
+
+/// @brief Load a TAM binary that is already in memory, as loadProgram().
+/// @param[in,out] Emulator emulator to load
+/// @param[in] Data contents of the binary, big-endian words
+/// @param Size length of `Data` in bytes
+/// @return 0 if loading succeeded, otherwise the error that stopped it
+int loadProgramFromMemory(TamEmulator *Emulator, const void *Data,
+                          size_t Size);
+
+/// @brief Save the state of an emulator to a file, to be picked up later by
+/// loadSnapshot().
+///
+/// Only the state the program can still see is saved: the registers, the
+/// program, the data store below the highest ST and above the lowest HT it
+/// has reached, the heap's free lists and the step counts. The words just
+/// above ST are kept because `PUSH` can move ST back over them without
+/// writing them. The
+/// emulator's I/O is not part of a snapshot, so any output still buffered
+/// should be flushed first and any input already buffered is not carried
+/// over. Snapshots are only read back by emulators built with the same word
+/// size and byte order.
+/// @param[in] Emulator emulator with a program attached
+/// @param[in] Filename name of file to write to
+/// @return 0 if the snapshot was written, otherwise `ErrFileWrite`
+int saveSnapshot(const TamEmulator *Emulator, const char *Filename);
+
+/// @brief Restore an emulator to the state saved by saveSnapshot(), ready
+/// for runEmulator() to carry on from where the saved emulator stopped.
+///
+/// If the emulator already has the snapshot's program attached, its image
+/// is kept rather than decoded again, along with anything compiled from it.
+/// The emulator's I/O is left as it is.
+/// @param[in,out] Emulator emulator to restore
+/// @param[in] Filename name of file to read from
+/// @return 0 if restoring succeeded, otherwise the error that stopped it
+int loadSnapshot(TamEmulator *Emulator, const char *Filename);
+
+/// @brief Restore a snapshot that is already in memory, as loadSnapshot().
+/// @param[in,out] Emulator emulator to restore
+/// @param[in] Data contents of the snapshot file
+/// @param Size length of `Data` in bytes
+/// @return 0 if restoring succeeded, otherwise the error that stopped it
+int loadSnapshotFromMemory(TamEmulator *Emulator, const void *Data,
+                           size_t Size);
+
+/// @brief Fetch the next predecoded instruction to be executed.
 /// @param[in,out] Emulator emulator to use
 /// @param[out] Instr pointer to receive the decoded instruction
 /// @return 0 if there was an error, 1 otherwise
@@ -90,4 +367,106 @@ int fetchDecode(TamEmulator *Emulator, Instruction *Instr);
 /// @return 0 if there was an error, 1 otherwise
 int execute(TamEmulator *Emulator, Instruction Instr);
 
+/// @brief Run a loaded program until it halts, fails or uses up its steps.
+///
+/// On failure the CP register holds the address to report: the faulting
+/// instruction, or the out-of-range address that could not be fetched.
+///
+/// A run that stops with `ErrStepLimit` or `ErrNeedsInput` can be carried on
+/// by calling this again; everything it needs is kept in the emulator. The
+/// second only comes from input set up by setInputFeed(), and leaves CP at
+/// the input primitive, not yet run or counted, for after feedInput().
+///
+/// `MaxSteps` only limits this run, while the emulator's `StepBudget` limits
+/// every run of its program, and running out of it is `ErrStepBudget`
+/// instead. Either way the count of steps is exact. Steps are counted a
+/// basic block at a time and `TimeUp` is only looked at where control goes
+/// backward or to a call or return, so neither costs anything per
+/// instruction. A program stopped with `ErrTimeout` has CP at the next
+/// instruction it would run.
+/// @param[in,out] Emulator emulator to run
+/// @param MaxSteps maximum number of instructions to execute, 0 for no limit
+/// @return 0 if the program halted, `ErrStepLimit` if it ran out of steps,
+/// `ErrNeedsInput` if it is waiting for input, `ErrStepBudget` or
+/// `ErrTimeout` if it used up its budget or time, otherwise the error that
+/// stopped it
+int runEmulator(TamEmulator *Emulator, uint64_t MaxSteps);
+
+/// @brief Run a loaded program like runEmulator(), compiling the parts of it
+/// that run most often to native code.
+///
+/// Results are exactly those of runEmulator(), including the error and CP
+/// reported on failure, the step count and the contents of the data store.
+/// Compiled code is kept with the emulator and reused by later runs of the
+/// same program, until another program is attached. Where the emulator was
+/// built without a compiler for the host, this is runEmulator().
+/// @param[in,out] Emulator emulator to run
+/// @param MaxSteps maximum number of instructions to execute, 0 for no limit
+/// @return as for runEmulator()
+int runEmulatorJit(TamEmulator *Emulator, uint64_t MaxSteps);
+
+/// @brief Run a loaded program like runEmulator(), translating each basic
+/// block into code for a register machine the first time it is reached.
+///
+/// Values on the stack are kept in virtual registers within a block and
+/// only written to the data store when it ends, so most pushes and pops are
+/// never made. Results are exactly those of runEmulator(), including the
+/// error and CP reported on failure, the step count and the contents of the
+/// data store. Translated code is kept with the emulator until another
+/// program is attached.
+/// @param[in,out] Emulator emulator to run
+/// @param MaxSteps maximum number of instructions to execute, 0 for no limit
+/// @return as for runEmulator()
+int runEmulatorIR(TamEmulator *Emulator, uint64_t MaxSteps);
+
+/// @brief Callback invoked by runEmulatorTraced() before each instruction.
+/// @param Context pointer passed through from runEmulatorTraced()
+/// @param Emulator emulator about to execute the instruction
+/// @param Addr address of the instruction
+/// @param Instr the instruction
+typedef void (*TamTraceFn)(void *Context, const TamEmulator *Emulator,
+                           ADDRESS Addr, Instruction Instr);
+
+/// @brief Run a loaded program like runEmulator(), reporting every
+/// instruction to a callback. This is much slower than runEmulator().
+///
+/// Program output is buffered as usual. A callback that writes somewhere
+/// the output also goes, and wants the two in order, should call
+/// flushOutput() on the emulator's I/O first.
+/// @param[in,out] Emulator emulator to run
+/// @param MaxSteps maximum number of instructions to execute, 0 for no limit
+/// @param Trace callback to invoke before each instruction
+/// @param Context pointer to pass to `Trace`
+/// @return as for runEmulator()
+int runEmulatorTraced(TamEmulator *Emulator, uint64_t MaxSteps,
+                      TamTraceFn Trace, void *Context);
+
+/// @brief What runEmulatorProfiled() counts, and where it reports calls and
+/// returns.
+///
+/// Both callbacks are given the number of instructions executed since the
+/// program was loaded, up to and including the CALL or RETURN.
+typedef struct TamProfiler {
+    uint64_t *Counts; ///< Executions of each instruction, added to
+    void *Context;    ///< Pointer passed to the callbacks
+    /// Called once a CALL has entered a routine at `Routine`, whose frame is
+    /// at `Lb`; primitives are not reported
+    void (*Call)(void *Context, uint64_t Steps, ADDRESS Routine, ADDRESS Lb);
+    /// Called as a RETURN leaves the frame at `Lb`
+    void (*Return)(void *Context, uint64_t Steps, ADDRESS Lb);
+} TamProfiler;
+
+/// @brief Run a loaded program like runEmulator(), counting how often each
+/// instruction executes and reporting every call and return.
+///
+/// Instructions are counted a basic block at a time, as the interpreter
+/// enters each block, so this runs at close to the speed of runEmulator().
+/// @param[in,out] Emulator emulator to run
+/// @param MaxSteps maximum number of instructions to execute, 0 for no limit
+/// @param[in,out] Profiler counts to add to, with one entry for each
+/// instruction of the program, and the callbacks to make
+/// @return as for runEmulator(), or -1 if memory ran out before the start
+int runEmulatorProfiled(TamEmulator *Emulator, uint64_t MaxSteps,
+                        TamProfiler *Profiler);
+
 #endif
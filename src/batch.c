@@ -0,0 +1,540 @@
+#include "batch.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tam/error.h>
+#include <tam/tam.h>
+#include <time.h>
+
+/// How a job ended.
+typedef enum JobStatus {
+    JobOk,    ///< Halted, with no expected output to check
+    JobPass,  ///< Halted with the expected output
+    JobFail,  ///< Halted with some other output
+    JobError, ///< Could not be run, or stopped with an error
+} JobStatus;
+
+/// A single program run listed in a job file.
+typedef struct Job {
+    char *Label;       ///< The job as written in the job file
+    char *Program;     ///< Path of the program
+    char *Input;       ///< Path of the input file, or null
+    char *Expected;    ///< Path of the expected output, or null
+    TamProgram *Image; ///< Loaded program, shared with other jobs
+    int LoadError;     ///< Error from loading the program, if any
+
+    JobStatus Status;    ///< Outcome of the job
+    int ErrCode;         ///< Error that stopped the job, if any
+    const char *Problem; ///< What the error was about, if not the run
+    ADDRESS Loc;         ///< Location of a run-time error
+    uint64_t Steps;      ///< Instructions executed
+    double Seconds;      ///< Time spent running the program
+} Job;
+
+struct Batch;
+
+/// @brief A thread running jobs.
+///
+/// Every worker starts with an equal share of the jobs. It works through its
+/// own share from the front and, once that runs out, takes jobs one at a
+/// time from the back of other workers' shares.
+typedef struct Worker {
+    pthread_mutex_t Lock; ///< Guards `Next`, `End` and `Deadline`
+    int Next;             ///< First job still queued
+    int End;              ///< One past the last job still queued
+    /// When the job being run is stopped by the watchdog, or 0 if no job is
+    /// running or there is no time limit
+    double Deadline;
+    struct Batch *Batch;  ///< Batch the worker belongs to
+    TamEmulator *Emulator;
+    TamBuffer Output; ///< Output of the job being run
+    pthread_t Thread;
+    int Started; ///< Set once `Thread` is running
+} Worker;
+
+/// @brief Everything a batch run shares between its workers.
+typedef struct Batch {
+    Job *Jobs;
+    int NumJobs;
+    Worker *Workers;
+    int NumWorkers;
+    double Timeout; ///< Seconds each job may run for, or 0 for no limit
+
+    pthread_mutex_t Lock;    ///< Guards `Done`
+    pthread_cond_t Finished; ///< Signalled when `Done` is set
+    int Done;                ///< Set once every job has run
+} Batch;
+
+/// How often, in seconds, the watchdog looks for jobs past their deadline.
+#define WATCHDOG_PERIOD 0.01
+
+/// Current value of the monotonic clock in seconds.
+static double now(void) {
+    struct timespec Ts;
+    clock_gettime(CLOCK_MONOTONIC, &Ts);
+    return Ts.tv_sec + Ts.tv_nsec * 1e-9;
+}
+
+/// @brief Read a whole file into memory.
+/// @param Path file to read
+/// @param[out] Data receives the contents followed by a null byte, to be
+/// freed by the caller
+/// @param[out] Size receives the length of the contents
+/// @return 0 on success, otherwise the error that stopped it
+static int readFile(const char *Path, char **Data, size_t *Size) {
+    FILE *File = fopen(Path, "rb");
+    if (!File) {
+        return ErrFileNotFound;
+    }
+
+    size_t Capacity = 4096, Length = 0;
+    char *Buf = malloc(Capacity);
+    for (;;) {
+        if (!Buf) {
+            fclose(File);
+            return ErrFileRead;
+        }
+        Length += fread(Buf + Length, 1, Capacity - Length, File);
+        if (Length < Capacity) {
+            break;
+        }
+        Capacity *= 2;
+        char *Bigger = realloc(Buf, Capacity);
+        if (!Bigger) {
+            free(Buf);
+        }
+        Buf = Bigger;
+    }
+
+    int Failed = ferror(File);
+    fclose(File);
+    if (Failed) {
+        free(Buf);
+        return ErrFileRead;
+    }
+    Buf[Length] = '\0';
+    *Data = Buf;
+    *Size = Length;
+    return OK;
+}
+
+/// Check whether a job file field names a file, rather than being absent or
+/// `-` for none.
+static int isPath(const char *Field) {
+    return Field && strcmp(Field, "-") != 0;
+}
+
+/// @brief Turn a path from the job file into one usable from here.
+/// @param Dir directory of the job file, ending in `/`, or empty
+/// @param Path path as written in the job file, or `-` for none
+/// @return newly allocated path, or null for `-` or if memory ran out
+static char *resolvePath(const char *Dir, const char *Path) {
+    if (!isPath(Path)) {
+        return NULL;
+    }
+
+    size_t DirLen = Path[0] == '/' ? 0 : strlen(Dir);
+    size_t PathLen = strlen(Path);
+    char *Resolved = malloc(DirLen + PathLen + 1);
+    if (Resolved) {
+        memcpy(Resolved, Dir, DirLen);
+        memcpy(Resolved + DirLen, Path, PathLen + 1);
+    }
+    return Resolved;
+}
+
+/// @brief Free the jobs of a batch and what they hold.
+/// @param[in,out] Batch batch whose jobs to free
+static void freeJobs(Batch *Batch) {
+    for (int i = 0; i < Batch->NumJobs; ++i) {
+        Job *J = &Batch->Jobs[i];
+        releaseProgram(J->Image);
+        free(J->Label);
+        free(J->Program);
+        free(J->Input);
+        free(J->Expected);
+    }
+    free(Batch->Jobs);
+    Batch->Jobs = NULL;
+    Batch->NumJobs = 0;
+}
+
+/// @brief Free the workers of a batch and what they hold.
+/// @param[in,out] Batch batch whose workers to free, all of which must have
+/// finished
+static void freeWorkers(Batch *Batch) {
+    for (int i = 0; i < Batch->NumWorkers; ++i) {
+        Worker *W = &Batch->Workers[i];
+        freeEmulator(W->Emulator);
+        free(W->Output.Data);
+        pthread_mutex_destroy(&W->Lock);
+    }
+    free(Batch->Workers);
+    Batch->Workers = NULL;
+    Batch->NumWorkers = 0;
+}
+
+/// @brief Read the jobs listed in a job file.
+/// @param JobFile name of the job file
+/// @param[out] Batch receives the jobs
+/// @return 0 on success, -1 after printing a message otherwise
+static int readJobs(const char *JobFile, Batch *Batch) {
+    char *Text;
+    size_t Size;
+    int ErrCode = readFile(JobFile, &Text, &Size);
+    if (ErrCode) {
+        fprintf(stderr, "%s: %s\n", JobFile, errorMessage(ErrCode));
+        return -1;
+    }
+
+    char *Dir = strdup(JobFile);
+    if (!Dir) {
+        fprintf(stderr, "out of memory\n");
+        free(Text);
+        return -1;
+    }
+    char *Slash = strrchr(Dir, '/');
+    Dir[Slash ? Slash - Dir + 1 : 0] = '\0';
+
+    int Capacity = 0, Failed = 0;
+    char *Line = Text;
+    for (int LineNo = 1; Line < Text + Size; ++LineNo) {
+        char *Newline = memchr(Line, '\n', Text + Size - Line);
+        char *Next = Newline ? Newline + 1 : Text + Size;
+        if (Newline) {
+            *Newline = '\0';
+        }
+
+        char *Save;
+        char *Fields[4] = {strtok_r(Line, " \t\r", &Save)};
+        Line = Next;
+        if (!Fields[0] || Fields[0][0] == '#') {
+            continue;
+        }
+        for (int i = 1; i < 4 && Fields[i - 1]; ++i) {
+            Fields[i] = strtok_r(NULL, " \t\r", &Save);
+        }
+        if (Fields[3] || !isPath(Fields[0])) {
+            fprintf(stderr, "%s:%d: %s\n", JobFile, LineNo,
+                    Fields[3] ? "too many fields" : "missing program");
+            Failed = 1;
+            break;
+        }
+
+        if (Batch->NumJobs == Capacity) {
+            int Bigger = Capacity ? 2 * Capacity : 64;
+            Job *Jobs = realloc(Batch->Jobs, Bigger * sizeof(Job));
+            if (!Jobs) {
+                fprintf(stderr, "out of memory\n");
+                Failed = 1;
+                break;
+            }
+            Batch->Jobs = Jobs;
+            Capacity = Bigger;
+        }
+        Job *J = &Batch->Jobs[Batch->NumJobs++];
+        *J = (Job){.Program = resolvePath(Dir, Fields[0]),
+                   .Input = resolvePath(Dir, Fields[1]),
+                   .Expected = resolvePath(Dir, Fields[2])};
+
+        size_t LabelLen = strlen(Fields[0]) + 1;
+        if (J->Input) {
+            LabelLen += strlen(Fields[1]) + 3;
+        }
+        J->Label = malloc(LabelLen);
+        if (!J->Program || (isPath(Fields[1]) && !J->Input) ||
+            (isPath(Fields[2]) && !J->Expected) || !J->Label) {
+            fprintf(stderr, "out of memory\n");
+            Failed = 1;
+            break;
+        }
+        snprintf(J->Label, LabelLen, J->Input ? "%s < %s" : "%s", Fields[0],
+                 Fields[1]);
+    }
+
+    free(Dir);
+    free(Text);
+    if (Failed) {
+        freeJobs(Batch);
+        return -1;
+    }
+    return 0;
+}
+
+/// Order jobs by the path of their program.
+static int compareProgram(const void *A, const void *B) {
+    return strcmp((*(Job *const *)A)->Program, (*(Job *const *)B)->Program);
+}
+
+/// @brief Load each distinct program once and point its jobs at it.
+/// @param[in,out] Batch jobs to load programs for
+/// @return 0 on success, -1 if memory ran out
+static int loadPrograms(Batch *Batch) {
+    Job **ByProgram = malloc((Batch->NumJobs + 1) * sizeof(Job *));
+    if (!ByProgram) {
+        return -1;
+    }
+    for (int i = 0; i < Batch->NumJobs; ++i) {
+        ByProgram[i] = &Batch->Jobs[i];
+    }
+    qsort(ByProgram, Batch->NumJobs, sizeof(Job *), compareProgram);
+
+    for (int i = 0; i < Batch->NumJobs; ++i) {
+        Job *J = ByProgram[i];
+        if (i && strcmp(J->Program, ByProgram[i - 1]->Program) == 0) {
+            Job *Prev = ByProgram[i - 1];
+            J->Image = Prev->Image ? retainProgram(Prev->Image) : NULL;
+            J->LoadError = Prev->LoadError;
+        } else {
+            J->LoadError = loadProgramImage(J->Program, &J->Image);
+        }
+    }
+    free(ByProgram);
+    return 0;
+}
+
+/// @brief Run one job on a worker's emulator and record how it went.
+/// @param[in,out] W worker to run the job on
+/// @param[in,out] J job to run
+static void runJob(Worker *W, Job *J) {
+    char *Input = NULL, *Expected = NULL;
+    size_t InputSize = 0, ExpectedSize = 0;
+
+    J->Status = JobError;
+    if ((J->ErrCode = J->LoadError)) {
+        J->Problem = "program";
+        return;
+    }
+    if (J->Input && (J->ErrCode = readFile(J->Input, &Input, &InputSize))) {
+        J->Problem = "input";
+        return;
+    }
+    if (J->Expected &&
+        (J->ErrCode = readFile(J->Expected, &Expected, &ExpectedSize))) {
+        J->Problem = "expected output";
+        free(Input);
+        return;
+    }
+
+    TamEmulator *Emulator = W->Emulator;
+    double Timeout = W->Batch->Timeout;
+    W->Output.Size = 0;
+    double Start = now();
+    attachProgram(Emulator, J->Image);
+    setInputMemory(&Emulator->IO, Input, InputSize);
+    setOutputMemory(&Emulator->IO, &W->Output);
+    // the deadline is only set while this job can be stopped by it
+    if (Timeout > 0) {
+        pthread_mutex_lock(&W->Lock);
+        W->Deadline = Start + Timeout;
+        pthread_mutex_unlock(&W->Lock);
+    }
+    J->ErrCode = runEmulator(Emulator, 0);
+    if (Timeout > 0) {
+        pthread_mutex_lock(&W->Lock);
+        W->Deadline = 0;
+        pthread_mutex_unlock(&W->Lock);
+    }
+    J->Seconds = now() - Start;
+    J->Steps = Emulator->Steps;
+    J->Loc = Emulator->Registers[CP];
+
+    if (!J->ErrCode) {
+        if (!J->Expected) {
+            J->Status = JobOk;
+        } else if (W->Output.Size == ExpectedSize &&
+                   memcmp(W->Output.Data, Expected, ExpectedSize) == 0) {
+            J->Status = JobPass;
+        } else {
+            J->Status = JobFail;
+        }
+    }
+    free(Input);
+    free(Expected);
+}
+
+/// @brief Take the next job for a worker, stealing one if it has none left.
+/// @param[in,out] W worker looking for a job
+/// @return index of the job, or -1 once every job has been taken
+static int takeJob(Worker *W) {
+    int Index = -1;
+    pthread_mutex_lock(&W->Lock);
+    if (W->Next < W->End) {
+        Index = W->Next++;
+    }
+    pthread_mutex_unlock(&W->Lock);
+    if (Index >= 0) {
+        return Index;
+    }
+
+    Batch *B = W->Batch;
+    int Self = W - B->Workers;
+    for (int i = 1; i < B->NumWorkers && Index < 0; ++i) {
+        Worker *Victim = &B->Workers[(Self + i) % B->NumWorkers];
+        pthread_mutex_lock(&Victim->Lock);
+        if (Victim->Next < Victim->End) {
+            Index = --Victim->End;
+        }
+        pthread_mutex_unlock(&Victim->Lock);
+    }
+    return Index;
+}
+
+/// Thread body: run jobs until there are none left.
+static void *workerMain(void *Arg) {
+    Worker *W = Arg;
+    for (int Index; (Index = takeJob(W)) >= 0;) {
+        runJob(W, &W->Batch->Jobs[Index]);
+    }
+    return NULL;
+}
+
+/// Thread body: stop each job that runs past its deadline, until the batch
+/// is done.
+static void *watchdogMain(void *Arg) {
+    Batch *B = Arg;
+    pthread_mutex_lock(&B->Lock);
+    while (!B->Done) {
+        double Wake = now() + WATCHDOG_PERIOD;
+        struct timespec Ts = {.tv_sec = (time_t)Wake,
+                              .tv_nsec = (long)((Wake - (time_t)Wake) * 1e9)};
+        pthread_cond_timedwait(&B->Finished, &B->Lock, &Ts);
+
+        double Now = now();
+        for (int i = 0; i < B->NumWorkers; ++i) {
+            Worker *W = &B->Workers[i];
+            pthread_mutex_lock(&W->Lock);
+            if (W->Deadline && Now >= W->Deadline) {
+                atomic_store_explicit(&W->Emulator->TimeUp, 1,
+                                      memory_order_relaxed);
+            }
+            pthread_mutex_unlock(&W->Lock);
+        }
+    }
+    pthread_mutex_unlock(&B->Lock);
+    return NULL;
+}
+
+/// @brief Print a line describing how a job went.
+/// @param J finished job
+static void reportJob(const Job *J) {
+    static const char *const Status[] = {"ok", "pass", "FAIL", "ERROR"};
+    printf("%-5s %3d %10.3f ms %12llu instrs  %s", Status[J->Status],
+           J->ErrCode, J->Seconds * 1e3, (unsigned long long)J->Steps,
+           J->Label);
+
+    if (J->Status == JobFail) {
+        printf(": output differs from %s", J->Expected);
+    } else if (J->Status == JobError && J->Problem) {
+        printf(": %s: %s", J->Problem, errorMessage(J->ErrCode));
+    } else if (J->Status == JobError) {
+        printf(": %s at loc %04x", errorMessage(J->ErrCode), J->Loc);
+    }
+    putchar('\n');
+}
+
+int runBatch(const char *JobFile, int Threads, uint64_t MaxSteps,
+             double Timeout) {
+    assert(JobFile);
+    Batch Batch = {.Timeout = Timeout};
+    if (readJobs(JobFile, &Batch)) {
+        return 1;
+    }
+
+    double Start = now();
+    if (loadPrograms(&Batch)) {
+        fprintf(stderr, "out of memory\n");
+        freeJobs(&Batch);
+        return 1;
+    }
+
+    if (Threads > Batch.NumJobs) {
+        Threads = Batch.NumJobs;
+    }
+    if (Threads < 1) {
+        Threads = 1;
+    }
+    Batch.Workers = calloc(Threads, sizeof(Worker));
+    if (!Batch.Workers) {
+        fprintf(stderr, "out of memory\n");
+        freeJobs(&Batch);
+        return 1;
+    }
+    for (int i = 0; i < Threads; ++i) {
+        Worker *W = &Batch.Workers[i];
+        pthread_mutex_init(&W->Lock, NULL);
+        W->Next = (long)Batch.NumJobs * i / Threads;
+        W->End = (long)Batch.NumJobs * (i + 1) / Threads;
+        W->Batch = &Batch;
+        W->Emulator = newEmulator();
+        Batch.NumWorkers = i + 1;
+        if (!W->Emulator) {
+            fprintf(stderr, "out of memory\n");
+            freeWorkers(&Batch);
+            freeJobs(&Batch);
+            return 1;
+        }
+        W->Emulator->StepBudget = MaxSteps;
+    }
+
+    // the watchdog's clock is the one now() reads
+    pthread_t Watchdog;
+    if (Timeout > 0) {
+        pthread_condattr_t Attr;
+        pthread_condattr_init(&Attr);
+        pthread_condattr_setclock(&Attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&Batch.Finished, &Attr);
+        pthread_condattr_destroy(&Attr);
+        pthread_mutex_init(&Batch.Lock, NULL);
+        if (pthread_create(&Watchdog, NULL, watchdogMain, &Batch)) {
+            fprintf(stderr, "could not start a thread for --timeout\n");
+            pthread_cond_destroy(&Batch.Finished);
+            pthread_mutex_destroy(&Batch.Lock);
+            freeWorkers(&Batch);
+            freeJobs(&Batch);
+            return 1;
+        }
+    }
+
+    // the calling thread does the work of the first worker, and the jobs of
+    // a worker whose thread could not be started are taken by the others
+    for (int i = 1; i < Threads; ++i) {
+        Worker *W = &Batch.Workers[i];
+        W->Started = pthread_create(&W->Thread, NULL, workerMain, W) == 0;
+    }
+    workerMain(&Batch.Workers[0]);
+    for (int i = 1; i < Threads; ++i) {
+        if (Batch.Workers[i].Started) {
+            pthread_join(Batch.Workers[i].Thread, NULL);
+        }
+    }
+    if (Timeout > 0) {
+        pthread_mutex_lock(&Batch.Lock);
+        Batch.Done = 1;
+        pthread_cond_signal(&Batch.Finished);
+        pthread_mutex_unlock(&Batch.Lock);
+        pthread_join(Watchdog, NULL);
+        pthread_cond_destroy(&Batch.Finished);
+        pthread_mutex_destroy(&Batch.Lock);
+    }
+    double Elapsed = now() - Start;
+
+    int Counts[JobError + 1] = {0};
+    for (int i = 0; i < Batch.NumJobs; ++i) {
+        Job *J = &Batch.Jobs[i];
+        reportJob(J);
+        ++Counts[J->Status];
+    }
+    printf("%d jobs: %d passed, %d failed, %d errors in %.3f ms on %d "
+           "threads\n",
+           Batch.NumJobs, Counts[JobOk] + Counts[JobPass], Counts[JobFail],
+           Counts[JobError], Elapsed * 1e3, Threads);
+
+    freeWorkers(&Batch);
+    freeJobs(&Batch);
+    return Counts[JobFail] || Counts[JobError];
+}
@@ -0,0 +1,30 @@
+#ifndef TAM_BATCH_H__
+#define TAM_BATCH_H__
+
+#include <stdint.h>
+
+/// @brief Run every job in a job file and report on each one.
+///
+/// Each non-blank line of the job file that does not start with `#` names a
+/// program, then optionally a file to use as its input and a file holding
+/// the output it should produce, separated by whitespace. `-` stands for no
+/// file. Relative paths are taken relative to the job file's directory.
+///
+/// Each program is loaded once and shared by every job that runs it. Jobs
+/// run in parallel, one emulator per thread, with their input and output
+/// held in memory. A line per job goes to standard output, in the order the
+/// jobs were listed, followed by a summary.
+///
+/// A job that executes more than `MaxSteps` instructions, or runs for more
+/// than `Timeout` seconds, is stopped and reported as an error, leaving the
+/// other jobs to carry on.
+/// @param JobFile name of the job file
+/// @param Threads number of threads to run jobs on
+/// @param MaxSteps most instructions each job may execute, or 0 for no
+/// limit
+/// @param Timeout most seconds each job may run for, or 0 for no limit
+/// @return 0 if every job halted with the expected output, 1 otherwise
+int runBatch(const char *JobFile, int Threads, uint64_t MaxSteps,
+             double Timeout);
+
+#endif
@@ -0,0 +1,67 @@
+#include "internal.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+TamBlockCache *newBlockCache(TamProgram *Program) {
+    assert(Program);
+    TamBlockCache *Cache = calloc(1, sizeof(TamBlockCache) +
+                                         (Program->Size + 1) *
+                                             sizeof(BasicBlock));
+    if (!Cache) {
+        return NULL;
+    }
+    Cache->Program = retainProgram(Program);
+    Cache->Size = Program->Size;
+    return Cache;
+}
+
+void freeBlockCache(TamBlockCache *Cache) {
+    if (Cache) {
+        releaseProgram(Cache->Program);
+    }
+    free(Cache);
+}
+
+/// @brief Work out how control leaves an instruction.
+/// @param Instr instruction with its operands already resolved
+/// @return the exit the instruction makes, or EXIT_NONE if control simply
+/// goes on to the next one
+static BlockExit exitOf(const Instruction *Instr) {
+    switch (selectHandler(Instr)) {
+    case H_CALL:
+        return EXIT_CALL;
+    case H_JUMP:
+        return EXIT_JUMP;
+    case H_JUMPIF:
+        return EXIT_BRANCH;
+    case H_HALT:
+        return EXIT_HALT;
+    case H_EXEC:
+    case H_RETURN:
+    case H_JUMPI:
+        return EXIT_DYNAMIC;
+    default:
+        return EXIT_NONE;
+    }
+}
+
+void findBlock(TamBlockCache *Cache, const Instruction *Code,
+               BasicBlock *Block) {
+    assert(Cache);
+    assert(Code);
+    assert(Block);
+
+    int Start = Block - Cache->Blocks;
+    int End = Start;
+    BlockExit Exit = EXIT_NONE;
+    while (End < Cache->Size && !Exit) {
+        Exit = exitOf(Code + End++);
+    }
+
+    Block->Length = End - Start;
+    Block->Taken = Exit == EXIT_CALL || Exit == EXIT_JUMP || Exit == EXIT_BRANCH
+                       ? Code[End - 1].Target
+                       : 0;
+    Block->Exit = Exit;
+}
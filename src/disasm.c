@@ -0,0 +1,56 @@
+#include "disasm.h"
+
+#include <stdio.h>
+
+void instructionString(Instruction Instr, char *Str) {
+    switch (Instr.Op) {
+    case LOAD:
+        snprintf(Str, 32, "LOAD(%d) %d[%d]", Instr.N, Instr.D, Instr.R);
+        break;
+    case LOADA:
+        snprintf(Str, 32, "LOADA %d[%d]", Instr.D, Instr.R);
+        break;
+    case LOADI:
+        snprintf(Str, 32, "LOADI (%d)", Instr.N);
+        break;
+    case LOADL:
+        snprintf(Str, 32, "LOADL %d", Instr.D);
+        break;
+    case STORE:
+        snprintf(Str, 32, "STORE(%d) %d[%d]", Instr.N, Instr.D, Instr.R);
+        break;
+    case STOREI:
+        snprintf(Str, 32, "STOREI(%d)", Instr.N);
+        break;
+    case CALL:
+        snprintf(Str, 32, "CALL(%d) %d[%d]", Instr.N, Instr.D, Instr.R);
+        break;
+    case CALLI:
+        snprintf(Str, 32, "CALLI");
+        break;
+    case RETURN:
+        snprintf(Str, 32, "RETURN(%d) %d", Instr.N, Instr.D);
+        break;
+    case PUSH:
+        snprintf(Str, 32, "PUSH %d", Instr.D);
+        break;
+    case POP:
+        snprintf(Str, 32, "POP(%d) %d", Instr.N, Instr.D);
+        break;
+    case JUMP:
+        snprintf(Str, 32, "JUMP %d[%d]", Instr.D, Instr.R);
+        break;
+    case JUMPI:
+        snprintf(Str, 32, "JUMPI");
+        break;
+    case JUMPIF:
+        snprintf(Str, 32, "JUMPIF(%d) %d[%d]", Instr.N, Instr.D, Instr.R);
+        break;
+    case HALT:
+        snprintf(Str, 32, "HALT");
+        break;
+    default:
+        snprintf(Str, 32, "OP%d", Instr.Op);
+        break;
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef TAM_DISASM_H__
+#define TAM_DISASM_H__
+
+#include <tam/tam.h>
+
+/// @brief Write an instruction in assembly form.
+/// @param Instr instruction to write
+/// @param[out] Str buffer of at least 32 characters to receive the text
+void instructionString(Instruction Instr, char *Str);
+
+#endif
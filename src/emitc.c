@@ -0,0 +1,488 @@
+#include "emitc.h"
+
+#include "disasm.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Definitions at the top of every translation. Each instruction becomes one
+// of these macros, which make the same checks in the same order as the
+// interpreter. `At` is the address reported if a check fails.
+static const char *const Prelude =
+    "#include <string.h>\n"
+    "#include <tam/error.h>\n"
+    "#include <tam/runtime.h>\n"
+    "\n"
+    "static TamIO IO = {.OutFd = 1};\n"
+    "static TamHeap Heap;\n"
+    "\n"
+    "#define FAIL(Err, At) do { *Cp = (At); return (Err); } while (0)\n"
+    "#define NEED(K, At) do { if (St < (K)) FAIL(ErrStackUnderflow, At); } "
+    "while (0)\n"
+    "#define INACCESSIBLE(A) ((A) >= St && (A) <= Ht)\n"
+    "#define PUSHV(V, At) do { DATA_W V_ = (V); "
+    "if (St >= Ht) FAIL(ErrStackOverflow, At); Mem[St] = V_; ++St; } "
+    "while (0)\n"
+    "#define LOAD1(A, At) do { ADDRESS A_ = (A); if (INACCESSIBLE(A_)) "
+    "FAIL(ErrDataAccessViolation, At); if (St >= Ht) "
+    "FAIL(ErrStackOverflow, At); Mem[St] = Mem[A_]; ++St; } while (0)\n"
+    "#define LOADN(A, N, At) do { ADDRESS A_ = (A); "
+    "if (!rangeAccessible(A_, N, St, Ht)) FAIL(ErrDataAccessViolation, At); "
+    "if ((WIDE_W)St + (N) > Ht) FAIL(ErrStackOverflow, At); "
+    "memcpy(Mem + St, Mem + A_, (N) * sizeof(DATA_W)); St += (N); } "
+    "while (0)\n"
+    "#define LOADIN(N, At) do { NEED(1, At); --St; "
+    "if ((N) == 1) LOAD1(Mem[St], At); else LOADN(Mem[St], N, At); } "
+    "while (0)\n"
+    "#define STOREN(A, N, At) do { NEED(N, At); St -= (N); ADDRESS A_ = (A); "
+    "if (!rangeAccessible(A_, N, St, Ht)) FAIL(ErrDataAccessViolation, At); "
+    "memcpy(Mem + A_, Mem + St, (N) * sizeof(DATA_W)); } while (0)\n"
+    "#define STOREIN(N, At) do { NEED((N) + 1, At); St -= (N) + 1; "
+    "ADDRESS A_ = Mem[St]; "
+    "if (!rangeAccessible(A_, N, St, Ht)) FAIL(ErrDataAccessViolation, At); "
+    "memcpy(Mem + A_, Mem + St + 1, (N) * sizeof(DATA_W)); } while (0)\n"
+    "#define ENTER(Link, Ret, At) do { ADDRESS L_ = (Link); "
+    "if ((WIDE_W)St + 3 > Ht) FAIL(ErrStackOverflow, At); "
+    "Mem[St] = (DATA_W)L_; Mem[St + 1] = (DATA_W)Lb; "
+    "Mem[St + 2] = (DATA_W)(Ret); Lb = St; St += 3; } while (0)\n"
+    "#define LEAVE(N, D, At) do { NEED(N, At); ADDRESS R_ = St - (N); "
+    "ADDRESS Ret_ = Mem[(ADDRESS)(Lb + 2)]; "
+    "ADDRESS Link_ = Mem[(ADDRESS)(Lb + 1)]; "
+    "if (Lb < (D)) FAIL(ErrStackUnderflow, At); St = Lb - (D); "
+    "if ((N) && (WIDE_W)St + (N) > Ht) FAIL(ErrStackOverflow, At); "
+    "memmove(Mem + St, Mem + R_, (N) * sizeof(DATA_W)); St += (N); "
+    "Lb = Link_; Addr = Ret_; "
+    "if (Addr >= CT) FAIL(ErrCodeAccessViolation, Addr); } while (0)\n"
+    "#define GROW(D, At) do { if ((WIDE_W)St + (D) >= Ht) "
+    "FAIL(ErrStackOverflow, At); St += (D); } while (0)\n"
+    "#define POPN(N, D, At) do { NEED((N) + (D), At); "
+    "memmove(Mem + St - (N) - (D), Mem + St - (N), (N) * sizeof(DATA_W)); "
+    "St -= (D); } while (0)\n"
+    "#define UNARY(E, At) do { NEED(1, At); WIDE_W A1 = Mem[St - 1]; "
+    "Mem[St - 1] = (E); } while (0)\n"
+    "#define BINARY(E, At) do { NEED(2, At); WIDE_W A1 = Mem[St - 1]; "
+    "WIDE_W A2 = Mem[St - 2]; Mem[St - 2] = (E); --St; } while (0)\n"
+    "#define DIVIDE(E, At) do { NEED(2, At); "
+    "if (!Mem[St - 2]) FAIL(ErrDivisionByZero, At); WIDE_W A1 = Mem[St - 1]; "
+    "WIDE_W A2 = Mem[St - 2]; Mem[St - 2] = (E); --St; } while (0)\n"
+    "#define COMPARE(Equal, At) do { NEED(1, At); WIDE_W S_ = Mem[St - 1]; "
+    "S_ = S_ < 0 ? 0 : S_; "
+    "if (St - 1 < 2 * S_) FAIL(ErrStackUnderflow, At); "
+    "int E_ = !memcmp(Mem + St - 1 - S_, Mem + St - 1 - 2 * S_, "
+    "S_ * sizeof(DATA_W)); St -= 2 * S_; Mem[St - 1] = E_ == (Equal); } "
+    "while (0)\n"
+    "#define GET(F, At) do { NEED(1, At); ADDRESS A_ = Mem[--St]; "
+    "if (INACCESSIBLE(A_)) FAIL(ErrDataAccessViolation, At); "
+    "Mem[A_] = F(&IO); } while (0)\n"
+    "#define PUT(F, At) do { NEED(1, At); F(&IO, Mem[--St]); } while (0)\n"
+    "#define NEW(At) do { NEED(1, At); ADDRESS H_ = Ht, A_; "
+    "int E_ = primitiveNew(&Heap, Mem, St - 1, &H_, Mem[St - 1], &A_); "
+    "if (E_) FAIL(E_, At); Ht = H_; Mem[St - 1] = (DATA_W)A_; } while (0)\n"
+    "#define DISPOSE(At) do { NEED(2, At); ADDRESS H_ = Ht; "
+    "int E_ = primitiveDispose(&Heap, Mem, &H_, Mem[St - 2], "
+    "(ADDRESS)Mem[St - 1]); if (E_) FAIL(E_, At); Ht = H_; St -= 2; } "
+    "while (0)\n"
+    "\n";
+
+/// @brief A program being translated.
+typedef struct Translation {
+    const TamEmulator *Emulator;
+    const Instruction *Code;
+    int Size;
+    FILE *Out;
+    uint8_t *Reachable; ///< Nonzero for instructions control can reach
+    uint8_t *Labelled;  ///< Nonzero for instructions that need a label
+    int Dispatch;       ///< Nonzero if control can go to a computed address
+} Translation;
+
+static int isPrimitive(const Instruction *I) {
+    return I->Op == CALL && I->R == PB && I->D > 0 && I->D < 29;
+}
+
+/// @brief Mark the instructions control can reach from address 0.
+///
+/// Returns, JUMPI and jumps relative to a register can go to any address,
+/// so if any of them can be reached, so can everything.
+/// @param[in,out] T translation to fill in
+/// @return 0 on success, -1 if memory ran out
+static int findReachable(Translation *T) {
+    int *Work = malloc(T->Size * sizeof(int));
+    if (!Work) {
+        return -1;
+    }
+    int Count = 0;
+    if (T->Size) {
+        T->Reachable[0] = 1;
+        Work[Count++] = 0;
+    }
+
+    while (Count && !T->Dispatch) {
+        int Addr = Work[--Count];
+        const Instruction *I = T->Code + Addr;
+        int Dynamic = isDynamicRegister(I->R);
+        int Next = 0, Target = -1;
+
+        switch (I->Op) {
+        case CALL:
+            if (isPrimitive(I)) {
+                Next = 1;
+            } else if (Dynamic) {
+                T->Dispatch = 1;
+            } else {
+                Target = I->Target;
+            }
+            break;
+        case RETURN:
+        case JUMPI:
+            T->Dispatch = 1;
+            break;
+        case JUMP:
+            T->Dispatch = Dynamic;
+            Target = Dynamic ? -1 : I->Target;
+            break;
+        case JUMPIF:
+            T->Dispatch = Dynamic;
+            Target = Dynamic ? -1 : I->Target;
+            Next = 1;
+            break;
+        case HALT:
+            break;
+        default:
+            Next = I->Op <= POP && I->Op != CALLI && I->Op != 9;
+            break;
+        }
+
+        if (Target >= 0 && Target < T->Size) {
+            T->Labelled[Target] = 1;
+            if (!T->Reachable[Target]) {
+                T->Reachable[Target] = 1;
+                Work[Count++] = Target;
+            }
+        }
+        if (Next && Addr + 1 < T->Size && !T->Reachable[Addr + 1]) {
+            T->Reachable[Addr + 1] = 1;
+            Work[Count++] = Addr + 1;
+        }
+    }
+
+    if (T->Dispatch) {
+        for (int i = 0; i < T->Size; ++i) {
+            T->Reachable[i] = T->Labelled[i] = 1;
+        }
+    }
+    free(Work);
+    return 0;
+}
+
+/// The expression for an address relative to a register.
+static void emitAddress(const Translation *T, const Instruction *I) {
+    switch (I->R) {
+    case ST:
+        fprintf(T->Out, "(ADDRESS)(St + %d)", I->D);
+        break;
+    case HT:
+        fprintf(T->Out, "(ADDRESS)(Ht + %d)", I->D);
+        break;
+    case LB:
+        fprintf(T->Out, "(ADDRESS)(Lb + %d)", I->D);
+        break;
+    default:
+        fprintf(T->Out, "%lu", (unsigned long)I->Target);
+        break;
+    }
+}
+
+/// Go to a static address, which must be checked first.
+static void emitGoto(const Translation *T, int Target, int At) {
+    if (Target < T->Size) {
+        fprintf(T->Out, "goto L%d;\n", Target);
+    } else {
+        fprintf(T->Out, "FAIL(ErrCodeAccessViolation, %d);\n", At);
+    }
+}
+
+/// Go to the address in `Addr`, checking it first.
+static void emitComputedGoto(const Translation *T, const Instruction *I,
+                             int At) {
+    fprintf(T->Out, "Addr = ");
+    emitAddress(T, I);
+    fprintf(T->Out,
+            "; if (Addr >= CT) FAIL(ErrCodeAccessViolation, %d); "
+            "goto dispatch;",
+            At);
+}
+
+static void emitPrimitive(const Translation *T, const Instruction *I,
+                          int At) {
+    FILE *Out = T->Out;
+    static const char *const Unary[] = {
+        [2] = "A1 ? 0 : 1",
+        [5] = "A1 + 1",
+        [6] = "A1 - 1",
+        [7] = "-A1",
+    };
+    // gt is computed as >=, as the interpreter computes it
+    static const char *const Binary[] = {
+        [3] = "A1 && A2",         [4] = "A1 + A2 ? 1 : 0",
+        [8] = "A1 + A2",          [9] = "A1 - A2",
+        [10] = "A1 * A2",         [11] = "A1 / A2",
+        [12] = "A1 % A2",         [13] = "A1 < A2 ? 1 : 0",
+        [14] = "A1 <= A2 ? 1 : 0", [15] = "A1 >= A2 ? 1 : 0",
+        [16] = "A1 >= A2 ? 1 : 0",
+    };
+
+    switch (I->D) {
+    case 2:
+    case 5:
+    case 6:
+    case 7:
+        fprintf(Out, "UNARY(%s, %d);\n", Unary[I->D], At);
+        break;
+    case 11:
+    case 12:
+        fprintf(Out, "DIVIDE(%s, %d);\n", Binary[I->D], At);
+        break;
+    case 17:
+    case 18:
+        fprintf(Out, "COMPARE(%d, %d);\n", I->D == 17, At);
+        break;
+    case 19:
+        fprintf(Out, "PUSHV(primitiveEol(&IO), %d);\n", At);
+        break;
+    case 20:
+        fprintf(Out, "PUSHV(primitiveEof(&IO), %d);\n", At);
+        break;
+    case 21:
+        fprintf(Out, "GET(primitiveGet, %d);\n", At);
+        break;
+    case 22:
+        fprintf(Out, "PUT(primitivePut, %d);\n", At);
+        break;
+    case 23:
+        fprintf(Out, "primitiveGetEol(&IO);\n");
+        break;
+    case 24:
+        fprintf(Out, "primitivePut(&IO, '\\n');\n");
+        break;
+    case 25:
+        fprintf(Out, "GET(primitiveGetInt, %d);\n", At);
+        break;
+    case 26:
+        fprintf(Out, "PUT(primitivePutInt, %d);\n", At);
+        break;
+    case 27:
+        fprintf(Out, "NEW(%d);\n", At);
+        break;
+    case 28:
+        fprintf(Out, "DISPOSE(%d);\n", At);
+        break;
+    default:
+        if (I->D < 17 && Binary[I->D]) {
+            fprintf(Out, "BINARY(%s, %d);\n", Binary[I->D], At);
+        } else {
+            // id
+            fprintf(Out, ";\n");
+        }
+        break;
+    }
+}
+
+/// The static link a CALL pushes.
+static void emitStaticLink(const Translation *T, const Instruction *I,
+                           int At) {
+    switch (I->N) {
+    case ST:
+        fprintf(T->Out, "St");
+        break;
+    case HT:
+        fprintf(T->Out, "Ht");
+        break;
+    case LB:
+        fprintf(T->Out, "Lb");
+        break;
+    case CP:
+        fprintf(T->Out, "%d", At + 1);
+        break;
+    default:
+        fprintf(T->Out, "%lu",
+                I->N < 16 ? (unsigned long)T->Emulator->Registers[I->N] : 0);
+        break;
+    }
+}
+
+static void emitInstruction(const Translation *T, int At) {
+    const Instruction *I = T->Code + At;
+    FILE *Out = T->Out;
+    int Dynamic = isDynamicRegister(I->R);
+    int D = I->D < 0 ? 0 : I->D;
+
+    switch (I->Op) {
+    case LOAD:
+        fprintf(Out, I->N == 1 ? "LOAD1(" : "LOADN(");
+        emitAddress(T, I);
+        if (I->N != 1) {
+            fprintf(Out, ", %d", I->N);
+        }
+        fprintf(Out, ", %d);\n", At);
+        break;
+    case LOADA:
+        fprintf(Out, "PUSHV((DATA_W)");
+        emitAddress(T, I);
+        fprintf(Out, ", %d);\n", At);
+        break;
+    case LOADI:
+        fprintf(Out, "LOADIN(%d, %d);\n", I->N, At);
+        break;
+    case LOADL:
+        fprintf(Out, "PUSHV(%d, %d);\n", I->D, At);
+        break;
+    case STORE:
+        fprintf(Out, "STOREN(");
+        emitAddress(T, I);
+        fprintf(Out, ", %d, %d);\n", I->N, At);
+        break;
+    case STOREI:
+        fprintf(Out, "STOREIN(%d, %d);\n", I->N, At);
+        break;
+    case CALL:
+        if (isPrimitive(I)) {
+            emitPrimitive(T, I, At);
+        } else if (Dynamic) {
+            fprintf(Out, "Addr = ");
+            emitAddress(T, I);
+            fprintf(Out,
+                    "; if (Addr >= CT) FAIL(ErrCodeAccessViolation, %d); "
+                    "ENTER(",
+                    At);
+            emitStaticLink(T, I, At);
+            fprintf(Out, ", %d, %d); goto dispatch;\n", At + 1, At);
+        } else if (I->Target >= T->Size) {
+            fprintf(Out, "FAIL(ErrCodeAccessViolation, %d);\n", At);
+        } else {
+            fprintf(Out, "ENTER(");
+            emitStaticLink(T, I, At);
+            fprintf(Out, ", %d, %d); goto L%d;\n", At + 1, At, I->Target);
+        }
+        break;
+    case RETURN:
+        fprintf(Out, "LEAVE(%d, %d, %d); goto dispatch;\n", I->N, D, At);
+        break;
+    case PUSH:
+        fprintf(Out, "GROW(%d, %d);\n", I->D, At);
+        break;
+    case POP:
+        fprintf(Out, "POPN(%d, %d, %d);\n", I->N, D, At);
+        break;
+    case JUMP:
+        if (Dynamic) {
+            emitComputedGoto(T, I, At);
+            fprintf(Out, "\n");
+        } else {
+            emitGoto(T, I->Target, At);
+        }
+        break;
+    case JUMPI:
+        fprintf(Out,
+                "NEED(1, %d); Addr = Mem[--St]; "
+                "if (Addr >= CT) FAIL(ErrCodeAccessViolation, %d); "
+                "goto dispatch;\n",
+                At, At);
+        break;
+    case JUMPIF:
+        // the address is worked out after the condition is popped
+        fprintf(Out, "NEED(1, %d); if (Mem[--St] == %d) { ", At, I->N);
+        if (Dynamic) {
+            emitComputedGoto(T, I, At);
+            fprintf(Out, " }\n");
+        } else if (I->Target < T->Size) {
+            fprintf(Out, "goto L%d; }\n", I->Target);
+        } else {
+            fprintf(Out, "FAIL(ErrCodeAccessViolation, %d); }\n", At);
+        }
+        break;
+    case HALT:
+        fprintf(Out, "return OK;\n");
+        break;
+    default:
+        fprintf(Out, "FAIL(ErrUnrecognisedOpcode, %d);\n", At);
+        break;
+    }
+}
+
+int emitC(const TamEmulator *Emulator, const char *Source, FILE *Out) {
+    assert(Emulator);
+    assert(Emulator->Program);
+    assert(Out);
+
+    Translation T = {.Emulator = Emulator,
+                     .Code = Emulator->Code,
+                     .Size = Emulator->Program->Size,
+                     .Out = Out};
+    T.Reachable = calloc(T.Size + 1, 1);
+    T.Labelled = calloc(T.Size + 1, 1);
+    if (!T.Reachable || !T.Labelled || findReachable(&T)) {
+        free(T.Reachable);
+        free(T.Labelled);
+        return -1;
+    }
+
+    // the translation is built for the word size of the emulator doing the
+    // translating, and a wider store is reserved rather than static
+    fprintf(Out, "// Translated from %s by tam --emit-c.\n", Source);
+    fprintf(Out, "#define TAM_WORD_BITS %d\n", TAM_WORD_BITS);
+    fprintf(Out, "%s", Prelude);
+    fprintf(Out, TAM_WORD_BITS == 16 ? "static DATA_W Mem[MEMORY_SIZE];\n"
+                                     : "static DATA_W *Mem;\n");
+    fprintf(Out, "#define CT %d\n\n", T.Size);
+    fprintf(Out, "static int run(ADDRESS *Cp) {\n");
+    fprintf(Out, "    ADDRESS St = 0, Ht = %lu, Lb = 0;\n",
+            (unsigned long)Emulator->Registers[HT]);
+    if (T.Dispatch) {
+        fprintf(Out, "    ADDRESS Addr;\n");
+    }
+    fprintf(Out, "    (void)Mem, (void)St, (void)Ht, (void)Lb;\n\n");
+
+    char Text[32];
+    for (int At = 0; At < T.Size; ++At) {
+        if (!T.Reachable[At]) {
+            continue;
+        }
+        instructionString(T.Code[At], Text);
+        if (T.Labelled[At]) {
+            fprintf(Out, "L%d:\n", At);
+        }
+        fprintf(Out, "    // 0x%04x: %s\n    ", At, Text);
+        emitInstruction(&T, At);
+    }
+
+    // running off the end is reported at the address after the last
+    // instruction
+    fprintf(Out, "    FAIL(ErrCodeAccessViolation, CT);\n");
+    if (T.Dispatch) {
+        fprintf(Out, "\ndispatch:\n    switch (Addr) {\n");
+        for (int At = 0; At < T.Size; ++At) {
+            fprintf(Out, "    case %d: goto L%d;\n", At, At);
+        }
+        fprintf(Out, "    }\n    FAIL(ErrCodeAccessViolation, Addr);\n");
+    }
+    fprintf(Out, "}\n\n");
+
+    fprintf(Out, "int main(void) {\n"
+                 "    ADDRESS Cp = 0;\n");
+    if (TAM_WORD_BITS != 16) {
+        fprintf(Out, "    if (!(Mem = reserveDataStore())) {\n"
+                     "        return 1;\n"
+                     "    }\n");
+    }
+    fprintf(Out, "    int ErrCode = run(&Cp);\n"
+                 "    flushOutput(&IO);\n"
+                 "    if (ErrCode) {\n"
+                 "        reportError(ErrCode, Cp);\n"
+                 "    }\n"
+                 "    return ErrCode;\n"
+                 "}\n");
+
+    free(T.Reachable);
+    free(T.Labelled);
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef TAM_EMITC_H__
+#define TAM_EMITC_H__
+
+#include <stdio.h>
+#include <tam/tam.h>
+
+/// @brief Translate a program into a standalone C program.
+///
+/// The translation is one function with a label for each instruction that
+/// can be reached and the data store in a static array. Every check the
+/// interpreter makes is kept, so compiled and linked against the `tam`
+/// library, the result writes the same output, reports the same errors at
+/// the same addresses and exits with the same code as `tam` running the
+/// original.
+/// @param Emulator emulator the program has just been loaded into
+/// @param Source name of the program, for a comment in the output
+/// @param Out stream to write the C source to
+/// @return 0 on success, -1 if memory ran out
+int emitC(const TamEmulator *Emulator, const char *Source, FILE *Out);
+
+#endif
@@ -0,0 +1,83 @@
+#include <tam/runtime.h>
+
+#include <assert.h>
+#include <tam/error.h>
+
+/// @brief Check that a block could have been allocated from the heap.
+/// @param Block address of the block
+/// @param Words number of words in the block
+/// @param Ht current value of HT
+/// @return 1 if the whole block lies between HT and the top of memory
+static int insideHeap(ADDRESS Block, uint32_t Words, ADDRESS Ht) {
+    return Block > Ht && (int64_t)Block + Words <= MEMORY_SIZE;
+}
+
+int primitiveNew(TamHeap *Heap, const DATA_W *Mem, ADDRESS St, ADDRESS *Ht,
+                 DATA_W Size, ADDRESS *Addr) {
+    assert(Heap);
+    assert(Mem);
+    assert(Ht);
+    assert(Addr);
+
+    if (Size <= 0) {
+        *Addr = *Ht + 1;
+        return OK;
+    }
+    int Class = heapClass(Size);
+    uint32_t Words = heapClassSize(Class);
+
+    // the program can write over a free block, or dispose of one twice, so
+    // a list that leads out of the heap is abandoned rather than followed
+    ADDRESS Block = Heap->Free[Class];
+    if (Block && !insideHeap(Block, Words, *Ht)) {
+        Block = 0;
+        Heap->FreeCount[Class] = 0;
+    }
+    if (Block) {
+        Heap->Free[Class] = (ADDRESS)Mem[Block];
+        --Heap->FreeCount[Class];
+    } else {
+        Heap->Free[Class] = 0;
+        if ((int64_t)*Ht - Words <= St) {
+            return ErrStackOverflow;
+        }
+        *Ht -= Words;
+        Block = *Ht + 1;
+    }
+
+    Heap->LiveWords += Words;
+    if (Heap->LiveWords > Heap->PeakWords) {
+        Heap->PeakWords = Heap->LiveWords;
+    }
+    ++Heap->Allocations;
+    *Addr = Block;
+    return OK;
+}
+
+int primitiveDispose(TamHeap *Heap, DATA_W *Mem, ADDRESS *Ht, DATA_W Size,
+                     ADDRESS Addr) {
+    assert(Heap);
+    assert(Mem);
+    assert(Ht);
+
+    if (Size <= 0) {
+        return OK;
+    }
+    int Class = heapClass(Size);
+    uint32_t Words = heapClassSize(Class);
+    if (!insideHeap(Addr, Words, *Ht)) {
+        return ErrDataAccessViolation;
+    }
+
+    Heap->LiveWords -= Words < Heap->LiveWords ? Words : Heap->LiveWords;
+    ++Heap->Disposals;
+    if (Addr == (ADDRESS)(*Ht + 1)) {
+        // the lowest block goes back to the free space instead
+        *Ht += Words;
+        return OK;
+    }
+    Mem[Addr] = (DATA_W)Heap->Free[Class];
+    Heap->Free[Class] = Addr;
+    ++Heap->FreeCount[Class];
+    return OK;
+}
@@ -0,0 +1,163 @@
+#include "hoststats.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char *const EventNames[NUM_HOST_EVENTS] = {
+    "host cycles:           ", "host instructions:     ",
+    "branch mispredicts:    ", "L1 data misses:        ",
+    "LLC misses:            ",
+};
+
+#ifdef __linux__
+/// The type and config of each HostEvent for perf_event_open().
+static const struct {
+    uint32_t Type;
+    uint64_t Config;
+} Events[NUM_HOST_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+         PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    {PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+         PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+};
+
+/// Open a disabled counter for this thread, on any CPU, in user space only.
+static int openEvent(HostEvent E) {
+    struct perf_event_attr Attr;
+    memset(&Attr, 0, sizeof(Attr));
+    Attr.size = sizeof(Attr);
+    Attr.type = Events[E].Type;
+    Attr.config = Events[E].Config;
+    Attr.disabled = 1;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    Attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0);
+}
+#endif
+
+void startHostStats(HostStats *Stats) {
+    memset(Stats, 0, sizeof(HostStats));
+    for (int E = 0; E < NUM_HOST_EVENTS; ++E) {
+        Stats->Fds[E] = -1;
+#ifdef __linux__
+        if ((Stats->Fds[E] = openEvent(E)) < 0 && !Stats->Error) {
+            Stats->Error = errno;
+        }
+#else
+        Stats->Error = ENOSYS;
+#endif
+    }
+
+    // the clock is read first and the counters started last, so that as
+    // little as possible of the counters' own setup is counted
+    clock_gettime(CLOCK_MONOTONIC, &Stats->Start);
+#ifdef __linux__
+    for (int E = 0; E < NUM_HOST_EVENTS; ++E) {
+        if (Stats->Fds[E] >= 0) {
+            ioctl(Stats->Fds[E], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+void stopHostStats(HostStats *Stats) {
+#ifdef __linux__
+    for (int E = 0; E < NUM_HOST_EVENTS; ++E) {
+        if (Stats->Fds[E] >= 0) {
+            ioctl(Stats->Fds[E], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#endif
+    struct timespec End;
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Stats->Seconds = (End.tv_sec - Stats->Start.tv_sec) +
+                     (End.tv_nsec - Stats->Start.tv_nsec) / 1e9;
+
+#ifdef __linux__
+    // with more counters open than the hardware has, the kernel takes turns
+    // and each count only covers the time it was running
+    for (int E = 0; E < NUM_HOST_EVENTS; ++E) {
+        uint64_t Value[3];
+        if (Stats->Fds[E] < 0) {
+            continue;
+        }
+        if (read(Stats->Fds[E], Value, sizeof(Value)) != sizeof(Value) ||
+            !Value[2]) {
+            Stats->Error = Stats->Error ? Stats->Error : ENODATA;
+            close(Stats->Fds[E]);
+            Stats->Fds[E] = -1;
+            continue;
+        }
+        Stats->Counts[E] = Value[2] < Value[1]
+                               ? (uint64_t)((double)Value[0] * Value[1] /
+                                            Value[2])
+                               : Value[0];
+        close(Stats->Fds[E]);
+    }
+#endif
+}
+
+/// Print `Count / Of`, labelled, or nothing if `Of` is 0.
+static void printRatio(FILE *Out, uint64_t Count, uint64_t Of,
+                       const char *Label) {
+    if (Of) {
+        fprintf(Out, " (%.3f %s)", (double)Count / Of, Label);
+    }
+}
+
+void printHostStats(const HostStats *Stats, uint64_t Steps,
+                    uint64_t Dispatches, FILE *Out) {
+    fprintf(Out, "wall time:             %.3f ms", Stats->Seconds * 1e3);
+    if (Stats->Seconds > 0) {
+        fprintf(Out, " (%.2f Minstr/s)", Steps / Stats->Seconds / 1e6);
+    }
+    fputc('\n', Out);
+
+    int Any = 0;
+    for (int E = 0; E < NUM_HOST_EVENTS; ++E) {
+        if (Stats->Fds[E] < 0) {
+            continue;
+        }
+        Any = 1;
+        uint64_t Count = Stats->Counts[E];
+        fprintf(Out, "%s%llu", EventNames[E], (unsigned long long)Count);
+        switch (E) {
+        case HOST_CYCLES:
+        case HOST_INSTRUCTIONS:
+            printRatio(Out, Count, Steps, "per instruction");
+            break;
+        case HOST_BRANCH_MISSES:
+            printRatio(Out, Count, Dispatches, "per dispatch");
+            break;
+        default:
+            printRatio(Out, Count * 1000, Steps, "per 1000 instructions");
+            break;
+        }
+        fputc('\n', Out);
+    }
+    if (Stats->Fds[HOST_CYCLES] >= 0 && Stats->Fds[HOST_INSTRUCTIONS] >= 0) {
+        fprintf(Out, "host instrs per cycle: %.3f\n",
+                Stats->Counts[HOST_CYCLES]
+                    ? (double)Stats->Counts[HOST_INSTRUCTIONS] /
+                          Stats->Counts[HOST_CYCLES]
+                    : 0.0);
+    }
+    if (!Any) {
+        fprintf(Out, "host counters:         unavailable (%s)\n",
+                strerror(Stats->Error));
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef TAM_HOSTSTATS_H__
+#define TAM_HOSTSTATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/// @brief Host hardware events counted around a run, in the order they are
+/// reported.
+typedef enum HostEvent {
+    HOST_CYCLES,
+    HOST_INSTRUCTIONS,
+    HOST_BRANCH_MISSES,
+    HOST_L1D_MISSES,
+    HOST_LLC_MISSES,
+    NUM_HOST_EVENTS
+} HostEvent;
+
+/// @brief What the host did while a program ran: the wall time, and where
+/// Linux perf events can be opened, its hardware counters.
+///
+/// Each counter is opened on its own for this thread in user space only, so
+/// an unprivileged process can read it. A counter the kernel or the
+/// hardware does not offer is left out; if none can be opened the wall time,
+/// from `clock_gettime()`, is still measured.
+typedef struct HostStats {
+    int Fds[NUM_HOST_EVENTS];          ///< Counters, -1 if not counted
+    uint64_t Counts[NUM_HOST_EVENTS];  ///< Counts, scaled if multiplexed
+    int Error;                         ///< errno from the first failed open
+    double Seconds;                    ///< Wall time between start and stop
+    struct timespec Start;             ///< Monotonic time at the start
+} HostStats;
+
+/// @brief Open the counters and start them and the clock.
+/// @param[out] Stats statistics to start
+void startHostStats(HostStats *Stats);
+
+/// @brief Stop the clock and the counters, read them and close them.
+/// @param[in,out] Stats statistics started by startHostStats()
+void stopHostStats(HostStats *Stats);
+
+/// @brief Print the host statistics, and their ratios to the guest's.
+/// @param Stats statistics stopped by stopHostStats()
+/// @param Steps guest instructions executed
+/// @param Dispatches guest instructions dispatched, after fusion
+/// @param Out stream to print to
+void printHostStats(const HostStats *Stats, uint64_t Steps,
+                    uint64_t Dispatches, FILE *Out);
+
+#endif
@@ -0,0 +1,359 @@
+#ifndef TAM_INTERNAL_H__
+#define TAM_INTERNAL_H__
+
+#include <tam/error.h>
+#include <tam/runtime.h>
+#include <tam/tam.h>
+
+/// @brief Interpreter routines that runEmulator() can dispatch to.
+///
+/// Each decoded instruction names one of these in its `Handler` field. The
+/// `_DYN` variants compute their address from ST, HT or LB at run time; the
+/// others use the address resolved at load time.
+typedef enum Handler {
+    H_EXEC, ///< Anything without a dedicated routine, run through execute()
+    H_LOAD,
+    H_LOAD_DYN,
+    H_LOADA,
+    H_LOADA_DYN,
+    H_LOADI,
+    H_LOADL,
+    H_STORE,
+    H_STORE_DYN,
+    H_STOREI,
+    H_CALL,
+    H_RETURN,
+    H_PUSH,
+    H_POP,
+    H_JUMP,
+    H_JUMPI,
+    H_JUMPIF,
+    H_HALT,
+    H_END, ///< Sentinel placed just past the end of the code store
+
+    // primitives 1 to 18, in order, then the output and heap primitives
+    H_ID,
+    H_NOT,
+    H_AND,
+    H_OR,
+    H_SUCC,
+    H_PRED,
+    H_NEG,
+    H_ADD,
+    H_SUB,
+    H_MULT,
+    H_DIV,
+    H_MOD,
+    H_LT,
+    H_LE,
+    H_GE,
+    H_GT,
+    H_EQ,
+    H_NEQ,
+    H_PUT,
+    H_PUTEOL,
+    H_PUTINT,
+    H_NEW,
+    H_DISPOSE,
+
+    // superinstructions, placed on the first instruction of a sequence; the
+    // instructions they cover keep their own handlers. Everything from here
+    // on stands in for a handler above, as isPlainHandler() relies on
+    H_LOAD_LOAD_BINARY,    ///< LOAD(1) a; LOAD(1) b; CALL binary
+    H_LOAD_BINARY,         ///< LOAD(1) a; CALL binary
+    H_LOAD_BINARY_JUMPIF,  ///< LOAD(1) a; CALL binary; JUMPIF(n) t
+    H_LOADL_BINARY,        ///< LOADL n; CALL binary
+    H_LOADL_BINARY_JUMPIF, ///< LOADL n; CALL binary; JUMPIF(n) t
+    H_BINARY_JUMPIF,       ///< CALL binary; JUMPIF(n) t
+    H_LOAD_UNARY_STORE,    ///< LOAD(1) a; CALL unary; STORE(1) b
+    H_LOAD_JUMPIF,         ///< LOAD(1) a; JUMPIF(n) t
+
+    // variants placed by verifyProgram() without the checks it has proved
+    // cannot fail; overflow checks stay, since HT can move
+    H_LOAD_U,       ///< H_LOAD without the access check
+    H_LOAD_DYN_U,   ///< H_LOAD_DYN relative to LB or ST, likewise
+    H_STORE_U,      ///< H_STORE without the underflow and access checks
+    H_STORE_DYN_U,  ///< H_STORE_DYN relative to LB or ST, likewise
+    H_CALL_U,       ///< H_CALL to an address inside the program
+    H_POP_U,        ///< H_POP without the underflow check
+    H_JUMP_U,       ///< H_JUMP to an address inside the program
+    H_JUMPIF_U,     ///< H_JUMPIF, likewise and without the underflow check
+
+    // primitives 2 to 16, in order, without their underflow checks
+    H_NOT_U,
+    H_AND_U,
+    H_OR_U,
+    H_SUCC_U,
+    H_PRED_U,
+    H_NEG_U,
+    H_ADD_U,
+    H_SUB_U,
+    H_MULT_U,
+    H_DIV_U,
+    H_MOD_U,
+    H_LT_U,
+    H_LE_U,
+    H_GE_U,
+    H_GT_U,
+    NUM_HANDLERS
+} Handler;
+
+/// Value of `TamProgram::Depth` where the verifier could not prove ST - LB.
+#define DEPTH_UNKNOWN INT32_MIN
+
+/// @brief Choose the interpreter routine for a decoded instruction.
+/// @param Instr instruction with its operands already resolved
+/// @return the handler to store in `Instr->Handler`
+Handler selectHandler(const Instruction *Instr);
+
+/// @brief Check whether a handler is one selectHandler() picks, rather
+/// than a superinstruction or an unchecked variant placed later.
+static inline int isPlainHandler(Handler H) { return H < H_LOAD_LOAD_BINARY; }
+
+/// @brief Replace common instruction sequences with superinstructions.
+/// @param[in,out] Code decoded program with handlers already selected
+/// @param Count number of instructions in the program
+void fuseInstructions(Instruction *Code, int Count);
+
+/// @brief Prove what can be proved about a program before it runs, and
+/// drop the checks that the proof makes unnecessary.
+///
+/// The verifier builds the control flow graph from the static jumps and
+/// calls, and follows ST - LB along it from the start of the program and
+/// from the entry of every routine, where a CALL sets it to 3. Where every
+/// path into an instruction agrees on its value, the instruction's
+/// underflow checks and its checks on accesses below ST can be decided
+/// before the program runs. Static jumps and calls that stay inside the
+/// program need no check on their target at all.
+///
+/// Each proof only holds if control got there along the graph. Returns,
+/// JUMPI and anything else that can land elsewhere check the recorded
+/// depth of where they land and run instructions one at a time through
+/// their checked routines until it matches again.
+/// @param[in,out] Code decoded and fused program; handlers are replaced
+/// with their unchecked variants where proved safe
+/// @param[out] Depth ST - LB at each instruction, or DEPTH_UNKNOWN, with
+/// one more entry for the sentinel
+/// @param Count number of instructions in the program
+void verifyProgram(Instruction *Code, int32_t *Depth, int Count);
+
+/// @brief How control leaves the last instruction of a basic block.
+typedef enum BlockExit {
+    EXIT_NONE,    ///< It doesn't: the block runs off the end of the program
+    EXIT_CALL,    ///< A CALL to `Taken`
+    EXIT_JUMP,    ///< A JUMP to `Taken`
+    EXIT_BRANCH,  ///< A JUMPIF to `Taken`, or on to the next block
+    EXIT_DYNAMIC, ///< RETURN, JUMPI or anything run through execute()
+    EXIT_HALT,    ///< HALT
+} BlockExit;
+
+/// @brief A run of instructions that control enters at the first and only
+/// leaves after the last.
+///
+/// Blocks are found by runInterpreter() the first time control enters them,
+/// and end at the first instruction that can go anywhere but the next one.
+/// A block can start part way through another, where something jumps in.
+/// Each block is kept at the index of its first instruction, so its start
+/// is its index and the block after it is `Length` further on.
+typedef struct BasicBlock {
+    uint32_t Length; ///< Number of instructions, 0 until found
+    ADDRESS Taken;   ///< Where a static jump or call goes
+    uint8_t Exit;    ///< How control leaves, a BlockExit
+} BasicBlock;
+
+/// @brief The basic blocks of a program found by one emulator so far.
+struct TamBlockCache {
+    TamProgram *Program; ///< Program the blocks are in, with a reference held
+    int Size;            ///< Number of instructions in `Program`
+    BasicBlock Blocks[]; ///< Block starting at each address, and one more
+};
+
+/// @brief Make an empty block cache for a program.
+/// @param Program program whose blocks will be cached
+/// @return the cache, or null if allocation failed
+TamBlockCache *newBlockCache(TamProgram *Program);
+
+/// @brief Fill in the descriptor of a block that has not been found yet.
+/// @param[in,out] Cache cache holding the block
+/// @param Code the cached program's decoded instructions
+/// @param[out] Block entry of `Cache->Blocks` at the block's start; the entry
+/// just past the end of the program keeps length 0
+void findBlock(TamBlockCache *Cache, const Instruction *Code,
+               BasicBlock *Block);
+
+/// Apply a primitive that replaces the top word of the stack.
+static inline DATA_W unaryPrimitive(int Prim, WIDE_W Arg1) {
+    switch (Prim) {
+    case 2: // not
+        return Arg1 ? 0 : 1;
+    case 5: // succ
+        return Arg1 + 1;
+    case 6: // pred
+        return Arg1 - 1;
+    case 7: // neg
+        return -Arg1;
+    default: // id
+        return Arg1;
+    }
+}
+
+/// Check whether a binary primitive would divide by zero.
+/// @param Prim primitive number
+/// @param Arg2 the word below the top of the stack, which div and mod
+/// divide by
+static inline int dividesByZero(int Prim, DATA_W Arg2) {
+    return (Prim == 11 || Prim == 12) && Arg2 == 0;
+}
+
+/// Apply a primitive that replaces the top two words with one.
+/// @param Prim primitive number
+/// @param Arg1 the word on top of the stack
+/// @param Arg2 the word below it
+static inline DATA_W binaryPrimitive(int Prim, WIDE_W Arg1, WIDE_W Arg2) {
+    switch (Prim) {
+    case 3: // and
+        return Arg1 * Arg2 ? 1 : 0;
+    case 4: // or
+        return Arg1 + Arg2 ? 1 : 0;
+    case 8: // add
+        return Arg1 + Arg2;
+    case 9: // sub
+        return Arg1 - Arg2;
+    case 10: // mult
+        return Arg1 * Arg2;
+    case 11: // div
+        return Arg1 / Arg2;
+    case 12: // mod
+        return Arg1 % Arg2;
+    case 13: // lt
+        return Arg1 < Arg2 ? 1 : 0;
+    case 14: // le
+        return Arg1 <= Arg2 ? 1 : 0;
+    case 15: // ge
+        return Arg1 >= Arg2 ? 1 : 0;
+    default: // gt
+        return Arg1 >= Arg2 ? 1 : 0;
+    }
+}
+
+/// @brief Cut the step limit for a run down to what is left of the
+/// emulator's `StepBudget`.
+/// @param Emulator emulator about to run
+/// @param[in,out] MaxSteps limit for the run, 0 for none
+/// @return 0, or `ErrStepBudget` if there is nothing left
+static inline int fitStepBudget(const TamEmulator *Emulator,
+                                uint64_t *MaxSteps) {
+    uint64_t Budget = Emulator->StepBudget;
+    if (!Budget) {
+        return 0;
+    }
+    if (Emulator->Steps >= Budget) {
+        return ErrStepBudget;
+    }
+    if (!*MaxSteps || *MaxSteps > Budget - Emulator->Steps) {
+        *MaxSteps = Budget - Emulator->Steps;
+    }
+    return 0;
+}
+
+/// @brief Report running out of steps as `ErrStepBudget` where it was the
+/// emulator's budget, not the run's limit, that ran out.
+static inline int stepBudgetResult(const TamEmulator *Emulator, int ErrCode) {
+    if (ErrCode == ErrStepLimit && Emulator->StepBudget &&
+        Emulator->Steps >= Emulator->StepBudget) {
+        return ErrStepBudget;
+    }
+    return ErrCode;
+}
+
+/// Check whether an emulator has been told to stop by setting `TimeUp`.
+static inline int timeUp(const TamEmulator *Emulator) {
+    return atomic_load_explicit(&Emulator->TimeUp, memory_order_relaxed);
+}
+
+/// @brief What runInterpreter() counts for runEmulatorProfiled().
+typedef struct BlockProfile {
+    TamProfiler *Profiler; ///< Per-instruction counts and callbacks
+    uint64_t *Entries;     ///< Times each block was entered, by its start
+} BlockProfile;
+
+/// @brief Run a loaded program as runEmulator() does, but without flushing
+/// output when it stops.
+///
+/// With a profile, each block entered is counted in `Entries`, and each
+/// instruction run on its own straight into the profiler's counts. Those of
+/// a block left part way through are taken off again, so that adding every
+/// block's entries to the counts of its instructions gives exact counts.
+/// @param[in,out] Emulator emulator to run
+/// @param MaxSteps maximum number of instructions to execute, 0 for no limit
+/// @param[in,out] Prof counts to keep, or null
+/// @return as for runEmulator()
+int runInterpreter(TamEmulator *Emulator, uint64_t MaxSteps,
+                   const BlockProfile *Prof);
+
+/// @brief Refill an emulator's input buffer from its backend.
+///
+/// Once `Stop` is set this reads nothing, and sets `InStopped` instead of
+/// reaching the end of the input.
+/// @param[in,out] IO stream whose buffer is empty
+/// @return 1 if more input is available, 0 at end of input or if stopped
+int refillInput(TamIO *IO);
+
+/// @brief Check whether an input primitive can run to completion on the
+/// input already available, which only a feed can lack.
+/// @param IO stream the primitive reads
+/// @param Prim primitive number: 19, 20, 21, 23 or 25
+/// @return 1 if it can, 0 if it must wait for feedInput()
+int inputReady(const TamIO *IO, int Prim);
+
+/// @brief Make room in an emulator's output buffer, allocating it on first
+/// use and flushing it otherwise.
+/// @param[in,out] IO stream whose buffer is missing or full
+void makeOutputRoom(TamIO *IO);
+
+/// @brief Parse an optionally signed decimal integer, skipping leading
+/// whitespace. The first character after the number is left unread.
+/// @param[in,out] IO stream to read from
+/// @return the value modulo 2^TAM_WORD_BITS, or 0 if there were no digits
+DATA_W readInt(TamIO *IO);
+
+/// @brief Write an integer in decimal.
+/// @param[in,out] IO stream to write to
+/// @param Value integer to write
+void writeInt(TamIO *IO, DATA_W Value);
+
+/// @brief Look at the next input character without consuming it.
+/// @param[in,out] IO stream to read from
+/// @return the character as an unsigned byte, or -1 at end of input
+static inline int peekChar(TamIO *IO) {
+    if (IO->InPos < IO->InLen || refillInput(IO)) {
+        return (unsigned char)IO->In[IO->InPos];
+    }
+    return -1;
+}
+
+/// @brief Read the next input character.
+/// @param[in,out] IO stream to read from
+/// @return the character as an unsigned byte, or -1 at end of input
+static inline int getChar(TamIO *IO) {
+    int C = peekChar(IO);
+    if (C >= 0) {
+        ++IO->InPos;
+    }
+    return C;
+}
+
+/// @brief Write a single character.
+/// @param[in,out] IO stream to write to
+/// @param C character to write
+static inline void putChar(TamIO *IO, char C) {
+    if (!IO->Out || IO->OutLen == TAM_IO_BUFFER_SIZE) {
+        makeOutputRoom(IO);
+        if (!IO->Out) {
+            return;
+        }
+    }
+    IO->Out[IO->OutLen++] = C;
+}
+
+#endif
@@ -0,0 +1,308 @@
+#include <tam/io.h>
+
+#include "internal.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+void setInputFd(TamIO *IO, int Fd) {
+    assert(IO);
+    IO->InKind = TamIOFd;
+    IO->InFd = Fd;
+    IO->In = IO->InStore;
+    IO->InPos = IO->InLen = 0;
+    IO->InEof = 0;
+}
+
+void setInputMemory(TamIO *IO, const char *Data, size_t Size) {
+    assert(IO);
+    IO->InKind = TamIOMemory;
+    IO->In = Data;
+    IO->InPos = 0;
+    IO->InLen = Size;
+    IO->InEof = 1;
+}
+
+void setInputCallback(TamIO *IO, TamReadFn Read, void *Context) {
+    assert(IO);
+    assert(Read);
+    IO->InKind = TamIOCallback;
+    IO->Read = Read;
+    IO->ReadContext = Context;
+    IO->In = IO->InStore;
+    IO->InPos = IO->InLen = 0;
+    IO->InEof = 0;
+}
+
+void setInputFeed(TamIO *IO) {
+    assert(IO);
+    IO->InKind = TamIOFeed;
+    IO->In = IO->InStore;
+    IO->InPos = IO->InLen = 0;
+    IO->InEof = 0;
+}
+
+int feedInput(TamIO *IO, const char *Data, size_t Size) {
+    assert(IO);
+    assert(IO->InKind == TamIOFeed);
+    // what has been read is dropped, and the rest moved to the front
+    size_t Unread = IO->InLen - IO->InPos;
+    if (Unread + Size > IO->InCapacity) {
+        size_t Capacity = IO->InCapacity ? IO->InCapacity : TAM_IO_BUFFER_SIZE;
+        while (Capacity < Unread + Size) {
+            Capacity *= 2;
+        }
+        char *Store = malloc(Capacity);
+        if (!Store) {
+            return -1;
+        }
+        memcpy(Store, IO->In + IO->InPos, Unread);
+        free(IO->InStore);
+        IO->InStore = Store;
+        IO->InCapacity = Capacity;
+    } else if (Unread) {
+        memmove(IO->InStore, IO->In + IO->InPos, Unread);
+    }
+    memcpy(IO->InStore + Unread, Data, Size);
+    IO->In = IO->InStore;
+    IO->InPos = 0;
+    IO->InLen = Unread + Size;
+    return 0;
+}
+
+void endInput(TamIO *IO) {
+    assert(IO);
+    IO->InEof = 1;
+}
+
+void setOutputFd(TamIO *IO, int Fd) {
+    assert(IO);
+    flushOutput(IO);
+    IO->OutKind = TamIOFd;
+    IO->OutFd = Fd;
+}
+
+void setOutputMemory(TamIO *IO, TamBuffer *Buffer) {
+    assert(IO);
+    assert(Buffer);
+    flushOutput(IO);
+    IO->OutKind = TamIOMemory;
+    IO->OutMemory = Buffer;
+}
+
+void setOutputCallback(TamIO *IO, TamWriteFn Write, void *Context) {
+    assert(IO);
+    assert(Write);
+    flushOutput(IO);
+    IO->OutKind = TamIOCallback;
+    IO->Write = Write;
+    IO->WriteContext = Context;
+}
+
+/// Write a whole block to a file descriptor, retrying short writes.
+static int writeFd(int Fd, const char *Buf, size_t Size) {
+    while (Size) {
+        ssize_t Written = write(Fd, Buf, Size);
+        if (Written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        Buf += Written;
+        Size -= Written;
+    }
+    return 0;
+}
+
+/// Append a block to a growable buffer, doubling its capacity as needed.
+static int appendBuffer(TamBuffer *Buffer, const char *Buf, size_t Size) {
+    if (Buffer->Size + Size > Buffer->Capacity) {
+        size_t Capacity = Buffer->Capacity ? Buffer->Capacity : 256;
+        while (Capacity < Buffer->Size + Size) {
+            Capacity *= 2;
+        }
+        char *Data = realloc(Buffer->Data, Capacity);
+        if (!Data) {
+            return -1;
+        }
+        Buffer->Data = Data;
+        Buffer->Capacity = Capacity;
+    }
+    memcpy(Buffer->Data + Buffer->Size, Buf, Size);
+    Buffer->Size += Size;
+    return 0;
+}
+
+int flushOutput(TamIO *IO) {
+    assert(IO);
+    int Result = 0;
+    if (!IO->OutLen) {
+        return 0;
+    }
+
+    switch (IO->OutKind) {
+    case TamIOFd:
+        Result = writeFd(IO->OutFd, IO->Out, IO->OutLen);
+        break;
+    case TamIOMemory:
+        Result = appendBuffer(IO->OutMemory, IO->Out, IO->OutLen);
+        break;
+    case TamIOCallback:
+        Result = IO->Write(IO->WriteContext, IO->Out, IO->OutLen);
+        break;
+    case TamIOFeed:
+        // feeds are for input only; no output is ever sent to one
+        break;
+    }
+    IO->OutLen = 0;
+    return Result;
+}
+
+void closeIO(TamIO *IO) {
+    assert(IO);
+    flushOutput(IO);
+    free(IO->InStore);
+    free(IO->Out);
+    IO->InStore = IO->Out = NULL;
+    IO->InCapacity = 0;
+    if (IO->InKind != TamIOMemory) {
+        IO->In = NULL;
+        IO->InPos = IO->InLen = 0;
+    }
+}
+
+int refillInput(TamIO *IO) {
+    // a feed is never read past what inputReady() has seen
+    if (IO->InEof || IO->InKind == TamIOFeed) {
+        return 0;
+    }
+    if (!IO->InStore) {
+        if (!(IO->InStore = malloc(TAM_IO_BUFFER_SIZE))) {
+            return 0;
+        }
+        IO->InCapacity = TAM_IO_BUFFER_SIZE;
+    }
+
+    // anything already written may be a prompt for the input we are about
+    // to wait for
+    flushOutput(IO);
+
+    // a read interrupted by a signal is resumed, unless the signal was
+    // there to stop the run
+    long Read;
+    for (;;) {
+        if (IO->Stop && atomic_load_explicit(IO->Stop, memory_order_relaxed)) {
+            IO->In = IO->InStore;
+            IO->InPos = IO->InLen = 0;
+            IO->InStopped = 1;
+            return 0;
+        }
+        if (IO->InKind == TamIOFd) {
+            Read = read(IO->InFd, IO->InStore, TAM_IO_BUFFER_SIZE);
+        } else {
+            Read = IO->Read(IO->ReadContext, IO->InStore, TAM_IO_BUFFER_SIZE);
+        }
+        if (Read >= 0 || IO->InKind != TamIOFd || errno != EINTR) {
+            break;
+        }
+    }
+
+    IO->In = IO->InStore;
+    IO->InPos = 0;
+    if (Read <= 0) {
+        IO->InLen = 0;
+        IO->InEof = 1;
+        return 0;
+    }
+    IO->InLen = Read;
+    return 1;
+}
+
+void makeOutputRoom(TamIO *IO) {
+    if (!IO->Out) {
+        IO->Out = malloc(TAM_IO_BUFFER_SIZE);
+        return;
+    }
+    flushOutput(IO);
+}
+
+/// Check for a character that readInt() skips before a number.
+static int isSpace(int C) {
+    return C == ' ' || C == '\t' || C == '\n' || C == '\r' || C == '\v' ||
+           C == '\f';
+}
+
+int inputReady(const TamIO *IO, int Prim) {
+    if (IO->InKind != TamIOFeed || IO->InEof) {
+        return 1;
+    }
+    const char *P = IO->In + IO->InPos;
+    const char *End = IO->In + IO->InLen;
+    switch (Prim) {
+    case 23: // geteol
+        return memchr(P, '\n', End - P) != NULL;
+    case 25: // getint, which looks at the character after the number
+        while (P < End && isSpace(*P)) {
+            ++P;
+        }
+        if (P < End && (*P == '-' || *P == '+')) {
+            ++P;
+        }
+        while (P < End && *P >= '0' && *P <= '9') {
+            ++P;
+        }
+        return P < End;
+    default: // eol, eof and get
+        return P < End;
+    }
+}
+
+DATA_W readInt(TamIO *IO) {
+    int C = peekChar(IO);
+    while (isSpace(C)) {
+        ++IO->InPos;
+        C = peekChar(IO);
+    }
+
+    int Negative = 0;
+    if (C == '-' || C == '+') {
+        Negative = C == '-';
+        ++IO->InPos;
+        C = peekChar(IO);
+    }
+
+    // accumulate modulo 2^64, of which a DATA_W keeps what it can hold
+    uint64_t Value = 0;
+    while (C >= '0' && C <= '9') {
+        Value = Value * 10 + (C - '0');
+        ++IO->InPos;
+        C = peekChar(IO);
+    }
+    return (DATA_W)(Negative ? -Value : Value);
+}
+
+void writeInt(TamIO *IO, DATA_W Value) {
+    char Digits[12];
+    char *End = Digits + sizeof(Digits);
+    char *P = End;
+    uint32_t Magnitude = Value < 0 ? -(int64_t)Value : Value;
+
+    do {
+        *--P = '0' + Magnitude % 10;
+        Magnitude /= 10;
+    } while (Magnitude);
+    if (Value < 0) {
+        *--P = '-';
+    }
+
+    if (!IO->Out || IO->OutLen + (End - P) > TAM_IO_BUFFER_SIZE) {
+        makeOutputRoom(IO);
+        if (!IO->Out) {
+            return;
+        }
+    }
+    memcpy(IO->Out + IO->OutLen, P, End - P);
+    IO->OutLen += End - P;
+}
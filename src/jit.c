@@ -0,0 +1,1166 @@
+#include <tam/tam.h>
+
+#include "internal.h"
+#include <assert.h>
+#include <tam/error.h>
+
+#ifndef TAM_JIT
+
+int runEmulatorJit(TamEmulator *Emulator, uint64_t MaxSteps) {
+    return runEmulator(Emulator, MaxSteps);
+}
+
+void freeJit(TamJit *Jit) { assert(!Jit); }
+
+#else
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// The compiler works a basic block at a time. A block starts wherever
+// control arrives and runs to the next jump, call, return or halt, or to the
+// first instruction the compiler leaves to the interpreter. Blocks are
+// interpreted until they have run JIT_THRESHOLD times, then compiled.
+//
+// Compiled code keeps the emulator's state in host registers:
+//
+//   RBX  DataStore          R12  ST at the start of the block
+//   RBP  JitState           R13  LB
+//   R15  steps left         R14  HT
+//
+// Within a block ST is tracked at compile time as an offset from R12, and
+// R12 is only moved when the block ends. Every value pushed is written to
+// the data store straight away, so memory is always as the interpreter
+// would leave it; EAX additionally caches the value of one stack slot.
+//
+// Compiled code never reports an error itself. Whatever can be checked
+// before a block runs (stack depth, stack room, addresses relative to SB or
+// LB, the step budget) is checked once on entry, and the block is
+// interpreted instead if any check fails. Whatever depends on values (LOADI
+// addresses, divisors, return addresses) is checked in line, and on failure
+// the block hands back to the interpreter at that instruction, with every
+// register as it was before it. The interpreter then reports the error, so
+// error codes, CP and the data store match an interpreted run exactly.
+
+/// Number of times a block is interpreted before it is compiled.
+#define JIT_THRESHOLD 16
+/// Count marking a block that cannot be compiled.
+#define JIT_NEVER UINT16_MAX
+/// Longest block, in instructions.
+#define JIT_MAX_BLOCK 128
+/// Size of the executable buffer compiled code goes into.
+#define JIT_CODE_SIZE (4 << 20)
+/// Size of the scratch buffer a block is compiled into before it is placed.
+#define JIT_SCRATCH_SIZE (64 << 10)
+/// Slot number meaning no slot.
+#define NO_SLOT INT32_MIN
+
+/// Reasons compiled code returns to runEmulatorJit().
+enum {
+    JIT_CONTINUE,  ///< Carry on at CP, in compiled code if there is some
+    JIT_INTERPRET, ///< Interpret the block at CP
+    JIT_HALT,      ///< The program halted
+};
+
+/// @brief State shared by runEmulatorJit() and compiled code.
+typedef struct JitState {
+    DATA_W *Mem;              ///< The emulator's data store
+    TamIO *IO;                ///< The emulator's I/O streams
+    const void *Exit;         ///< Stub that returns to runEmulatorJit()
+    const atomic_int *TimeUp; ///< The emulator's `TimeUp` flag
+    uint64_t Budget;          ///< Steps left
+    uint32_t St;              ///< ST
+    uint32_t Lb;              ///< LB
+    uint32_t Ht;              ///< HT
+    uint32_t Cp;              ///< CP
+    uint32_t StHigh;          ///< Highest value ST may have reached
+    uint32_t Unused;          ///< Pads `Table` to 8 bytes
+    const void *Table[];      ///< Code for each address, or a stub to return
+} JitState;
+
+/// Signature of the stub that enters compiled code.
+typedef int (*JitEnterFn)(JitState *State, const void *Code);
+
+struct TamJit {
+    TamProgram *Program;   ///< Program compiled, with a reference held
+    int Size;              ///< Number of instructions
+    ADDRESS Registers[16]; ///< Static registers for the program
+    uint8_t *Buf;          ///< Executable buffer
+    size_t Used;           ///< Bytes of `Buf` in use
+    JitEnterFn Enter;      ///< Stub that enters compiled code
+    const void *Continue;  ///< Stub for addresses with no compiled code
+    uint16_t *Counts;      ///< Times each block has been interpreted
+    uint16_t *Lengths;     ///< Length of each interpreted block, or 0
+    uint8_t *Scratch;      ///< Buffer for the block being compiled
+    JitState *State;       ///< State shared with compiled code
+};
+
+// Host registers, numbered as in instruction encodings.
+enum {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R12 = 12,
+    R13,
+    R14,
+    R15,
+};
+
+// Condition codes.
+enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_S = 0x8,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf,
+};
+
+/// @brief A memory operand, `[Base + Index * Scale + Disp]`.
+typedef struct Operand {
+    int Base;
+    int Index; ///< Index register, or -1 for none
+    int Scale;
+    int32_t Disp;
+} Operand;
+
+/// @brief Machine code being written to a buffer.
+typedef struct Emitter {
+    uint8_t *Start;
+    uint8_t *P;
+    uint8_t *End;
+    int Full; ///< Nonzero if the code did not fit
+} Emitter;
+
+static void emitByte(Emitter *E, int B) {
+    if (E->P < E->End) {
+        *E->P++ = B;
+    } else {
+        E->Full = 1;
+    }
+}
+
+static void emit32(Emitter *E, uint32_t V) {
+    for (int i = 0; i < 4; ++i) {
+        emitByte(E, V >> 8 * i);
+    }
+}
+
+static void emit64(Emitter *E, uint64_t V) {
+    emit32(E, V);
+    emit32(E, V >> 32);
+}
+
+static size_t offset(const Emitter *E) { return E->P - E->Start; }
+
+/// Emit an opcode of one byte, or two if it starts with 0x0f.
+static void emitOpcode(Emitter *E, int Op) {
+    if (Op > 0xff) {
+        emitByte(E, Op >> 8);
+    }
+    emitByte(E, Op);
+}
+
+/// Emit a REX prefix if one is needed.
+static void emitRex(Emitter *E, int W, int Reg, int Index, int Base) {
+    int Rex = 0x40 | W << 3 | (Reg >> 3 & 1) << 2 |
+              (Index >= 0 ? Index >> 3 & 1 : 0) << 1 | (Base >> 3 & 1);
+    if (Rex != 0x40) {
+        emitByte(E, Rex);
+    }
+}
+
+/// @brief Emit an instruction with a register and a memory operand.
+/// @param Prefix 0x66 for a 16-bit operation, otherwise 0
+/// @param W 1 for a 64-bit operation
+/// @param Op opcode
+/// @param Reg register, or opcode extension
+/// @param M memory operand, always encoded with a 32-bit displacement
+static void emitMem(Emitter *E, int Prefix, int W, int Op, int Reg,
+                    Operand M) {
+    if (Prefix) {
+        emitByte(E, Prefix);
+    }
+    emitRex(E, W, Reg, M.Index, M.Base);
+    emitOpcode(E, Op);
+    if (M.Index >= 0 || (M.Base & 7) == RSP) {
+        int Scale = M.Scale == 8 ? 3 : M.Scale == 4 ? 2 : M.Scale == 2 ? 1 : 0;
+        int Index = M.Index >= 0 ? M.Index & 7 : RSP;
+        emitByte(E, 0x80 | (Reg & 7) << 3 | RSP);
+        emitByte(E, Scale << 6 | Index << 3 | (M.Base & 7));
+    } else {
+        emitByte(E, 0x80 | (Reg & 7) << 3 | (M.Base & 7));
+    }
+    emit32(E, M.Disp);
+}
+
+/// Emit an instruction with two register operands.
+static void emitReg(Emitter *E, int W, int Op, int Reg, int Rm) {
+    emitRex(E, W, Reg, -1, Rm);
+    emitOpcode(E, Op);
+    emitByte(E, 0xc0 | (Reg & 7) << 3 | (Rm & 7));
+}
+
+static Operand base(int Base, int32_t Disp) {
+    return (Operand){Base, -1, 1, Disp};
+}
+
+static Operand indexed(int Base, int Index, int Scale, int32_t Disp) {
+    return (Operand){Base, Index, Scale, Disp};
+}
+
+/// The stack slot `Slot` words above ST at the start of the block.
+static Operand slot(int Slot) { return indexed(RBX, R12, 2, 2 * Slot); }
+
+/// A field of the JitState.
+static Operand field(size_t Offset) { return base(RBP, Offset); }
+
+/// The Table entry for an address.
+static Operand tableEntry(int Addr) {
+    return field(offsetof(JitState, Table) + 8 * Addr);
+}
+
+static void movsx16(Emitter *E, int R, Operand M) {
+    emitMem(E, 0, 0, 0x0fbf, R, M);
+}
+
+static void movzx16(Emitter *E, int R, Operand M) {
+    emitMem(E, 0, 0, 0x0fb7, R, M);
+}
+
+static void store16(Emitter *E, int R, Operand M) {
+    emitMem(E, 0x66, 0, 0x89, R, M);
+}
+
+static void store16Imm(Emitter *E, int Imm, Operand M) {
+    emitMem(E, 0x66, 0, 0xc7, 0, M);
+    emitByte(E, Imm);
+    emitByte(E, Imm >> 8);
+}
+
+static void lea(Emitter *E, int R, Operand M) {
+    emitMem(E, 0, 0, 0x8d, R, M);
+}
+
+static void movRR(Emitter *E, int Dst, int Src) {
+    emitReg(E, 0, 0x89, Src, Dst);
+}
+
+static void movRI(Emitter *E, int R, int32_t Imm) {
+    emitRex(E, 0, 0, -1, R);
+    emitByte(E, 0xb8 + (R & 7));
+    emit32(E, Imm);
+}
+
+/// Apply a two-operand ALU opcode (add 0x01, sub 0x29, cmp 0x39, test
+/// 0x85) to `Dst` and `Src`.
+static void aluRR(Emitter *E, int Op, int Dst, int Src) {
+    emitReg(E, 0, Op, Src, Dst);
+}
+
+/// Apply an ALU operation with an immediate (add 0, sub 5, cmp 7).
+static void aluRI(Emitter *E, int W, int Ext, int R, int32_t Imm) {
+    emitReg(E, W, 0x81, Ext, R);
+    emit32(E, Imm);
+}
+
+/// Sign-extend the low 16 bits of a register.
+static void sext16(Emitter *E, int R) { emitReg(E, 0, 0x0fbf, R, R); }
+
+/// Set EAX to 1 if a condition holds and 0 otherwise.
+static void setcc(Emitter *E, int Cc) {
+    emitReg(E, 0, 0x0f90 | Cc, 0, RAX);
+    emitReg(E, 0, 0x0fb6, RAX, RAX);
+}
+
+/// Emit a conditional jump and return where its displacement goes.
+static size_t jcc(Emitter *E, int Cc) {
+    emitByte(E, 0x0f);
+    emitByte(E, 0x80 | Cc);
+    emit32(E, 0);
+    return offset(E) - 4;
+}
+
+/// Point the jump whose displacement is at `At` to `Target`.
+static void patch(Emitter *E, size_t At, size_t Target) {
+    if (!E->Full) {
+        uint32_t Rel = Target - (At + 4);
+        memcpy(E->Start + At, &Rel, 4);
+    }
+}
+
+static void jmpMem(Emitter *E, Operand M) { emitMem(E, 0, 0, 0xff, 4, M); }
+
+/// Return to runEmulatorJit() with CP in ESI.
+static void emitExit(Emitter *E, int Reason) {
+    movRI(E, RAX, Reason);
+    jmpMem(E, field(offsetof(JitState, Exit)));
+}
+
+/// Call a C function taking the emulator's I/O streams and ESI.
+static void emitCall(Emitter *E, void (*Fn)(TamIO *, int)) {
+    emitMem(E, 0, 1, 0x8b, RDI, field(offsetof(JitState, IO)));
+    emitRex(E, 1, 0, -1, RAX);
+    emitByte(E, 0xb8);
+    emit64(E, (uint64_t)(uintptr_t)Fn);
+    emitByte(E, 0xff);
+    emitByte(E, 0xd0);
+}
+
+/// Return to runEmulatorJit() with CP in ESI if the emulator has been told
+/// to stop. Every register is already as the interpreter would have it.
+static void pollTimeUp(Emitter *E) {
+    emitMem(E, 0, 1, 0x8b, RAX, field(offsetof(JitState, TimeUp)));
+    emitMem(E, 0, 0, 0x8b, RAX, base(RAX, 0));
+    aluRR(E, 0x85, RAX, RAX);
+    size_t Go = jcc(E, CC_E);
+    emitExit(E, JIT_CONTINUE);
+    patch(E, Go, offset(E));
+}
+
+static void jitPut(TamIO *IO, int C) { putChar(IO, C); }
+
+static void jitPutInt(TamIO *IO, int V) { writeInt(IO, V); }
+
+/// @brief A block being compiled.
+typedef struct Block {
+    const TamJit *Jit;
+    ADDRESS Start; ///< Address of the first instruction
+    int Len;       ///< Instructions compiled so far
+    int K;         ///< ST, as an offset from R12
+    int Cached;    ///< Slot whose value is in EAX
+    int ConstSlot; ///< Slot whose value is known, or NO_SLOT
+    int Const;     ///< The known value
+
+    // checks made on entry
+    int MinSt;   ///< ST must be at least this
+    int MaxNeed; ///< ST plus this must not exceed HT
+    int Touch;   ///< Largest offset ST reaches
+    int UsesLb;  ///< Nonzero if anything is addressed relative to LB
+    int LbMin;   ///< LB plus this must not be negative
+    int LbMax;   ///< LB plus this must not exceed ST
+
+    int NumExits;
+    struct {
+        size_t At; ///< Jump to patch
+        int Index; ///< Instruction that could not be run
+        int K;     ///< Offset of ST before it
+    } Exits[2 * JIT_MAX_BLOCK];
+} Block;
+
+static int max(int A, int B) { return A > B ? A : B; }
+
+static int min(int A, int B) { return A < B ? A : B; }
+
+/// Require ST to be at least `N` words.
+static void needDepth(Block *B, int N) { B->MinSt = max(B->MinSt, N - B->K); }
+
+/// Require room for `N` more words between ST and HT.
+static void needRoom(Block *B, int N) {
+    B->MaxNeed = max(B->MaxNeed, B->K + N);
+}
+
+/// Note that ST has reached its current offset.
+static void touch(Block *B) { B->Touch = max(B->Touch, B->K); }
+
+/// Require `N` words addressed by a LOAD or STORE to lie below ST.
+static void needAccess(Block *B, const Instruction *I, int N) {
+    if (I->R == LB) {
+        B->UsesLb = 1;
+        B->LbMin = min(B->LbMin, I->D);
+        B->LbMax = max(B->LbMax, I->D + N - B->K);
+    } else {
+        B->MinSt = max(B->MinSt, I->Target + N - B->K);
+    }
+}
+
+/// The memory a LOAD or STORE addresses.
+static Operand accessed(const Instruction *I) {
+    return I->R == LB ? indexed(RBX, R13, 2, 2 * I->D)
+                      : base(RBX, 2 * I->Target);
+}
+
+/// Note that a slot has been written.
+static void wrote(Block *B, int Slot) {
+    if (B->Cached == Slot) {
+        B->Cached = NO_SLOT;
+    }
+    if (B->ConstSlot == Slot) {
+        B->ConstSlot = NO_SLOT;
+    }
+}
+
+/// Load the value of a stack slot, sign-extended, into a register.
+static void loadSlot(Block *B, Emitter *E, int R, int Slot) {
+    if (B->ConstSlot == Slot) {
+        movRI(E, R, B->Const);
+    } else if (B->Cached == Slot) {
+        if (R != RAX) {
+            movRR(E, R, RAX);
+        }
+    } else {
+        movsx16(E, R, slot(Slot));
+    }
+}
+
+/// Store EAX to a stack slot and remember that it holds it.
+static void storeSlot(Block *B, Emitter *E, int Slot) {
+    store16(E, RAX, slot(Slot));
+    wrote(B, Slot);
+    B->Cached = Slot;
+}
+
+/// Copy words upwards in memory, or to a lower address that may overlap.
+static void copyWords(Block *B, Emitter *E, Operand Dst, Operand Src, int N) {
+    for (int i = 0; i < N;) {
+        int Size = N - i >= 4 ? 8 : N - i >= 2 ? 4 : 2;
+        Operand From = Src, To = Dst;
+        From.Disp += 2 * i;
+        To.Disp += 2 * i;
+        if (Size == 8) {
+            emitMem(E, 0, 1, 0x8b, RAX, From);
+            emitMem(E, 0, 1, 0x89, RAX, To);
+        } else if (Size == 4) {
+            emitMem(E, 0, 0, 0x8b, RAX, From);
+            emitMem(E, 0, 0, 0x89, RAX, To);
+        } else {
+            movzx16(E, RAX, From);
+            store16(E, RAX, To);
+        }
+        i += Size / 2;
+    }
+    B->Cached = NO_SLOT;
+}
+
+/// Hand back to the interpreter at the current instruction if a condition
+/// holds.
+static void sideExit(Block *B, Emitter *E, int Cc, int K) {
+    int N = B->NumExits++;
+    B->Exits[N].At = jcc(E, Cc);
+    B->Exits[N].Index = B->Len;
+    B->Exits[N].K = K;
+}
+
+/// Move R12 to the final ST of the block.
+static void commit(Block *B, Emitter *E) {
+    if (B->K) {
+        lea(E, R12, indexed(R12, -1, 1, B->K));
+    }
+}
+
+/// Continue at a known address, in compiled code if it has any, first
+/// looking for a timeout if `Poll` is set.
+static void chain(Emitter *E, int Addr, int Poll) {
+    movRI(E, RSI, Addr);
+    if (Poll) {
+        pollTimeUp(E);
+    }
+    jmpMem(E, tableEntry(Addr));
+}
+
+/// Continue at the address in ESI, which is below CT.
+static void chainDynamic(Emitter *E) {
+    pollTimeUp(E);
+    jmpMem(E, indexed(RBP, RSI, 8, offsetof(JitState, Table)));
+}
+
+/// Check whether a block must end after an instruction.
+static int endsBlock(const Instruction *I) {
+    switch (I->Op) {
+    case CALL:
+        return !(I->R == PB && I->D > 0 && I->D < 29);
+    case CALLI:
+    case RETURN:
+    case JUMP:
+    case JUMPI:
+    case JUMPIF:
+    case HALT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/// @brief Compile one instruction.
+/// @param[in,out] B block being compiled
+/// @param[in,out] E emitter for the body of the block
+/// @param I the instruction
+/// @return 1 if it was compiled and the block goes on, 2 if it was compiled
+/// and ended the block, 0 if it must be left to the interpreter
+static int compileInstruction(Block *B, Emitter *E, const Instruction *I) {
+    const int Size = B->Jit->Size;
+    const ADDRESS Here = B->Start + B->Len;
+    const int K = B->K;
+    int N = I->N;
+    int D = I->D;
+    Handler H = selectHandler(I);
+
+    if ((H == H_LOAD_DYN || H == H_STORE_DYN || H == H_LOADA_DYN) &&
+        I->R != LB) {
+        return 0;
+    }
+
+    switch (H) {
+    case H_LOAD:
+    case H_LOAD_DYN:
+        needAccess(B, I, N);
+        needRoom(B, N);
+        if (N == 1) {
+            movsx16(E, RAX, accessed(I));
+            storeSlot(B, E, K);
+        } else {
+            copyWords(B, E, slot(K), accessed(I), N);
+            for (int i = 0; i < N; ++i) {
+                wrote(B, K + i);
+            }
+        }
+        B->K += N;
+        touch(B);
+        return 1;
+
+    case H_LOADA:
+    case H_LOADL:
+        needRoom(B, 1);
+        D = H == H_LOADA ? (DATA_W)I->Target : D;
+        store16Imm(E, D, slot(K));
+        wrote(B, K);
+        B->ConstSlot = K;
+        B->Const = D;
+        B->K++;
+        touch(B);
+        return 1;
+
+    case H_LOADA_DYN:
+        needRoom(B, 1);
+        lea(E, RAX, indexed(R13, -1, 1, D));
+        sext16(E, RAX);
+        storeSlot(B, E, K);
+        B->K++;
+        touch(B);
+        return 1;
+
+    case H_LOADI: {
+        if (N != 1) {
+            return 0;
+        }
+        needDepth(B, 1);
+        needRoom(B, 0);
+        if (B->ConstSlot == K - 1) {
+            movRI(E, RCX, (ADDRESS)B->Const);
+        } else {
+            movzx16(E, RCX, slot(K - 1));
+        }
+        lea(E, RDX, indexed(R12, -1, 1, K - 1));
+        aluRR(E, 0x39, RCX, RDX);
+        size_t Below = jcc(E, CC_B);
+        aluRR(E, 0x39, RCX, R14);
+        sideExit(B, E, CC_BE, K);
+        patch(E, Below, offset(E));
+        movsx16(E, RAX, indexed(RBX, RCX, 2, 0));
+        storeSlot(B, E, K - 1);
+        return 1;
+    }
+
+    case H_STORE:
+    case H_STORE_DYN:
+        needDepth(B, N);
+        B->K -= N;
+        needAccess(B, I, N);
+        if (N == 1) {
+            loadSlot(B, E, RAX, B->K);
+            store16(E, RAX, accessed(I));
+            B->Cached = B->K;
+        } else {
+            copyWords(B, E, accessed(I), slot(B->K), N);
+        }
+        // the store may have hit a stack slot
+        if (B->ConstSlot != B->K) {
+            B->ConstSlot = NO_SLOT;
+        }
+        return 1;
+
+    case H_STOREI:
+        if (N != 1) {
+            return 0;
+        }
+        needDepth(B, 2);
+        movzx16(E, RCX, slot(K - 2));
+        lea(E, RDX, indexed(R12, -1, 1, K - 2));
+        aluRR(E, 0x39, RCX, RDX);
+        size_t Below = jcc(E, CC_B);
+        aluRR(E, 0x39, RCX, R14);
+        sideExit(B, E, CC_BE, K);
+        patch(E, Below, offset(E));
+        loadSlot(B, E, RAX, K - 1);
+        store16(E, RAX, indexed(RBX, RCX, 2, 0));
+        B->K -= 2;
+        B->Cached = B->ConstSlot = NO_SLOT;
+        return 1;
+
+    case H_PUSH:
+        if (D < 0) {
+            return 0;
+        }
+        needRoom(B, D + 1);
+        B->K += D;
+        touch(B);
+        return 1;
+
+    case H_POP:
+        D = D < 0 ? 0 : D;
+        needDepth(B, N + D);
+        if (N && D) {
+            copyWords(B, E, slot(K - N - D), slot(K - N), N);
+            B->ConstSlot = NO_SLOT;
+        }
+        B->K -= D;
+        return 1;
+
+    case H_JUMP:
+        if (I->Target >= Size) {
+            return 0;
+        }
+        commit(B, E);
+        chain(E, I->Target, I->Target <= Here);
+        return 2;
+
+    case H_JUMPIF: {
+        if (I->Target >= Size) {
+            return 0;
+        }
+        needDepth(B, 1);
+        loadSlot(B, E, RAX, K - 1);
+        B->K--;
+        commit(B, E);
+        aluRI(E, 0, 7, RAX, N);
+        size_t NotTaken = jcc(E, CC_NE);
+        chain(E, I->Target, I->Target <= Here);
+        patch(E, NotTaken, offset(E));
+        chain(E, Here + 1, 0);
+        return 2;
+    }
+
+    case H_JUMPI:
+        needDepth(B, 1);
+        if (B->ConstSlot == K - 1) {
+            movRI(E, RSI, (ADDRESS)B->Const);
+        } else {
+            movzx16(E, RSI, slot(K - 1));
+        }
+        aluRI(E, 0, 7, RSI, Size);
+        sideExit(B, E, CC_AE, K);
+        B->K--;
+        commit(B, E);
+        chainDynamic(E);
+        return 2;
+
+    case H_CALL:
+        if (I->Target >= Size) {
+            return 0;
+        }
+        needRoom(B, 3);
+        switch (N) {
+        case ST:
+            lea(E, RAX, indexed(R12, -1, 1, K));
+            break;
+        case HT:
+            movRR(E, RAX, R14);
+            break;
+        case LB:
+            movRR(E, RAX, R13);
+            break;
+        case CP:
+            movRI(E, RAX, Here + 1);
+            break;
+        default:
+            movRI(E, RAX, N < 16 ? B->Jit->Registers[N] : 0);
+            break;
+        }
+        store16(E, RAX, slot(K));
+        store16(E, R13, slot(K + 1));
+        store16Imm(E, Here + 1, slot(K + 2));
+        lea(E, R13, indexed(R12, -1, 1, K));
+        B->K += 3;
+        touch(B);
+        commit(B, E);
+        chain(E, I->Target, 1);
+        return 2;
+
+    case H_RETURN: {
+        D = D < 0 ? 0 : D;
+        needDepth(B, N);
+
+        // ECX gets the return address and EDX the dynamic link, both read
+        // with the address wrapping as the interpreter's does
+        lea(E, RAX, indexed(R13, -1, 1, 2));
+        emitReg(E, 0, 0x0fb7, RAX, RAX);
+        movzx16(E, RCX, indexed(RBX, RAX, 2, 0));
+        lea(E, RAX, indexed(R13, -1, 1, 1));
+        emitReg(E, 0, 0x0fb7, RAX, RAX);
+        movzx16(E, RDX, indexed(RBX, RAX, 2, 0));
+
+        // EDI gets the new ST, which must leave room for the result and lie
+        // no higher than it, so that it can be copied down
+        aluRI(E, 0, 7, R13, D);
+        sideExit(B, E, CC_B, K);
+        lea(E, RDI, indexed(R13, -1, 1, -D));
+        if (N) {
+            lea(E, RAX, indexed(RDI, -1, 1, N));
+            aluRR(E, 0x39, RAX, R14);
+            sideExit(B, E, CC_A, K);
+            lea(E, RAX, indexed(R12, -1, 1, K - N));
+            aluRR(E, 0x39, RDI, RAX);
+            sideExit(B, E, CC_A, K);
+            copyWords(B, E, indexed(RBX, RDI, 2, 0), slot(K - N), N);
+        }
+        lea(E, R12, indexed(RDI, -1, 1, N));
+        movRR(E, R13, RDX);
+        B->K = 0;
+
+        // a return address past the end is reported by runEmulatorJit()
+        movRR(E, RSI, RCX);
+        aluRI(E, 0, 7, RSI, Size);
+        size_t Inside = jcc(E, CC_B);
+        jmpMem(E, tableEntry(Size));
+        patch(E, Inside, offset(E));
+        chainDynamic(E);
+        return 2;
+    }
+
+    case H_HALT:
+        commit(B, E);
+        movRI(E, RSI, Here + 1);
+        emitExit(E, JIT_HALT);
+        return 2;
+
+    case H_ID:
+        return 1;
+
+    case H_NOT:
+    case H_SUCC:
+    case H_PRED:
+    case H_NEG:
+        needDepth(B, 1);
+        loadSlot(B, E, RAX, K - 1);
+        if (H == H_NOT) {
+            aluRR(E, 0x85, RAX, RAX);
+            setcc(E, CC_E);
+        } else {
+            if (H == H_SUCC) {
+                aluRI(E, 0, 0, RAX, 1);
+            } else if (H == H_PRED) {
+                aluRI(E, 0, 5, RAX, 1);
+            } else {
+                emitReg(E, 0, 0xf7, 3, RAX);
+            }
+            sext16(E, RAX);
+        }
+        storeSlot(B, E, K - 1);
+        return 1;
+
+    case H_AND:
+    case H_OR:
+    case H_ADD:
+    case H_SUB:
+    case H_MULT:
+    case H_DIV:
+    case H_MOD:
+    case H_LT:
+    case H_LE:
+    case H_GE:
+    case H_GT:
+        // EAX gets the top word and ECX the one below it
+        needDepth(B, 2);
+        loadSlot(B, E, RCX, K - 2);
+        loadSlot(B, E, RAX, K - 1);
+        switch (H) {
+        case H_AND:
+            emitReg(E, 0, 0x0faf, RAX, RCX);
+            aluRR(E, 0x85, RAX, RAX);
+            setcc(E, CC_NE);
+            break;
+        case H_OR:
+            aluRR(E, 0x01, RAX, RCX);
+            aluRR(E, 0x85, RAX, RAX);
+            setcc(E, CC_NE);
+            break;
+        case H_ADD:
+            aluRR(E, 0x01, RAX, RCX);
+            sext16(E, RAX);
+            break;
+        case H_SUB:
+            aluRR(E, 0x29, RAX, RCX);
+            sext16(E, RAX);
+            break;
+        case H_MULT:
+            emitReg(E, 0, 0x0faf, RAX, RCX);
+            sext16(E, RAX);
+            break;
+        case H_DIV:
+        case H_MOD:
+            aluRR(E, 0x85, RCX, RCX);
+            sideExit(B, E, CC_E, K);
+            emitByte(E, 0x99);
+            emitReg(E, 0, 0xf7, 7, RCX);
+            if (H == H_MOD) {
+                movRR(E, RAX, RDX);
+            }
+            sext16(E, RAX);
+            break;
+        case H_LT:
+            aluRR(E, 0x39, RAX, RCX);
+            setcc(E, CC_L);
+            break;
+        case H_LE:
+            aluRR(E, 0x39, RAX, RCX);
+            setcc(E, CC_LE);
+            break;
+        default: // ge, and gt, which is the same
+            aluRR(E, 0x39, RAX, RCX);
+            setcc(E, CC_GE);
+            break;
+        }
+        storeSlot(B, E, K - 2);
+        B->K--;
+        return 1;
+
+    case H_EQ:
+    case H_NEQ:
+        // only comparisons of single words, whose size is pushed just before
+        if (B->ConstSlot != K - 1 || B->Const != 1) {
+            return 0;
+        }
+        needDepth(B, 3);
+        movzx16(E, RAX, slot(K - 2));
+        emitMem(E, 0x66, 0, 0x3b, RAX, slot(K - 3));
+        setcc(E, H == H_EQ ? CC_E : CC_NE);
+        storeSlot(B, E, K - 3);
+        B->K -= 2;
+        return 1;
+
+    case H_PUT:
+    case H_PUTINT:
+        needDepth(B, 1);
+        loadSlot(B, E, RSI, K - 1);
+        emitCall(E, H == H_PUT ? jitPut : jitPutInt);
+        B->Cached = NO_SLOT;
+        B->K--;
+        return 1;
+
+    case H_PUTEOL:
+        movRI(E, RSI, '\n');
+        emitCall(E, jitPut);
+        B->Cached = NO_SLOT;
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/// Copy a finished block into the executable buffer.
+static const void *placeBlock(TamJit *J, const Block *B, const Emitter *Body) {
+    Emitter Out = {J->Buf + J->Used, J->Buf + J->Used, J->Buf + JIT_CODE_SIZE,
+                   0};
+
+    // a block that fails its checks goes back to be interpreted
+    size_t BudgetFail = offset(&Out);
+    aluRI(&Out, 1, 0, R15, B->Len);
+    size_t CheckFail = offset(&Out);
+    movRI(&Out, RSI, B->Start);
+    emitExit(&Out, JIT_INTERPRET);
+
+    size_t Entry = offset(&Out);
+    if (B->MinSt > 0) {
+        aluRI(&Out, 0, 7, R12, B->MinSt);
+        patch(&Out, jcc(&Out, CC_L), CheckFail);
+    }
+    if (B->MaxNeed > INT32_MIN) {
+        lea(&Out, RAX, indexed(R12, -1, 1, B->MaxNeed));
+        aluRR(&Out, 0x39, RAX, R14);
+        patch(&Out, jcc(&Out, CC_G), CheckFail);
+    }
+    if (B->UsesLb) {
+        lea(&Out, RAX, indexed(R13, -1, 1, B->LbMin));
+        aluRR(&Out, 0x85, RAX, RAX);
+        patch(&Out, jcc(&Out, CC_S), CheckFail);
+        lea(&Out, RAX, indexed(R13, -1, 1, B->LbMax));
+        aluRR(&Out, 0x39, RAX, R12);
+        patch(&Out, jcc(&Out, CC_G), CheckFail);
+    }
+    aluRI(&Out, 1, 5, R15, B->Len);
+    patch(&Out, jcc(&Out, CC_B), BudgetFail);
+    if (B->Touch > 0) {
+        lea(&Out, RAX, indexed(R12, -1, 1, B->Touch));
+        emitMem(&Out, 0, 0, 0x3b, RAX, field(offsetof(JitState, StHigh)));
+        size_t Lower = jcc(&Out, CC_BE);
+        emitMem(&Out, 0, 0, 0x89, RAX, field(offsetof(JitState, StHigh)));
+        patch(&Out, Lower, offset(&Out));
+    }
+
+    size_t Length = offset(Body);
+    if (Out.P + Length > Out.End) {
+        return NULL;
+    }
+    memcpy(Out.P, Body->Start, Length);
+    Out.P += Length;
+    if (Out.Full) {
+        return NULL;
+    }
+    J->Used += offset(&Out);
+    return Out.Start + Entry;
+}
+
+/// Compile the block starting at an address, if it can be.
+static void compileBlock(TamJit *J, ADDRESS Start) {
+    const Instruction *Code = J->Program->Code;
+    Block B = {.Jit = J,
+               .Start = Start,
+               .Cached = NO_SLOT,
+               .ConstSlot = NO_SLOT,
+               .MaxNeed = INT32_MIN,
+               .LbMin = INT32_MAX,
+               .LbMax = INT32_MIN};
+    Emitter E = {J->Scratch, J->Scratch, J->Scratch + JIT_SCRATCH_SIZE, 0};
+
+    int Result = 1;
+    while (Result == 1) {
+        int Addr = Start + B.Len;
+        if (Addr >= J->Size || B.Len == JIT_MAX_BLOCK) {
+            Result = 0;
+        } else if ((Result = compileInstruction(&B, &E, Code + Addr))) {
+            B.Len++;
+        }
+    }
+    if (!B.Len) {
+        J->Counts[Start] = JIT_NEVER;
+        return;
+    }
+    if (!Result) {
+        // the interpreter takes over at the instruction that stopped us
+        commit(&B, &E);
+        chain(&E, Start + B.Len, 0);
+    }
+    for (int i = 0; i < B.NumExits; ++i) {
+        patch(&E, B.Exits[i].At, offset(&E));
+        if (B.Exits[i].K) {
+            lea(&E, R12, indexed(R12, -1, 1, B.Exits[i].K));
+        }
+        if (B.Len > B.Exits[i].Index) {
+            aluRI(&E, 1, 0, R15, B.Len - B.Exits[i].Index);
+        }
+        movRI(&E, RSI, Start + B.Exits[i].Index);
+        emitExit(&E, JIT_INTERPRET);
+    }
+
+    const void *Entry = NULL;
+    if (!E.Full && !mprotect(J->Buf, JIT_CODE_SIZE, PROT_READ | PROT_WRITE)) {
+        Entry = placeBlock(J, &B, &E);
+        mprotect(J->Buf, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+    }
+    if (Entry) {
+        J->State->Table[Start] = Entry;
+    } else {
+        J->Counts[Start] = JIT_NEVER;
+    }
+}
+
+/// Write the stubs that enter and leave compiled code.
+static void emitStubs(TamJit *J) {
+    Emitter E = {J->Buf, J->Buf, J->Buf + JIT_CODE_SIZE, 0};
+    static const int Saved[] = {RBX, RBP, R12, R13, R14, R15};
+
+    // enter: save callee-saved registers, keeping the stack 16-byte aligned,
+    // and load the emulator's state
+    for (int i = 0; i < 6; ++i) {
+        emitRex(&E, 0, 0, -1, Saved[i]);
+        emitByte(&E, 0x50 + (Saved[i] & 7));
+    }
+    aluRI(&E, 1, 5, RSP, 8);
+    emitReg(&E, 1, 0x89, RDI, RBP);
+    emitMem(&E, 0, 1, 0x8b, RBX, field(offsetof(JitState, Mem)));
+    emitMem(&E, 0, 0, 0x8b, R12, field(offsetof(JitState, St)));
+    emitMem(&E, 0, 0, 0x8b, R13, field(offsetof(JitState, Lb)));
+    emitMem(&E, 0, 0, 0x8b, R14, field(offsetof(JitState, Ht)));
+    emitMem(&E, 0, 1, 0x8b, R15, field(offsetof(JitState, Budget)));
+    emitReg(&E, 0, 0xff, 4, RSI);
+
+    // exit: store the state back and return the reason in EAX
+    J->State->Exit = E.P;
+    emitMem(&E, 0, 0, 0x89, R12, field(offsetof(JitState, St)));
+    emitMem(&E, 0, 0, 0x89, R13, field(offsetof(JitState, Lb)));
+    emitMem(&E, 0, 1, 0x89, R15, field(offsetof(JitState, Budget)));
+    emitMem(&E, 0, 0, 0x89, RSI, field(offsetof(JitState, Cp)));
+    aluRI(&E, 1, 0, RSP, 8);
+    for (int i = 5; i >= 0; --i) {
+        emitRex(&E, 0, 0, -1, Saved[i]);
+        emitByte(&E, 0x58 + (Saved[i] & 7));
+    }
+    emitByte(&E, 0xc3);
+
+    J->Continue = E.P;
+    emitExit(&E, JIT_CONTINUE);
+
+    J->Enter = (JitEnterFn)(uintptr_t)J->Buf;
+    J->Used = offset(&E);
+}
+
+/// Set up compilation of an emulator's program.
+static TamJit *newJit(const TamEmulator *Emulator) {
+    int Size = Emulator->Program->Size;
+    TamJit *J = calloc(1, sizeof(TamJit));
+    if (!J) {
+        return NULL;
+    }
+    J->Size = Size;
+    memcpy(J->Registers, Emulator->Registers, sizeof(J->Registers));
+    J->Counts = calloc(Size + 1, sizeof(uint16_t));
+    J->Lengths = calloc(Size + 1, sizeof(uint16_t));
+    J->Scratch = malloc(JIT_SCRATCH_SIZE);
+    J->State = calloc(1, sizeof(JitState) + (Size + 1) * sizeof(void *));
+    J->Buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (J->Buf == MAP_FAILED) {
+        J->Buf = NULL;
+    }
+    if (!J->Counts || !J->Lengths || !J->Scratch || !J->State || !J->Buf) {
+        freeJit(J);
+        return NULL;
+    }
+
+    emitStubs(J);
+    if (mprotect(J->Buf, JIT_CODE_SIZE, PROT_READ | PROT_EXEC)) {
+        freeJit(J);
+        return NULL;
+    }
+    for (int i = 0; i <= Size; ++i) {
+        J->State->Table[i] = J->Continue;
+    }
+    J->Program = retainProgram(Emulator->Program);
+    return J;
+}
+
+void freeJit(TamJit *Jit) {
+    if (!Jit) {
+        return;
+    }
+    if (Jit->Buf) {
+        munmap(Jit->Buf, JIT_CODE_SIZE);
+    }
+    releaseProgram(Jit->Program);
+    free(Jit->Counts);
+    free(Jit->Lengths);
+    free(Jit->Scratch);
+    free(Jit->State);
+    free(Jit);
+}
+
+/// Number of instructions from an address to the end of its block.
+static int blockLength(TamJit *J, ADDRESS Start) {
+    if (!J->Lengths[Start]) {
+        const Instruction *Code = J->Program->Code;
+        int Len = 1;
+        while (!endsBlock(Code + Start + Len - 1) && Len < JIT_MAX_BLOCK &&
+               Start + Len < J->Size) {
+            ++Len;
+        }
+        J->Lengths[Start] = Len;
+    }
+    return J->Lengths[Start];
+}
+
+int runEmulatorJit(TamEmulator *Emulator, uint64_t MaxSteps) {
+    assert(Emulator);
+    assert(Emulator->Program);
+
+    int ErrCode = fitStepBudget(Emulator, &MaxSteps);
+    if (ErrCode) {
+        return ErrCode;
+    }
+    TamJit *J = Emulator->Jit;
+    if (!J || J->Program != Emulator->Program) {
+        freeJit(J);
+        if (!(J = Emulator->Jit = newJit(Emulator))) {
+            return runEmulator(Emulator, MaxSteps);
+        }
+    }
+
+    ADDRESS *Regs = Emulator->Registers;
+    JitState *S = J->State;
+    S->Mem = Emulator->DataStore;
+    S->IO = &Emulator->IO;
+
+    S->TimeUp = &Emulator->TimeUp;
+
+    uint64_t Budget = MaxSteps ? MaxSteps : UINT64_MAX;
+    int Interpret = 0;
+    for (;;) {
+        ADDRESS Cp = Regs[CP];
+        if (Cp >= J->Size) {
+            ErrCode = Budget ? ErrCodeAccessViolation : ErrStepLimit;
+            break;
+        }
+        if (!Budget) {
+            ErrCode = ErrStepLimit;
+            break;
+        }
+        if (timeUp(Emulator)) {
+            ErrCode = ErrTimeout;
+            break;
+        }
+
+        if (!Interpret && S->Table[Cp] == J->Continue &&
+            J->Counts[Cp] != JIT_NEVER && ++J->Counts[Cp] >= JIT_THRESHOLD) {
+            compileBlock(J, Cp);
+        }
+
+        if (!Interpret && S->Table[Cp] != J->Continue) {
+            S->St = Regs[ST];
+            S->Lb = Regs[LB];
+            S->Ht = Regs[HT];
+            S->Budget = Budget;
+            S->StHigh = Emulator->StHigh;
+            int Reason = J->Enter(S, S->Table[Cp]);
+            Emulator->Steps += Budget - S->Budget;
+            Budget = S->Budget;
+            Regs[ST] = S->St;
+            Regs[LB] = S->Lb;
+            Regs[CP] = S->Cp;
+            Emulator->StHigh = S->StHigh;
+            if (Reason == JIT_HALT) {
+                ErrCode = OK;
+                break;
+            }
+            Interpret = Reason == JIT_INTERPRET;
+            continue;
+        }
+
+        // interpret up to the end of the block, which runInterpreter()
+        // reports as running out of steps
+        Interpret = 0;
+        uint64_t Run = blockLength(J, Cp);
+        uint64_t Before = Emulator->Steps;
+        ErrCode =
+            runInterpreter(Emulator, Run < Budget ? Run : Budget, NULL);
+        Budget -= Emulator->Steps - Before;
+        if (ErrCode != ErrStepLimit) {
+            break;
+        }
+    }
+
+    flushOutput(&Emulator->IO);
+    return stepBudgetResult(Emulator, ErrCode);
+}
+
+#endif
@@ -1,105 +1,357 @@
+#include "batch.h"
+#include "disasm.h"
+#include "emitc.h"
+#include "hoststats.h"
+#include "profile.h"
+#include "tracefile.h"
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <tam/error.h>
+#include <tam/runtime.h>
+#include <sys/time.h>
 #include <tam/tam.h>
+#include <unistd.h>
 
-void instructionString(Instruction Instr, char *Str) {
-    switch (Instr.Op) {
-    case LOAD:
-        snprintf(Str, 32, "LOAD(%d) %d[%d]", Instr.N, Instr.D, Instr.R);
-        break;
-    case LOADA:
-        snprintf(Str, 32, "LOADA %d[%d]", Instr.D, Instr.R);
-        break;
-    case LOADI:
-        snprintf(Str, 32, "LOADI (%d)", Instr.N);
-        break;
-    case LOADL:
-        snprintf(Str, 32, "LOADL %d", Instr.D);
-        break;
-    case STORE:
-        snprintf(Str, 32, "STORE(%d) %d[%d]", Instr.N, Instr.D, Instr.R);
-        break;
-    case STOREI:
-        snprintf(Str, 32, "STOREI(%d)", Instr.N);
-        break;
-    case CALL:
-        snprintf(Str, 32, "CALL(%d) %d[%d]", Instr.N, Instr.D, Instr.R);
-        break;
-    case CALLI:
-        snprintf(Str, 32, "CALLI");
-        break;
-    case RETURN:
-        snprintf(Str, 32, "RETURN(%d) %d", Instr.N, Instr.D);
-        break;
-    case PUSH:
-        snprintf(Str, 32, "PUSH %d", Instr.D);
-        break;
-    case POP:
-        snprintf(Str, 32, "POP(%d) %d", Instr.N, Instr.D);
-        break;
-    case JUMP:
-        snprintf(Str, 32, "JUMP %d[%d]", Instr.D, Instr.R);
-        break;
-    case JUMPI:
-        snprintf(Str, 32, "JUMPI");
-        break;
-    case JUMPIF:
-        snprintf(Str, 32, "JUMPIF(%d) %d[%d]", Instr.N, Instr.D, Instr.R);
-        break;
-    case HALT:
-        snprintf(Str, 32, "HALT");
-        break;
+/// Emulator to stop when the `--timeout` timer goes off.
+static TamEmulator *TimedEmulator;
+
+/// Signal handler for the `--timeout` timer.
+static void stopOnTimeout(int Signal) {
+    atomic_store_explicit(&TimedEmulator->TimeUp, 1, memory_order_relaxed);
+}
+
+/// How often, in microseconds, the `--timeout` timer goes off again once it
+/// has expired, in case the first signal came just before a wait for input.
+#define TIMEOUT_REPEAT_USEC 10000
+
+/// Start a timer that stops an emulator after a number of seconds of wall
+/// clock time.
+///
+/// The timer keeps going off until stopTimeout() is called. A signal that
+/// arrives after refillInput() has looked at `TimeUp` but before it blocks
+/// in read() would otherwise be lost, and leave the program waiting.
+/// @return 0 on success, -1 if the timer could not be set
+static int startTimeout(TamEmulator *Emulator, double Seconds) {
+    TimedEmulator = Emulator;
+    struct sigaction Action;
+    memset(&Action, 0, sizeof(Action));
+    // no SA_RESTART, so that a program waiting for input is woken up
+    Action.sa_handler = stopOnTimeout;
+    sigemptyset(&Action.sa_mask);
+
+    struct itimerval Timer;
+    memset(&Timer, 0, sizeof(Timer));
+    Timer.it_value.tv_sec = (time_t)Seconds;
+    Timer.it_value.tv_usec = (suseconds_t)((Seconds - (time_t)Seconds) * 1e6);
+    if (!Timer.it_value.tv_sec && !Timer.it_value.tv_usec) {
+        Timer.it_value.tv_usec = 1;
+    }
+    Timer.it_interval.tv_usec = TIMEOUT_REPEAT_USEC;
+    if (sigaction(SIGALRM, &Action, NULL) ||
+        setitimer(ITIMER_REAL, &Timer, NULL)) {
+        return -1;
+    }
+    return 0;
+}
+
+/// Stop the `--timeout` timer, so that it no longer interrupts the writes
+/// made once the program has finished.
+static void stopTimeout(void) {
+    struct itimerval Timer;
+    memset(&Timer, 0, sizeof(Timer));
+    setitimer(ITIMER_REAL, &Timer, NULL);
+}
+
+/// Print an instruction as it is about to be executed. `Context` is the
+/// emulator, whose output written so far is let out ahead of the trace.
+static void traceInstruction(void *Context, const TamEmulator *Emulator,
+                             ADDRESS Addr, Instruction Instr) {
+    flushOutput(&((TamEmulator *)Context)->IO);
+    char Buf[32];
+    instructionString(Instr, Buf);
+    printf("0x%04x: %s\n", Addr, Buf);
+}
+
+/// Output callback used while tracing, so that program output goes through
+/// the same stdio buffer as the trace and the two stay in order.
+static int writeStdout(void *Context, const char *Buf, size_t Size) {
+    return fwrite(Buf, 1, Size, stdout) == Size ? 0 : -1;
+}
+
+/// Print execution counts and host statistics for the last run to stderr.
+static void printStats(const TamEmulator *Emulator, const HostStats *Host) {
+    uint64_t Steps = Emulator->Steps;
+    uint64_t Fused = Emulator->Fused;
+    fprintf(stderr, "instructions executed: %llu\n", (unsigned long long)Steps);
+    fprintf(stderr, "dispatches:            %llu\n",
+            (unsigned long long)(Steps - Fused));
+    fprintf(stderr, "eliminated by fusion:  %llu (%.1f%%)\n",
+            (unsigned long long)Fused, Steps ? 100.0 * Fused / Steps : 0.0);
+    printHostStats(Host, Steps, Steps - Fused, stderr);
+
+    const TamHeap *Heap = &Emulator->Heap;
+    if (!Heap->Allocations) {
+        return;
     }
+    fprintf(stderr, "heap allocations:      %llu\n",
+            (unsigned long long)Heap->Allocations);
+    fprintf(stderr, "heap disposals:        %llu\n",
+            (unsigned long long)Heap->Disposals);
+    fprintf(stderr, "heap words live:       %llu (peak %llu)\n",
+            (unsigned long long)Heap->LiveWords,
+            (unsigned long long)Heap->PeakWords);
+    fprintf(stderr, "heap free blocks:     ");
+    int Any = 0;
+    for (int i = 0; i < HEAP_CLASSES; ++i) {
+        if (Heap->FreeCount[i]) {
+            fprintf(stderr, " %lux%lu", (unsigned long)Heap->FreeCount[i],
+                    (unsigned long)heapClassSize(i));
+            Any = 1;
+        }
+    }
+    fprintf(stderr, Any ? "\n" : " none\n");
 }
 
 int main(int argc, const char **argv) {
     int ErrCode;
     TamEmulator *Emulator = newEmulator();
 
-    if (argc < 2) {
-        fprintf(stderr, "must specify program file\n");
+    int TraceMode = 0;
+    int StatsMode = 0;
+    int JitMode = 0;
+    int IrMode = 0;
+    const char *JobFile = NULL;
+    const char *ProfileFile = NULL;
+    const char *TraceFile = NULL;
+    const char *EmitFile = NULL;
+    const char *SaveFile = NULL;
+    const char *LoadFile = NULL;
+    uint64_t SnapshotAfter = 0;
+    uint64_t MaxSteps = 0;
+    double Timeout = 0;
+    size_t TraceLast = 0;
+    int TraceRegisters = 0;
+    int Threads = 0;
+    int Arg = 1;
+    for (; Arg < argc && argv[Arg][0] == '-'; ++Arg) {
+        if (strcmp("-t", argv[Arg]) == 0 || strcmp("--trace", argv[Arg]) == 0) {
+            TraceMode = 1;
+        } else if (strcmp("-s", argv[Arg]) == 0 ||
+                   strcmp("--stats", argv[Arg]) == 0) {
+            StatsMode = 1;
+        } else if (strcmp("--jit", argv[Arg]) == 0) {
+            JitMode = 1;
+        } else if (strcmp("--ir", argv[Arg]) == 0) {
+            IrMode = 1;
+        } else if (strcmp("--profile", argv[Arg]) == 0 && Arg + 1 < argc) {
+            ProfileFile = argv[++Arg];
+        } else if (strcmp("--emit-c", argv[Arg]) == 0 && Arg + 1 < argc) {
+            EmitFile = argv[++Arg];
+        } else if (strcmp("--trace-file", argv[Arg]) == 0 && Arg + 1 < argc) {
+            TraceFile = argv[++Arg];
+        } else if (strcmp("--trace-last", argv[Arg]) == 0 && Arg + 1 < argc) {
+            TraceLast = strtoul(argv[++Arg], NULL, 10);
+        } else if (strcmp("--trace-registers", argv[Arg]) == 0) {
+            TraceRegisters = 1;
+        } else if (strcmp("--save-snapshot", argv[Arg]) == 0 &&
+                   Arg + 1 < argc) {
+            SaveFile = argv[++Arg];
+        } else if (strcmp("--snapshot-after", argv[Arg]) == 0 &&
+                   Arg + 1 < argc) {
+            SnapshotAfter = strtoull(argv[++Arg], NULL, 10);
+        } else if (strcmp("--load-snapshot", argv[Arg]) == 0 &&
+                   Arg + 1 < argc) {
+            LoadFile = argv[++Arg];
+        } else if (strcmp("--max-steps", argv[Arg]) == 0 && Arg + 1 < argc) {
+            MaxSteps = strtoull(argv[++Arg], NULL, 10);
+        } else if (strcmp("--timeout", argv[Arg]) == 0 && Arg + 1 < argc) {
+            Timeout = strtod(argv[++Arg], NULL);
+        } else if (strcmp("--batch", argv[Arg]) == 0 && Arg + 1 < argc) {
+            JobFile = argv[++Arg];
+        } else if ((strcmp("-j", argv[Arg]) == 0 ||
+                    strcmp("--jobs", argv[Arg]) == 0) &&
+                   Arg + 1 < argc) {
+            Threads = atoi(argv[++Arg]);
+        } else {
+            fprintf(stderr, "unrecognised option %s\n", argv[Arg]);
+            return 1;
+        }
+    }
+
+    if (JobFile) {
+        if (TraceMode || StatsMode || JitMode || IrMode || ProfileFile ||
+            TraceFile || EmitFile || SaveFile || LoadFile || Arg < argc) {
+            fprintf(stderr, "--batch takes no program and no options but -j, "
+                            "--max-steps and --timeout\n");
+            return 1;
+        }
+        if (Threads < 1) {
+            Threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        freeEmulator(Emulator);
+        return runBatch(JobFile, Threads, MaxSteps,
+                        Timeout > 0 ? Timeout : 0);
+    }
+
+    if (!!TraceMode + !!ProfileFile + !!TraceFile > 1) {
+        fprintf(stderr, "only one of --trace, --trace-file and --profile may "
+                        "be given\n");
+        return 1;
+    }
+    if (JitMode && (TraceMode || ProfileFile || TraceFile)) {
+        fprintf(stderr, "--jit cannot be combined with tracing or profiling\n");
+        return 1;
+    }
+    if (IrMode && (JitMode || TraceMode || ProfileFile || TraceFile)) {
+        fprintf(stderr, "--ir cannot be combined with --jit, tracing or "
+                        "profiling\n");
+        return 1;
+    }
+    if (EmitFile && (TraceMode || StatsMode || JitMode || IrMode ||
+                     ProfileFile || TraceFile || MaxSteps || Timeout > 0)) {
+        fprintf(stderr, "--emit-c translates the program without running "
+                        "it and takes no other options\n");
+        return 1;
+    }
+    if ((TraceLast || TraceRegisters) && !TraceFile) {
+        fprintf(stderr, "--trace-last and --trace-registers need "
+                        "--trace-file\n");
         return 1;
     }
 
-    int TraceMode =
-        strncmp("-t", argv[1], 2) == 0 || strncmp("--trace", argv[1], 7) == 0;
+    if (!SaveFile != !SnapshotAfter) {
+        fprintf(stderr, "--save-snapshot and --snapshot-after must be given "
+                        "together\n");
+        return 1;
+    }
+    if ((SaveFile || LoadFile) &&
+        (TraceMode || ProfileFile || TraceFile || EmitFile)) {
+        fprintf(stderr, "snapshots cannot be combined with tracing, "
+                        "profiling or --emit-c\n");
+        return 1;
+    }
 
-    if (TraceMode && argc < 3) {
+    // a snapshot stands in for the program
+    const char *Filename = LoadFile;
+    if (LoadFile) {
+        if (Arg < argc) {
+            fprintf(stderr, "--load-snapshot takes no program file\n");
+            return 1;
+        }
+        ErrCode = loadSnapshot(Emulator, LoadFile);
+    } else if (Arg < argc) {
+        Filename = argv[Arg];
+        ErrCode = loadProgram(Emulator, Filename);
+    } else {
         fprintf(stderr, "must specify program file\n");
         return 1;
     }
-
-    const char *Filename = TraceMode ? argv[2] : argv[1];
-    if ((ErrCode = loadProgram(Emulator, Filename))) {
+    if (ErrCode) {
         fprintf(stderr, "%s\n", errorMessage(ErrCode));
         return ErrCode;
     }
 
-    Instruction Instr;
-    while (1) {
-        if ((ErrCode = fetchDecode(Emulator, &Instr))) {
-            fprintf(stderr, "%s at loc %04x\n", errorMessage(ErrCode),
-                    Emulator->Registers[CP]);
-            return ErrCode;
+    if (EmitFile) {
+        FILE *Out = fopen(EmitFile, "w");
+        if (!Out) {
+            fprintf(stderr, "could not open %s\n", EmitFile);
+            return 1;
         }
-
-        if (TraceMode) {
-            char Buf[32];
-            instructionString(Instr, Buf);
-            printf("0x%04x: %s\n", Emulator->Registers[CP] - 1, Buf);
+        int Failed = emitC(Emulator, Filename, Out);
+        if (fclose(Out) || Failed) {
+            fprintf(stderr, "could not write %s\n", EmitFile);
+            return 1;
         }
+        freeEmulator(Emulator);
+        return 0;
+    }
+
+    Emulator->StepBudget = MaxSteps;
+    if (Timeout > 0 && startTimeout(Emulator, Timeout)) {
+        fprintf(stderr, "could not set a timer for --timeout\n");
+        return 1;
+    }
 
-        if (Instr.Op == HALT) {
-            break;
+    Profile *Prof = NULL;
+    TraceWriter *Writer = NULL;
+    HostStats Host;
+    if (StatsMode) {
+        startHostStats(&Host);
+    }
+    if (TraceMode) {
+        setOutputCallback(&Emulator->IO, writeStdout, NULL);
+        ErrCode =
+            runEmulatorTraced(Emulator, 0, traceInstruction, Emulator);
+    } else if (ProfileFile) {
+        if (!(Prof = newProfile(Emulator))) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        ErrCode = runEmulatorProfiled(Emulator, 0, profileHooks(Prof));
+        if (ErrCode < 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
         }
+    } else if (TraceFile) {
+        if (!(Writer = newTraceWriter(TraceFile, TraceLast, TraceRegisters))) {
+            fprintf(stderr, "could not open trace file %s\n", TraceFile);
+            return 1;
+        }
+        ErrCode = runEmulatorTraced(Emulator, 0, traceRecord, Writer);
+    } else if (JitMode) {
+        ErrCode = runEmulatorJit(Emulator, SnapshotAfter);
+    } else if (IrMode) {
+        ErrCode = runEmulatorIR(Emulator, SnapshotAfter);
+    } else {
+        ErrCode = runEmulator(Emulator, SnapshotAfter);
+    }
+    if (Timeout > 0) {
+        stopTimeout();
+    }
+    if (StatsMode) {
+        stopHostStats(&Host);
+    }
 
-        if ((ErrCode = execute(Emulator, Instr))) {
-            fprintf(stderr, "%s at loc %04x\n", errorMessage(ErrCode),
-                    Emulator->Registers[CP] - 1);
+    // the snapshot is only taken if the program is still running, and
+    // carries on from the first instruction it did not run
+    if (SaveFile && ErrCode == ErrStepLimit) {
+        flushOutput(&Emulator->IO);
+        if ((ErrCode = saveSnapshot(Emulator, SaveFile))) {
+            fprintf(stderr, "could not write snapshot to %s\n", SaveFile);
             return ErrCode;
         }
+    } else if (SaveFile && !ErrCode) {
+        fprintf(stderr, "program halted before the snapshot was taken\n");
+    }
+
+    // a trace of the last few instructions is only kept if they led up to
+    // an error
+    if (Writer) {
+        if (finishTrace(Writer, ErrCode != 0)) {
+            fprintf(stderr, "could not write trace to %s\n", TraceFile);
+        }
+        freeTraceWriter(Writer);
+    }
+
+    // a profile is written even if the program fails, since that may be
+    // what it is needed for
+    if (Prof) {
+        if (writeProfile(Prof, ProfileFile)) {
+            fprintf(stderr, "could not write profile to %s\n", ProfileFile);
+        }
+        freeProfile(Prof);
+    }
+
+    if (StatsMode) {
+        printStats(Emulator, &Host);
+    }
+
+    if (ErrCode) {
+        reportError(ErrCode, Emulator->Registers[CP]);
+        return ErrCode;
     }
 
-    free(Emulator);
+    freeEmulator(Emulator);
 }
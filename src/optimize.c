@@ -0,0 +1,530 @@
+#include "optimize.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// @brief A program being optimised.
+///
+/// Instructions keep their original addresses until the program is written
+/// out, so every `Target` goes on meaning the same place. A removed
+/// instruction is only marked dead, and control that reaches it falls
+/// through to the next live one.
+typedef struct Optimizer {
+    Instruction *Code; ///< Instructions, code operands resolved in `Target`
+    int Size;          ///< Number of instructions, live or dead
+    uint8_t *Dead;     ///< Nonzero for instructions that have been removed
+    uint8_t *Leader;   ///< Nonzero where control can arrive but by falling
+    uint8_t *Reached;  ///< Nonzero for instructions control can reach
+    int *Work;         ///< Instructions whose successors are still to visit
+    OptStats *Stats;
+} Optimizer;
+
+static int isPrimitive(const Instruction *I) {
+    return I->Op == CALL && I->R == PB && I->D > 0 && I->D < 29;
+}
+
+/// Check whether addresses relative to a register are in the code store,
+/// and so move when the code does.
+static int isCodeRegister(int R) {
+    return R == CB || R == CT || R == PB || R == PT || R == CP;
+}
+
+/// Check whether an instruction's operand is a code address: where it
+/// jumps or calls, or code whose address `LOADA` takes.
+static int hasCodeTarget(const Instruction *I) {
+    switch (I->Op) {
+    case JUMP:
+    case JUMPIF:
+        return 1;
+    case CALL:
+        return !isPrimitive(I);
+    case LOADA:
+        return isCodeRegister(I->R);
+    default:
+        return 0;
+    }
+}
+
+/// Find the first live instruction at or after an address.
+static int nextLive(const Optimizer *O, int Addr) {
+    while (Addr < O->Size && O->Dead[Addr]) {
+        ++Addr;
+    }
+    return Addr;
+}
+
+/// Remove an instruction. Control that arrived at it now arrives at the
+/// next one, so that becomes a leader in its place.
+static void removeAt(Optimizer *O, int Addr) {
+    O->Dead[Addr] = 1;
+    int Next = nextLive(O, Addr + 1);
+    if (O->Leader[Addr] && Next < O->Size) {
+        O->Leader[Next] = 1;
+    }
+}
+
+/// @brief Remove every instruction control cannot reach from address 0.
+///
+/// Code whose address `LOADA` takes counts as reached, since
+/// codeAddressesKnown() has made sure that only such addresses reach
+/// `JUMPI`. The instruction after a call is reached, as the routine called
+/// may return to it.
+static void removeUnreachable(Optimizer *O) {
+    memset(O->Reached, 0, (unsigned)O->Size);
+    int Count = 0;
+    if (O->Size) {
+        O->Reached[0] = 1;
+        O->Work[Count++] = 0;
+    }
+
+    while (Count) {
+        int Addr = O->Work[--Count];
+        const Instruction *I = O->Code + Addr;
+        int Next = 1, Target = -1;
+        if (!O->Dead[Addr]) {
+            switch (I->Op) {
+            case JUMP:
+                Next = 0;
+                Target = I->Target;
+                break;
+            case JUMPIF:
+                Target = I->Target;
+                break;
+            case CALL:
+            case LOADA:
+                Target = hasCodeTarget(I) ? I->Target : -1;
+                break;
+            case LOAD:
+            case LOADI:
+            case LOADL:
+            case STORE:
+            case STOREI:
+            case PUSH:
+            case POP:
+                break;
+            default: // RETURN, JUMPI, HALT and what fails to execute
+                Next = 0;
+                break;
+            }
+        }
+
+        int Succ[2] = {Next ? Addr + 1 : -1, Target};
+        for (int S = 0; S < 2; ++S) {
+            if (Succ[S] >= 0 && Succ[S] < O->Size && !O->Reached[Succ[S]]) {
+                O->Reached[Succ[S]] = 1;
+                O->Work[Count++] = Succ[S];
+            }
+        }
+    }
+
+    for (int Addr = 0; Addr < O->Size; ++Addr) {
+        if (!O->Reached[Addr] && !O->Dead[Addr]) {
+            O->Dead[Addr] = 1;
+            ++O->Stats->Unreachable;
+        }
+    }
+}
+
+/// Mark the instructions control can arrive at other than by falling
+/// through: the start, targets and the instructions after calls.
+static void findLeaders(Optimizer *O) {
+    memset(O->Leader, 0, (unsigned)O->Size);
+    int Start = nextLive(O, 0);
+    if (Start < O->Size) {
+        O->Leader[Start] = 1;
+    }
+    for (int Addr = 0; Addr < O->Size; ++Addr) {
+        const Instruction *I = O->Code + Addr;
+        if (O->Dead[Addr]) {
+            continue;
+        }
+        int Target = hasCodeTarget(I) && I->Target < O->Size
+                         ? nextLive(O, I->Target)
+                         : O->Size;
+        if (Target < O->Size) {
+            O->Leader[Target] = 1;
+        }
+        int After = nextLive(O, Addr + 1);
+        if (I->Op == CALL && !isPrimitive(I) && After < O->Size) {
+            O->Leader[After] = 1;
+        }
+    }
+}
+
+/// Check whether a register holds a code address that moves with the code.
+static int isMovingRegister(int R) {
+    return isCodeRegister(R) && R != CB;
+}
+
+/// @brief Check that code addresses only ever go from a `LOADA` straight
+/// into the `JUMPI` after it, which is moved along with its target.
+///
+/// A `JUMPI` can equally take a literal, the result of arithmetic or a
+/// word loaded from memory, and none of those can be followed; nor can a
+/// code address that is printed, compared or stored, or data addressed
+/// relative to the code. So each `JUMPI` must be reached only from a
+/// `LOADA` of code just before it, and each such `LOADA` must feed one. A
+/// `CALLI` could be given anything.
+/// @param O program with its leaders found and nothing removed yet
+/// @return 1 if every code address is known, 0 if the program cannot be
+/// rewritten
+static int codeAddressesKnown(const Optimizer *O) {
+    for (int Addr = 0; Addr < O->Size; ++Addr) {
+        const Instruction *I = O->Code + Addr;
+        switch (I->Op) {
+        case LOAD:
+        case STORE:
+            if (isMovingRegister(I->R)) {
+                return 0;
+            }
+            break;
+        case LOADA:
+            if (isCodeRegister(I->R) &&
+                (Addr + 1 == O->Size || O->Code[Addr + 1].Op != JUMPI)) {
+                return 0;
+            }
+            break;
+        case CALL:
+            // the static link is a word of data like any other
+            if (!isPrimitive(I) && isMovingRegister(I->N)) {
+                return 0;
+            }
+            break;
+        case CALLI:
+            return 0;
+        case JUMPI:
+            // address 0 is a leader, so any other has one before it
+            if (O->Leader[Addr] || O->Code[Addr - 1].Op != LOADA ||
+                !isCodeRegister(O->Code[Addr - 1].R)) {
+                return 0;
+            }
+            break;
+        }
+    }
+    return 1;
+}
+
+/// @brief Work out a primitive on constant arguments, as the emulator does.
+///
+/// Only results that fit a `LOADL` operand are folded, which also makes
+/// them the same whatever the word size.
+/// @param Prim primitive number
+/// @param Arg1 argument on top of the stack
+/// @param Arg2 argument below it, for binary primitives
+/// @param[out] Result receives the result
+/// @return 1 if the primitive was folded, 0 if it cannot be
+static int foldPrimitive(int Prim, int64_t Arg1, int64_t Arg2,
+                         int64_t *Result) {
+    switch (Prim) {
+    case 2: // not
+        *Result = !Arg1;
+        break;
+    case 3: // and
+        *Result = Arg1 * Arg2 != 0;
+        break;
+    case 4: // or
+        *Result = Arg1 + Arg2 != 0;
+        break;
+    case 5: // succ
+        *Result = Arg1 + 1;
+        break;
+    case 6: // pred
+        *Result = Arg1 - 1;
+        break;
+    case 7: // neg
+        *Result = -Arg1;
+        break;
+    case 8: // add
+        *Result = Arg1 + Arg2;
+        break;
+    case 9: // sub
+        *Result = Arg1 - Arg2;
+        break;
+    case 10: // mult
+        *Result = Arg1 * Arg2;
+        break;
+    case 11: // div
+    case 12: // mod
+        if (!Arg2) {
+            return 0;
+        }
+        *Result = Prim == 11 ? Arg1 / Arg2 : Arg1 % Arg2;
+        break;
+    case 13: // lt
+        *Result = Arg1 < Arg2;
+        break;
+    case 14: // le
+        *Result = Arg1 <= Arg2;
+        break;
+    case 15: // ge
+    case 16: // gt, which the emulator also takes as >=
+        *Result = Arg1 >= Arg2;
+        break;
+    default:
+        return 0;
+    }
+    return *Result >= INT16_MIN && *Result <= INT16_MAX;
+}
+
+static int isUnaryPrimitive(int Prim) {
+    return Prim == 2 || (Prim >= 5 && Prim <= 7);
+}
+
+static int isBinaryPrimitive(int Prim) {
+    return Prim == 3 || Prim == 4 || (Prim >= 8 && Prim <= 16);
+}
+
+/// @brief Simplify a `LOADL` together with the instructions after it.
+/// @return 1 if anything changed
+static int simplifyLiteral(Optimizer *O, int Addr) {
+    Instruction *I = O->Code + Addr;
+    int J = nextLive(O, Addr + 1);
+    if (J >= O->Size || O->Leader[J]) {
+        return 0;
+    }
+    Instruction *Next = O->Code + J;
+    int K = nextLive(O, J + 1);
+    int Prim = isPrimitive(Next) ? Next->D : 0;
+    int64_t Result;
+
+    // a literal and one primitive, or two and a binary one
+    if (isUnaryPrimitive(Prim) && foldPrimitive(Prim, I->D, 0, &Result)) {
+        I->D = (int16_t)Result;
+        removeAt(O, J);
+        ++O->Stats->Folded;
+        return 1;
+    }
+    if (Next->Op == LOADL && K < O->Size && !O->Leader[K] &&
+        isPrimitive(O->Code + K) && isBinaryPrimitive(O->Code[K].D) &&
+        foldPrimitive(O->Code[K].D, Next->D, I->D, &Result)) {
+        I->D = (int16_t)Result;
+        removeAt(O, J);
+        removeAt(O, K);
+        ++O->Stats->Folded;
+        return 1;
+    }
+
+    // adding 0 or multiplying by 1 does nothing, and adding 1 or -1 or
+    // multiplying by -1 has a primitive of its own
+    if ((Prim == 8 && I->D == 0) || (Prim == 10 && I->D == 1)) {
+        removeAt(O, Addr);
+        removeAt(O, J);
+        O->Stats->Simplified += 2;
+        return 1;
+    }
+    if ((Prim == 8 && (I->D == 1 || I->D == -1)) ||
+        (Prim == 10 && I->D == -1)) {
+        Next->D = Prim == 10 ? 7 : I->D == 1 ? 5 : 6;
+        removeAt(O, Addr);
+        ++O->Stats->Simplified;
+        return 1;
+    }
+
+    // a literal popped straight away
+    if (Next->Op == POP && Next->N == 0 && Next->D >= 1) {
+        if (--Next->D == 0) {
+            removeAt(O, J);
+            ++O->Stats->Simplified;
+        }
+        removeAt(O, Addr);
+        ++O->Stats->Simplified;
+        return 1;
+    }
+
+    // a conditional jump on a literal always or never goes
+    if (Next->Op == JUMPIF) {
+        if ((DATA_W)I->D == Next->N) {
+            *I = *Next;
+            I->Op = JUMP;
+            I->N = 0;
+            removeAt(O, J);
+        } else {
+            removeAt(O, Addr);
+            removeAt(O, J);
+        }
+        ++O->Stats->Folded;
+        return 1;
+    }
+    return 0;
+}
+
+/// @brief Send a jump straight to the end of a chain of jumps, and remove
+/// it if it only goes to the next instruction.
+/// @return 1 if anything changed
+static int simplifyJump(Optimizer *O, int Addr) {
+    Instruction *I = O->Code + Addr;
+    int Target = I->Target;
+
+    // a chain that goes round in a loop is left as it is
+    for (int Hops = 0; Hops <= O->Size; ++Hops) {
+        int To = Target < O->Size ? nextLive(O, Target) : O->Size;
+        if (To >= O->Size || O->Code[To].Op != JUMP) {
+            if (Target != I->Target) {
+                I->Target = Target;
+                ++O->Stats->Threaded;
+                return 1;
+            }
+            break;
+        }
+        Target = O->Code[To].Target;
+    }
+    if (I->Op != JUMP || Target >= O->Size) {
+        return 0;
+    }
+
+    // jumping to a HALT or RETURN is the same as doing it here
+    int To = nextLive(O, Target);
+    if (To < O->Size &&
+        (O->Code[To].Op == HALT || O->Code[To].Op == RETURN)) {
+        *I = O->Code[To];
+        ++O->Stats->Threaded;
+        return 1;
+    }
+    if (To == nextLive(O, Addr + 1)) {
+        removeAt(O, Addr);
+        ++O->Stats->Simplified;
+        return 1;
+    }
+    return 0;
+}
+
+/// @brief Apply the peephole rules once over the whole program.
+/// @return 1 if anything changed
+static int simplify(Optimizer *O) {
+    int Changed = 0;
+    for (int Addr = 0; Addr < O->Size; ++Addr) {
+        Instruction *I = O->Code + Addr;
+        if (O->Dead[Addr]) {
+            continue;
+        }
+        switch (I->Op) {
+        case PUSH:
+        case POP:
+        case CALL:
+            // PUSH 0, POP(n) 0 and CALL id leave everything as it was
+            if ((I->Op == PUSH && I->D == 0) || (I->Op == POP && I->D <= 0) ||
+                (isPrimitive(I) && I->D == 1)) {
+                removeAt(O, Addr);
+                ++O->Stats->Simplified;
+                Changed = 1;
+            }
+            break;
+        case LOADL:
+            Changed |= simplifyLiteral(O, Addr);
+            break;
+        case JUMP:
+        case JUMPIF:
+            Changed |= simplifyJump(O, Addr);
+            break;
+        }
+    }
+    return Changed;
+}
+
+/// Address a register holds in the rewritten program, for code operands.
+static int64_t codeBase(int R, int Addr, int Size) {
+    switch (R) {
+    case CT:
+    case PB:
+        return Size;
+    case PT:
+        return Size + 29;
+    case CP:
+        return Addr + 1;
+    default: // CB
+        return 0;
+    }
+}
+
+/// @brief Lay the live instructions out afresh and encode them, moving
+/// every code operand to the new address of its target.
+///
+/// Addresses past the end of the code, such as primitives, keep their
+/// distance from the end.
+/// @return 0 on success, -1 if memory ran out, 1 if an operand no longer
+/// fits
+static int encode(const Optimizer *O, CODE_W **Code, int *Size) {
+    int *NewAddr = malloc((O->Size + 1) * sizeof(int));
+    if (!NewAddr) {
+        return -1;
+    }
+    int Count = 0;
+    for (int Addr = 0; Addr < O->Size; ++Addr) {
+        NewAddr[Addr] = Count;
+        Count += !O->Dead[Addr];
+    }
+    NewAddr[O->Size] = Count;
+
+    CODE_W *Words = malloc((Count ? Count : 1) * sizeof(CODE_W));
+    if (!Words) {
+        free(NewAddr);
+        return -1;
+    }
+    for (int Addr = 0; Addr < O->Size; ++Addr) {
+        const Instruction *I = O->Code + Addr;
+        if (O->Dead[Addr]) {
+            continue;
+        }
+        int64_t D = I->D;
+        if (hasCodeTarget(I)) {
+            int64_t Target = I->Target < O->Size
+                                 ? NewAddr[I->Target]
+                                 : (int64_t)I->Target - O->Size + Count;
+            D = Target - codeBase(I->R, NewAddr[Addr], Count);
+            if (D < INT16_MIN || D > INT16_MAX) {
+                free(Words);
+                free(NewAddr);
+                return 1;
+            }
+        }
+        Words[NewAddr[Addr]] = (CODE_W)I->Op << 28 | (CODE_W)I->R << 24 |
+                               (CODE_W)I->N << 16 | (uint16_t)D;
+    }
+    free(NewAddr);
+    *Code = Words;
+    *Size = Count;
+    return 0;
+}
+
+int optimizeProgram(const TamProgram *Program, CODE_W **Code, int *Size,
+                    OptStats *Stats) {
+    memset(Stats, 0, sizeof(OptStats));
+
+    // a jump or call relative to anything but the code store goes to an
+    // address that is only known at run time, and may not survive a move
+    for (int Addr = 0; Addr < Program->Size; ++Addr) {
+        const Instruction *I = Program->Code + Addr;
+        if (hasCodeTarget(I) && !isCodeRegister(I->R)) {
+            return 1;
+        }
+    }
+
+    Optimizer O = {.Size = Program->Size, .Stats = Stats};
+    size_t Count = Program->Size ? Program->Size : 1;
+    O.Code = malloc(Count * sizeof(Instruction));
+    O.Dead = calloc(Count, 1);
+    O.Leader = malloc(Count);
+    O.Reached = malloc(Count);
+    O.Work = malloc(Count * sizeof(int));
+    int Result = -1;
+    if (O.Code && O.Dead && O.Leader && O.Reached && O.Work) {
+        memcpy(O.Code, Program->Code, Program->Size * sizeof(Instruction));
+        findLeaders(&O);
+        Result = 1;
+        if (codeAddressesKnown(&O)) {
+            do {
+                removeUnreachable(&O);
+                findLeaders(&O);
+            } while (simplify(&O));
+            Result = encode(&O, Code, Size);
+        }
+    }
+
+    free(O.Code);
+    free(O.Dead);
+    free(O.Leader);
+    free(O.Reached);
+    free(O.Work);
+    return Result;
+}
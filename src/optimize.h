@@ -0,0 +1,40 @@
+#ifndef TAM_OPTIMIZE_H__
+#define TAM_OPTIMIZE_H__
+
+#include <tam/tam.h>
+
+/// @brief What optimizeProgram() changed.
+typedef struct OptStats {
+    int Folded;      ///< Constant operations worked out in advance
+    int Threaded;    ///< Jumps sent straight to where a chain of jumps ends
+    int Simplified;  ///< Instructions removed or shortened by peepholes
+    int Unreachable; ///< Instructions removed because nothing reaches them
+} OptStats;
+
+/// @brief Rewrite a program into a shorter one that behaves the same.
+///
+/// Constant arithmetic is folded, jumps to jumps are threaded, instructions
+/// that do nothing and code that can never run are removed, and every code
+/// address is moved to match: jump and call targets and the code addresses
+/// that `LOADA` puts on the stack for the `JUMPI` after it. Primitives are
+/// folded the way this emulator defines them, and only where the result is
+/// the same with 16-bit and 32-bit words.
+///
+/// A program that runs without error writes the same output and finishes
+/// with the same result once rewritten, provided that it only returns to
+/// where it was called from and never reads a word that `PUSH` reserved
+/// before writing it. One that fails may fail at a different address, or,
+/// if it only failed on the stack in code that is now folded away, not at
+/// all.
+/// @param[in] Program program to rewrite
+/// @param[out] Code receives the new code words, to be freed by the caller
+/// @param[out] Size receives the number of words in `Code`
+/// @param[out] Stats receives what was changed
+/// @return 0 on success, -1 if memory ran out, or 1 if the program jumps or
+/// calls through an address that cannot be moved, such as one relative to
+/// LB, or uses code addresses in any other way than a `LOADA` straight into
+/// a `JUMPI`, in which case it is left alone
+int optimizeProgram(const TamProgram *Program, CODE_W **Code, int *Size,
+                    OptStats *Stats);
+
+#endif
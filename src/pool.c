@@ -0,0 +1,72 @@
+#include <tam/pool.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+struct TamPool {
+    pthread_mutex_t Lock;
+    TamEmulator **Idle; ///< Emulators ready to hand out
+    int NumIdle;
+    int MaxIdle;
+};
+
+TamPool *newPool(int MaxIdle) {
+    assert(MaxIdle >= 0);
+    TamPool *Pool = calloc(1, sizeof(TamPool));
+    if (!Pool) {
+        return NULL;
+    }
+
+    Pool->Idle = calloc(MaxIdle ? MaxIdle : 1, sizeof(TamEmulator *));
+    if (!Pool->Idle) {
+        free(Pool);
+        return NULL;
+    }
+    Pool->MaxIdle = MaxIdle;
+    pthread_mutex_init(&Pool->Lock, NULL);
+    return Pool;
+}
+
+void freePool(TamPool *Pool) {
+    if (!Pool) {
+        return;
+    }
+    for (int i = 0; i < Pool->NumIdle; ++i) {
+        freeEmulator(Pool->Idle[i]);
+    }
+    pthread_mutex_destroy(&Pool->Lock);
+    free(Pool->Idle);
+    free(Pool);
+}
+
+TamEmulator *acquireEmulator(TamPool *Pool) {
+    assert(Pool);
+    TamEmulator *Emulator = NULL;
+
+    pthread_mutex_lock(&Pool->Lock);
+    if (Pool->NumIdle) {
+        Emulator = Pool->Idle[--Pool->NumIdle];
+    }
+    pthread_mutex_unlock(&Pool->Lock);
+
+    return Emulator ? Emulator : newEmulator();
+}
+
+void releaseEmulator(TamPool *Pool, TamEmulator *Emulator) {
+    assert(Pool);
+    if (!Emulator) {
+        return;
+    }
+
+    // reset outside the lock, so that other threads are not kept waiting
+    resetEmulator(Emulator);
+
+    pthread_mutex_lock(&Pool->Lock);
+    if (Pool->NumIdle < Pool->MaxIdle) {
+        Pool->Idle[Pool->NumIdle++] = Emulator;
+        Emulator = NULL;
+    }
+    pthread_mutex_unlock(&Pool->Lock);
+
+    freeEmulator(Emulator);
+}
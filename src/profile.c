@@ -0,0 +1,414 @@
+#include "profile.h"
+
+#include "disasm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Number of primitive routines, counting the unused number 0.
+#define NUM_PRIMITIVES 29
+/// Number of instructions listed in the hottest instructions table.
+#define HOTTEST 20
+
+static const char *const OpcodeNames[16] = {
+    "LOAD",   "LOADA",  "LOADI",  "LOADL",  "STORE",  "STOREI",
+    "CALL",   "CALLI",  "RETURN", "OP9",    "PUSH",   "POP",
+    "JUMP",   "JUMPI",  "JUMPIF", "HALT",
+};
+
+static const char *const PrimitiveNames[NUM_PRIMITIVES] = {
+    "",        "id",      "not",     "and",     "or",      "succ",
+    "pred",    "neg",     "add",     "sub",     "mult",    "div",
+    "mod",     "lt",      "le",      "ge",      "gt",      "eq",
+    "neq",     "eol",     "eof",     "get",     "put",     "geteol",
+    "puteol",  "getint",  "putint",  "new",     "dispose",
+};
+
+/// @brief A node of the call tree: one distinct chain of calls from the
+/// start of the program.
+typedef struct StackNode {
+    int Parent;     ///< Node of the calling chain, or -1 for the root
+    int Routine;    ///< Routine called last in the chain
+    uint64_t Count; ///< Instructions executed with exactly this chain active
+} StackNode;
+
+/// @brief An entry of the shadow call stack.
+typedef struct Frame {
+    int Node;       ///< Call tree node for the stack up to this frame
+    int Routine;    ///< Routine the frame belongs to
+    ADDRESS Lb;     ///< LB while the routine runs
+    uint64_t Entry; ///< Steps taken when the routine was called
+} Frame;
+
+/// @brief Counts for one routine.
+typedef struct RoutineStats {
+    uint64_t Calls;     ///< Number of times it was called
+    uint64_t Inclusive; ///< Instructions run by it and by what it called
+    uint64_t Exclusive; ///< Instructions run by it alone
+    int Active;         ///< Number of its frames on the shadow stack
+} RoutineStats;
+
+struct Profile {
+    TamProgram *Program; ///< Program being profiled
+    int Size;            ///< Number of instructions; also the index of main
+    uint64_t Total;      ///< Instructions executed, once the run is over
+    uint64_t Opcodes[16];
+    uint64_t Primitives[NUM_PRIMITIVES];
+    uint64_t *Addresses;    ///< Count for each instruction
+    uint64_t Start;         ///< Emulator's steps when the profile began
+    uint64_t Last;          ///< Steps up to the last call or return
+    RoutineStats *Routines; ///< Counts by routine address, then for main
+
+    StackNode *Nodes;
+    int NumNodes, MaxNodes;
+    int *Table; ///< Hash table of nodes by parent and routine, as index + 1
+    int TableSize;
+
+    Frame *Frames;
+    int Depth, MaxDepth;
+    TamProfiler Hooks; ///< Handed to runEmulatorProfiled()
+};
+
+/// Double the capacity of an array, exiting if memory runs out.
+static void *growArray(void *Array, int *Capacity, size_t ElementSize) {
+    *Capacity = *Capacity ? 2 * *Capacity : 64;
+    Array = realloc(Array, *Capacity * ElementSize);
+    if (!Array) {
+        fprintf(stderr, "out of memory while profiling\n");
+        exit(1);
+    }
+    return Array;
+}
+
+/// Hash a call tree node by its parent and routine.
+static uint32_t hashNode(int Parent, int Routine) {
+    return (uint32_t)Parent * 0x9e3779b1u ^ (uint32_t)Routine * 0x85ebca6bu;
+}
+
+/// Rebuild the node hash table at twice its size.
+static void growTable(Profile *P) {
+    free(P->Table);
+    P->TableSize *= 2;
+    P->Table = calloc(P->TableSize, sizeof(int));
+    if (!P->Table) {
+        fprintf(stderr, "out of memory while profiling\n");
+        exit(1);
+    }
+
+    uint32_t Mask = P->TableSize - 1;
+    for (int i = 0; i < P->NumNodes; ++i) {
+        uint32_t H = hashNode(P->Nodes[i].Parent, P->Nodes[i].Routine) & Mask;
+        while (P->Table[H]) {
+            H = (H + 1) & Mask;
+        }
+        P->Table[H] = i + 1;
+    }
+}
+
+/// @brief Find or add the call tree node for calling a routine from a chain.
+/// @param[in,out] P profile to search
+/// @param Parent node of the calling chain
+/// @param Routine routine called
+/// @return index of the node
+static int childNode(Profile *P, int Parent, int Routine) {
+    if (2 * (P->NumNodes + 1) > P->TableSize) {
+        growTable(P);
+    }
+
+    uint32_t Mask = P->TableSize - 1;
+    uint32_t H = hashNode(Parent, Routine) & Mask;
+    for (; P->Table[H]; H = (H + 1) & Mask) {
+        StackNode *Node = &P->Nodes[P->Table[H] - 1];
+        if (Node->Parent == Parent && Node->Routine == Routine) {
+            return P->Table[H] - 1;
+        }
+    }
+
+    if (P->NumNodes == P->MaxNodes) {
+        P->Nodes = growArray(P->Nodes, &P->MaxNodes, sizeof(StackNode));
+    }
+    P->Nodes[P->NumNodes] = (StackNode){.Parent = Parent, .Routine = Routine};
+    P->Table[H] = ++P->NumNodes;
+    return P->NumNodes - 1;
+}
+
+/// Enter a routine, making it the one charged for each instruction.
+static void pushFrame(Profile *P, int Routine, ADDRESS Lb) {
+    if (P->Depth == P->MaxDepth) {
+        P->Frames = growArray(P->Frames, &P->MaxDepth, sizeof(Frame));
+    }
+    int Parent = P->Depth ? P->Frames[P->Depth - 1].Node : 0;
+    P->Frames[P->Depth++] = (Frame){.Node = childNode(P, Parent, Routine),
+                                    .Routine = Routine,
+                                    .Lb = Lb,
+                                    .Entry = P->Last};
+
+    RoutineStats *R = &P->Routines[Routine];
+    ++R->Calls;
+    ++R->Active;
+}
+
+/// Leave the innermost routine. Time in a recursive routine is added to its
+/// inclusive count only when its outermost frame is left.
+static void popFrame(Profile *P) {
+    Frame *F = &P->Frames[--P->Depth];
+    RoutineStats *R = &P->Routines[F->Routine];
+    if (--R->Active == 0) {
+        R->Inclusive += P->Last - F->Entry;
+    }
+}
+
+/// Charge the steps taken since the last call or return to the chain of
+/// calls active while they ran.
+static void chargeSteps(Profile *P, uint64_t Steps) {
+    P->Nodes[P->Depth ? P->Frames[P->Depth - 1].Node : 0].Count +=
+        Steps - P->Last;
+    P->Last = Steps;
+}
+
+/// The CALL itself is charged to the caller, and everything after it to
+/// the routine it called.
+static void profileCall(void *Context, uint64_t Steps, ADDRESS Routine,
+                        ADDRESS Lb) {
+    Profile *P = Context;
+    chargeSteps(P, Steps);
+    pushFrame(P, Routine, Lb);
+}
+
+static void profileReturn(void *Context, uint64_t Steps, ADDRESS Lb) {
+    Profile *P = Context;
+    chargeSteps(P, Steps);
+    if (!P->Depth) {
+        return;
+    }
+    // leave the frame LB points to, and any the program abandoned on the
+    // way; if no frame matches, assume the innermost one is returning
+    int Target = P->Depth - 1;
+    while (Target >= 0 && P->Frames[Target].Lb != Lb) {
+        --Target;
+    }
+    if (Target < 0) {
+        Target = P->Depth - 1;
+    }
+    while (P->Depth > Target) {
+        popFrame(P);
+    }
+}
+
+Profile *newProfile(const TamEmulator *Emulator) {
+    assert(Emulator);
+    assert(Emulator->Program);
+
+    Profile *P = calloc(1, sizeof(Profile));
+    if (!P) {
+        return NULL;
+    }
+    P->Size = Emulator->Program->Size;
+    P->Addresses = calloc(P->Size + 1, sizeof(uint64_t));
+    P->Routines = calloc(P->Size + 1, sizeof(RoutineStats));
+    P->TableSize = 64;
+    P->Table = calloc(P->TableSize, sizeof(int));
+    if (!P->Addresses || !P->Routines || !P->Table) {
+        freeProfile(P);
+        return NULL;
+    }
+
+    // the root of the call tree stands for the main program
+    P->Program = retainProgram(Emulator->Program);
+    P->Routines[P->Size].Calls = 1;
+    childNode(P, -1, P->Size);
+    P->Start = P->Last = Emulator->Steps;
+    P->Hooks = (TamProfiler){.Counts = P->Addresses,
+                             .Context = P,
+                             .Call = profileCall,
+                             .Return = profileReturn};
+    return P;
+}
+
+void freeProfile(Profile *P) {
+    if (P) {
+        releaseProgram(P->Program);
+        free(P->Addresses);
+        free(P->Routines);
+        free(P->Nodes);
+        free(P->Table);
+        free(P->Frames);
+    }
+    free(P);
+}
+
+TamProfiler *profileHooks(Profile *P) {
+    assert(P);
+    return &P->Hooks;
+}
+
+/// Write the name of a routine as used in reports.
+static void routineName(const Profile *P, int Routine, char *Buf) {
+    if (Routine == P->Size) {
+        strcpy(Buf, "main");
+    } else {
+        snprintf(Buf, 16, "0x%04x", Routine);
+    }
+}
+
+static const Profile *SortProfile;
+
+/// Order routines by inclusive count, most first.
+static int compareInclusive(const void *A, const void *B) {
+    uint64_t X = SortProfile->Routines[*(const int *)A].Inclusive;
+    uint64_t Y = SortProfile->Routines[*(const int *)B].Inclusive;
+    return X < Y ? 1 : X > Y ? -1 : *(const int *)A - *(const int *)B;
+}
+
+/// Order addresses by execution count, most first.
+static int compareAddress(const void *A, const void *B) {
+    uint64_t X = SortProfile->Addresses[*(const int *)A];
+    uint64_t Y = SortProfile->Addresses[*(const int *)B];
+    return X < Y ? 1 : X > Y ? -1 : *(const int *)A - *(const int *)B;
+}
+
+/// Write the human-readable report.
+static void writeReport(const Profile *P, FILE *Out) {
+    double Scale = P->Total ? 100.0 / P->Total : 0;
+    fprintf(Out, "instructions executed: %llu\n\n",
+            (unsigned long long)P->Total);
+
+    fprintf(Out, "%-12s %14s %7s\n", "opcode", "count", "share");
+    for (int i = 0; i < 16; ++i) {
+        if (P->Opcodes[i]) {
+            fprintf(Out, "%-12s %14llu %6.2f%%\n", OpcodeNames[i],
+                    (unsigned long long)P->Opcodes[i], P->Opcodes[i] * Scale);
+        }
+    }
+
+    fprintf(Out, "\n%-12s %14s %7s\n", "primitive", "calls", "share");
+    for (int i = 1; i < NUM_PRIMITIVES; ++i) {
+        if (P->Primitives[i]) {
+            fprintf(Out, "%-12s %14llu %6.2f%%\n", PrimitiveNames[i],
+                    (unsigned long long)P->Primitives[i],
+                    P->Primitives[i] * Scale);
+        }
+    }
+
+    int *Order = malloc((P->Size + 1) * sizeof(int));
+    int Count = 0;
+    for (int i = 0; i <= P->Size; ++i) {
+        if (P->Routines[i].Calls) {
+            Order[Count++] = i;
+        }
+    }
+    SortProfile = P;
+    qsort(Order, Count, sizeof(int), compareInclusive);
+    fprintf(Out, "\n%-12s %14s %14s %7s %14s %7s\n", "routine", "calls",
+            "inclusive", "share", "exclusive", "share");
+    for (int i = 0; i < Count; ++i) {
+        const RoutineStats *R = &P->Routines[Order[i]];
+        char Name[16];
+        routineName(P, Order[i], Name);
+        fprintf(Out, "%-12s %14llu %14llu %6.2f%% %14llu %6.2f%%\n", Name,
+                (unsigned long long)R->Calls, (unsigned long long)R->Inclusive,
+                R->Inclusive * Scale, (unsigned long long)R->Exclusive,
+                R->Exclusive * Scale);
+    }
+
+    Count = 0;
+    for (int i = 0; i < P->Size; ++i) {
+        if (P->Addresses[i]) {
+            Order[Count++] = i;
+        }
+    }
+    qsort(Order, Count, sizeof(int), compareAddress);
+    fprintf(Out, "\n%-12s %14s %7s  %s\n", "address", "count", "share",
+            "instruction");
+    for (int i = 0; i < Count && i < HOTTEST; ++i) {
+        char Text[32];
+        instructionString(P->Program->Code[Order[i]], Text);
+        fprintf(Out, "0x%04x       %14llu %6.2f%%  %s\n", Order[i],
+                (unsigned long long)P->Addresses[Order[i]],
+                P->Addresses[Order[i]] * Scale, Text);
+    }
+    free(Order);
+}
+
+/// Write one line per call chain: the routines from the root down, separated
+/// by semicolons, then the number of instructions run in that chain.
+static void writeFolded(const Profile *P, FILE *Out) {
+    int *Chain = NULL;
+    int MaxChain = 0;
+    for (int i = 0; i < P->NumNodes; ++i) {
+        if (!P->Nodes[i].Count) {
+            continue;
+        }
+
+        int Length = 0;
+        for (int Node = i; Node >= 0; Node = P->Nodes[Node].Parent) {
+            if (Length == MaxChain) {
+                Chain = growArray(Chain, &MaxChain, sizeof(int));
+            }
+            Chain[Length++] = Node;
+        }
+        while (Length--) {
+            char Name[16];
+            routineName(P, P->Nodes[Chain[Length]].Routine, Name);
+            fprintf(Out, "%s%c", Name, Length ? ';' : ' ');
+        }
+        fprintf(Out, "%llu\n", (unsigned long long)P->Nodes[i].Count);
+    }
+    free(Chain);
+}
+
+int writeProfile(Profile *P, const char *Filename) {
+    assert(P);
+    assert(Filename);
+
+    // opcodes and primitives follow from the count at each address
+    P->Total = 0;
+    memset(P->Opcodes, 0, sizeof(P->Opcodes));
+    memset(P->Primitives, 0, sizeof(P->Primitives));
+    for (int i = 0; i < P->Size; ++i) {
+        Instruction I = P->Program->Code[i];
+        P->Total += P->Addresses[i];
+        P->Opcodes[I.Op] += P->Addresses[i];
+        if (I.Op == CALL && I.R == PB && I.D > 0 && I.D < NUM_PRIMITIVES) {
+            P->Primitives[I.D] += P->Addresses[i];
+        }
+    }
+
+    // whatever ran after the last call or return belongs to the innermost
+    // frame
+    chargeSteps(P, P->Start + P->Total);
+    while (P->Depth) {
+        popFrame(P);
+    }
+    P->Routines[P->Size].Inclusive = P->Total;
+    for (int i = 0; i <= P->Size; ++i) {
+        P->Routines[i].Exclusive = 0;
+    }
+    for (int i = 0; i < P->NumNodes; ++i) {
+        P->Routines[P->Nodes[i].Routine].Exclusive += P->Nodes[i].Count;
+    }
+
+    FILE *Report = fopen(Filename, "w");
+    if (!Report) {
+        return -1;
+    }
+    writeReport(P, Report);
+    int Failed = fclose(Report);
+
+    size_t Length = strlen(Filename);
+    char *FoldedName = malloc(Length + sizeof(".folded"));
+    if (!FoldedName) {
+        return -1;
+    }
+    memcpy(FoldedName, Filename, Length);
+    strcpy(FoldedName + Length, ".folded");
+    FILE *Folded = fopen(FoldedName, "w");
+    free(FoldedName);
+    if (!Folded) {
+        return -1;
+    }
+    writeFolded(P, Folded);
+    Failed |= fclose(Folded);
+    return Failed ? -1 : 0;
+}
@@ -0,0 +1,37 @@
+#ifndef TAM_PROFILE_H__
+#define TAM_PROFILE_H__
+
+#include <tam/tam.h>
+
+/// @brief Execution counts gathered while a program runs.
+///
+/// Instructions are counted by opcode, by primitive, by address and by
+/// routine. A shadow call stack follows the program's frames so that every
+/// instruction is charged to the routine running it and to each distinct
+/// chain of calls leading there. Routines are named after their address.
+typedef struct Profile Profile;
+
+/// @brief Start a profile for the program an emulator has loaded.
+/// @param Emulator emulator about to run its program from the start
+/// @return the new profile, or null if allocation failed
+Profile *newProfile(const TamEmulator *Emulator);
+
+/// @brief Free a profile.
+/// @param P profile to free, may be null
+void freeProfile(Profile *P);
+
+/// @brief Get the hooks that fill in a profile, to be passed to
+/// runEmulatorProfiled().
+/// @param P profile to fill in
+/// @return hooks that stay valid as long as the profile
+TamProfiler *profileHooks(Profile *P);
+
+/// @brief Write a report on a finished run, and its call stacks in the
+/// folded format that flame graph tools read.
+/// @param[in,out] P profile of the run, whose open frames are closed
+/// @param Filename file to write the report to; the stacks go to the same
+/// name with `.folded` appended
+/// @return 0 on success, -1 if a file could not be written
+int writeProfile(Profile *P, const char *Filename);
+
+#endif
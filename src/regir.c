@@ -0,0 +1,1256 @@
+#include <tam/tam.h>
+
+#include "internal.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tam/error.h>
+
+#if defined(__GNUC__) && !defined(TAM_SWITCH_DISPATCH)
+#define TAM_THREADED 1
+#endif
+
+// The register engine translates each basic block the first time control
+// reaches it into code for a machine with an unlimited supply of virtual
+// registers, and runs that instead of the stack code.
+//
+// While a block is translated, every stack slot it touches is described
+// rather than written. A slot's value may be in a virtual register, be a
+// constant, be some word of memory as it is now, or still be whatever the
+// slot held when the block was entered. LOADs, LOADLs and LOADAs only copy
+// descriptions; STOREs to the stack and POPs only move them. Code is
+// generated for the arithmetic, for stores to memory outside the stack and
+// for anything that must happen at run time, with the operands read
+// straight from wherever their descriptions say they are, so most of the
+// pushing and popping disappears.
+//
+// Slots are only written to the data store when the block ends, or at a
+// side exit: every slot whose description is not its own entry value is
+// written, dead ones above ST included, so the data store is then exactly
+// as the interpreter would have left it. Stores to memory below the stack
+// happen in order, after any description that reads the memory they
+// overwrite has been copied to a register.
+//
+// As in the JIT compiler, whatever can be checked before a block runs
+// (stack depth and room, addresses relative to SB or LB, the step budget)
+// is checked once on entry, and the block is interpreted instead if any
+// check fails. Whatever depends on values is checked where it happens, and
+// on failure the block writes its slots back and hands over to the
+// interpreter at that instruction, which reports the error.
+
+/// Longest block, in instructions.
+#define IR_MAX_BLOCK 128
+/// Most operations in one block, counting its side exits.
+#define IR_MAX_OPS 4096
+/// Most distinct constants in one block.
+#define IR_MAX_CONSTS 256
+/// Slots from this far below ST at the start of a block to this far above
+/// it can be described.
+#define IR_SLOT_BIAS 256
+/// Most words a single LOAD, STORE or POP can move and still be translated.
+#define IR_MAX_WORDS 16
+/// Static link of a CALL that is a constant rather than a register.
+#define IR_LINK_CONST 0xff
+
+/// Where an operand is: the base its offset is added to.
+enum {
+    IR_REG,   ///< A virtual register
+    IR_CONST, ///< One of the block's constants
+    IR_MEM,   ///< An absolute address
+    IR_LB,    ///< An address relative to LB
+    IR_ST,    ///< A slot, relative to ST at the start of the block
+    IR_NUM_BASES
+};
+
+/// Operations. Each reads operands A and B and writes Dst, any of which may
+/// be in memory.
+enum {
+    IR_MOV,
+    IR_SPILL, ///< IR_MOV to a slot
+    IR_NOT,
+    IR_SUCC,
+    IR_PRED,
+    IR_NEG,
+    IR_AND,
+    IR_OR,
+    IR_ADD,
+    IR_SUB,
+    IR_MULT,
+    IR_DIV, ///< Takes the side exit at `Imm` if B is zero
+    IR_MOD, ///< Likewise
+    IR_LT,
+    IR_LE,
+    IR_GE,
+    IR_EQ,
+    IR_NEQ,
+    IR_ADDR,   ///< Dst = the register `Link` plus `Imm`
+    IR_LOADI,  ///< Dst = the word A points to, or the side exit at `Imm`
+    IR_STOREI, ///< The word A points to = B, or the side exit at `Imm`
+    IR_PUT,
+    IR_PUTEOL,
+    IR_PUTINT,
+
+    // these end the block
+    IR_GOTO,   ///< Carry on at `Imm`
+    IR_BRANCH, ///< Carry on at `Imm` if A is `Arg`, else at the next
+    IR_JUMPI,  ///< Carry on at A
+    IR_CALL,   ///< Call `Imm`, with static link `Link`, or A if constant
+    IR_RETURN, ///< Return `Imm` words, popping `Arg`
+    IR_HALT,
+    IR_EXIT, ///< Side exit: interpret from the instruction at `Index`
+    IR_NUM_OPS
+};
+
+/// Reasons execBlocks() returns to runEmulatorIR().
+enum {
+    IR_CONTINUE,  ///< Carry on at CP, in translated code if there is some
+    IR_INTERPRET, ///< Interpret the block at CP
+    IR_HALTED,    ///< The program halted
+};
+
+/// @brief An operand, or the description of a slot.
+typedef struct Operand {
+    int32_t Off;
+    uint8_t Base;
+} Operand;
+
+/// @brief A single operation.
+typedef struct IROp {
+    uint8_t Op;
+    uint8_t Link;   ///< Register an IR_ADDR or IR_CALL reads
+    uint16_t Index; ///< Instruction it belongs to, within the block
+    int32_t K;      ///< ST before that instruction, relative to the start
+    int32_t Imm;
+    int32_t Arg;
+    Operand Dst, A, B;
+} IROp;
+
+/// @brief A translated block, with the checks made on entry.
+typedef struct IRBlock {
+    ADDRESS Start; ///< Address of the first instruction
+    uint32_t Len;  ///< Instructions translated
+    int32_t MinK;  ///< Lowest slot used; ST plus this is at least 0
+    int32_t MaxK;  ///< Highest ST reaches, relative to the start
+    int32_t Need;  ///< ST plus this must not exceed HT
+    int32_t Depth; ///< ST - LB required on entry, or DEPTH_UNKNOWN
+    int64_t MemHi; ///< Static addresses used lie below this, at least 0
+    int UsesLb;    ///< Nonzero if memory is addressed relative to LB
+    int32_t LbLo;  ///< LB plus this must not be negative
+    int32_t LbHi;  ///< LB plus this must not exceed ST plus `MinK`
+    DATA_W *Consts;
+    IROp Ops[];
+} IRBlock;
+
+/// @brief A block being translated.
+typedef struct Translator {
+    const Instruction *Code;
+    const ADDRESS *Registers;
+    int Size;
+    ADDRESS Start;
+    int Len;
+    int K;        ///< ST, relative to the start
+    int Depth;    ///< ST - LB at the start, or DEPTH_UNKNOWN
+    int UseDepth; ///< Nonzero if slots are addressed through `Depth`
+    int SlotLo;   ///< Slots described, from this
+    int SlotHi;   ///< up to but not including this
+    int NumRegs;
+    int LastDef; ///< Operation that last set a new register, or -1
+    int NumOps;
+    int NumStubs;
+    int NumConsts;
+
+    int MinK, MaxK, Need, UsesLb, LbLo, LbHi;
+    int64_t MemHi;
+
+    Operand Slots[2 * IR_SLOT_BIAS];
+    DATA_W Consts[IR_MAX_CONSTS];
+    IROp Ops[IR_MAX_OPS];
+    IROp Stubs[IR_MAX_OPS];
+} Translator;
+
+struct TamIR {
+    TamProgram *Program;   ///< Program translated, with a reference held
+    int Size;              ///< Number of instructions
+    ADDRESS Registers[16]; ///< Static registers for the program
+    IRBlock **Blocks;      ///< Block at each address, if translated
+    DATA_W *Regs;          ///< Virtual registers
+    Translator *Scratch;   ///< State for the block being translated
+};
+
+/// Marks an address whose block cannot be translated.
+static IRBlock Untranslatable;
+
+static int max(int A, int B) { return A > B ? A : B; }
+
+static int min(int A, int B) { return A < B ? A : B; }
+
+static Operand operand(int Base, int32_t Off) {
+    Operand O = {Off, Base};
+    return O;
+}
+
+static int sameOperand(Operand A, Operand B) {
+    return A.Base == B.Base && A.Off == B.Off;
+}
+
+/// The description of a slot.
+static Operand *slot(Translator *T, int K) {
+    return &T->Slots[K + IR_SLOT_BIAS];
+}
+
+/// Check whether slots `Lo` up to `Hi` can be described.
+static int slotsInRange(int Lo, int Hi) {
+    return Lo >= -IR_SLOT_BIAS && Hi <= IR_SLOT_BIAS;
+}
+
+/// Note that slots `Lo` up to `Hi` are read or written, so must lie above
+/// the bottom of memory.
+static void useSlots(Translator *T, int Lo, int Hi) {
+    T->SlotLo = min(T->SlotLo, Lo);
+    T->SlotHi = max(T->SlotHi, Hi);
+    T->MinK = min(T->MinK, Lo);
+}
+
+/// Check whether a slot holds something other than its value on entry, and
+/// so must be written back.
+static int isDirty(Translator *T, int K) {
+    return !sameOperand(*slot(T, K), operand(IR_ST, K));
+}
+
+/// Require room for ST to reach `K` with HT above it.
+static void needRoom(Translator *T, int K) {
+    T->Need = max(T->Need, K);
+    T->MaxK = max(T->MaxK, K);
+}
+
+static Operand constant(Translator *T, DATA_W Value) {
+    for (int i = 0; i < T->NumConsts; ++i) {
+        if (T->Consts[i] == Value) {
+            return operand(IR_CONST, i);
+        }
+    }
+    T->Consts[T->NumConsts] = Value;
+    return operand(IR_CONST, T->NumConsts++);
+}
+
+static Operand newReg(Translator *T) { return operand(IR_REG, T->NumRegs++); }
+
+/// Append an operation for the current instruction, to the block or, for a
+/// side exit, after it.
+static IROp *emitTo(Translator *T, int Stub, int Op) {
+    IROp *O = Stub ? &T->Stubs[T->NumStubs++] : &T->Ops[T->NumOps++];
+    memset(O, 0, sizeof(IROp));
+    O->Op = Op;
+    O->Index = T->Len;
+    O->K = T->K;
+    if (!Stub) {
+        T->LastDef = -1;
+    }
+    return O;
+}
+
+static IROp *emit(Translator *T, int Op) { return emitTo(T, 0, Op); }
+
+/// Append an operation that sets a new register, returning the register.
+static Operand emitDef(Translator *T, int Op, Operand A, Operand B) {
+    IROp *O = emit(T, Op);
+    O->Dst = newReg(T);
+    O->A = A;
+    O->B = B;
+    T->LastDef = T->NumOps - 1;
+    return O->Dst;
+}
+
+/// Copy a value described by memory into a register, and describe every
+/// slot that held it by the register instead.
+static void materialise(Translator *T, Operand Value) {
+    Operand Reg = emitDef(T, IR_MOV, Value, Value);
+    for (int K = T->SlotLo; K < T->SlotHi; ++K) {
+        if (sameOperand(*slot(T, K), Value)) {
+            *slot(T, K) = Reg;
+        }
+    }
+}
+
+/// Check whether writing `N` words at `Off` from `Base` could change the
+/// value an operand describes. Slots are never written mid-block, and the
+/// checks on entry keep memory operands below them.
+static int mayAlias(Operand O, int Base, int32_t Off, int N) {
+    if (O.Base != IR_MEM && O.Base != IR_LB) {
+        return 0;
+    }
+    if (O.Base != Base) {
+        return 1;
+    }
+    return O.Off >= Off && O.Off < Off + N;
+}
+
+/// Copy to registers every description that writing `N` words at `Off`
+/// from `Base` could change, or every one read from memory if `N` is 0.
+static void protect(Translator *T, int Base, int32_t Off, int N) {
+    for (int K = T->SlotLo; K < T->SlotHi; ++K) {
+        Operand O = *slot(T, K);
+        if (N ? mayAlias(O, Base, Off, N)
+              : O.Base == IR_MEM || O.Base == IR_LB) {
+            materialise(T, O);
+        }
+    }
+}
+
+/// Write back every slot whose description is not its value on entry. A
+/// slot described as another slot that is itself written back is read into
+/// a register first.
+static void spill(Translator *T, int Stub) {
+    Operand Values[2 * IR_SLOT_BIAS];
+    for (int K = T->SlotLo; K < T->SlotHi; ++K) {
+        Operand O = *slot(T, K);
+        Values[K + IR_SLOT_BIAS] = O;
+        if (isDirty(T, K) && O.Base == IR_ST && isDirty(T, O.Off)) {
+            IROp *Mov = emitTo(T, Stub, IR_MOV);
+            Mov->Dst = Values[K + IR_SLOT_BIAS] = newReg(T);
+            Mov->A = O;
+        }
+    }
+    for (int K = T->SlotLo; K < T->SlotHi; ++K) {
+        if (isDirty(T, K)) {
+            IROp *Mov = emitTo(T, Stub, IR_SPILL);
+            Mov->Dst = operand(IR_ST, K);
+            Mov->A = Values[K + IR_SLOT_BIAS];
+        }
+    }
+}
+
+/// Make a side exit for the current instruction, to be taken if a check on
+/// it fails, and return where it starts among the side exits.
+static int sideExit(Translator *T) {
+    int At = T->NumStubs;
+    spill(T, 1);
+    emitTo(T, 1, IR_EXIT);
+    return At;
+}
+
+/// Make sure a value can be read after the slots are written back, which
+/// only matters if it is a slot that is itself written back.
+static Operand beforeSpill(Translator *T, Operand O) {
+    if (O.Base == IR_ST && isDirty(T, O.Off)) {
+        return emitDef(T, IR_MOV, O, O);
+    }
+    return O;
+}
+
+/// End the block: write back the slots, then leave through `Op`.
+static IROp *finish(Translator *T, int Op) {
+    spill(T, 0);
+    return emit(T, Op);
+}
+
+/// Find the slot an access relative to ST or LB lands on.
+/// @return 1 if it lands on a slot, 0 if it must go through memory or
+/// cannot be translated at all
+static int slotOf(Translator *T, const Instruction *I, int *K) {
+    if (I->R == ST) {
+        *K = T->K + I->D;
+        return 1;
+    }
+    if (I->R == LB && T->Depth != DEPTH_UNKNOWN) {
+        *K = I->D - T->Depth;
+        return 1;
+    }
+    return 0;
+}
+
+/// Translate a LOAD of `N` words, pushing their descriptions.
+static int translateLoad(Translator *T, const Instruction *I) {
+    int N = I->N, K;
+    if (N < 1 || N > IR_MAX_WORDS || !slotsInRange(T->K, T->K + N)) {
+        return 0;
+    }
+    if (I->R == HT) {
+        return 0;
+    }
+    if (slotOf(T, I, &K)) {
+        if (!slotsInRange(K, K + N) || K + N > T->K) {
+            return 0;
+        }
+        useSlots(T, K, K + N);
+        T->UseDepth |= I->R == LB;
+        for (int i = 0; i < N; ++i) {
+            *slot(T, T->K + i) = *slot(T, K + i);
+        }
+    } else if (I->R == LB) {
+        T->UsesLb = 1;
+        T->LbLo = min(T->LbLo, I->D);
+        T->LbHi = max(T->LbHi, I->D + N);
+        for (int i = 0; i < N; ++i) {
+            *slot(T, T->K + i) = operand(IR_LB, I->D + i);
+        }
+    } else {
+        T->MemHi =
+            (int64_t)I->Target + N > T->MemHi ? (int64_t)I->Target + N : T->MemHi;
+        for (int i = 0; i < N; ++i) {
+            *slot(T, T->K + i) = operand(IR_MEM, (int32_t)I->Target + i);
+        }
+    }
+    useSlots(T, T->K, T->K + N);
+    T->K += N;
+    needRoom(T, T->K);
+    return 1;
+}
+
+/// Translate a STORE of `N` words from the top of the stack.
+static int translateStore(Translator *T, const Instruction *I) {
+    int N = I->N, K;
+    int From = T->K - N;
+    if (N < 1 || N > IR_MAX_WORDS || !slotsInRange(From, T->K)) {
+        return 0;
+    }
+    if (I->R == HT) {
+        return 0;
+    }
+    // an address relative to ST is taken after the words are popped
+    if (slotOf(T, I, &K)) {
+        K -= I->R == ST ? N : 0;
+        if (!slotsInRange(K, K + N) || K + N > From) {
+            return 0;
+        }
+        useSlots(T, K, K + N);
+        useSlots(T, From, T->K);
+        T->UseDepth |= I->R == LB;
+        for (int i = 0; i < N; ++i) {
+            *slot(T, K + i) = *slot(T, From + i);
+        }
+        T->K = From;
+        return 1;
+    }
+
+    int Base;
+    int32_t Off;
+    if (I->R == LB) {
+        Base = IR_LB;
+        Off = I->D;
+        T->UsesLb = 1;
+        T->LbLo = min(T->LbLo, Off);
+        T->LbHi = max(T->LbHi, Off + N);
+    } else {
+        Base = IR_MEM;
+        Off = (int32_t)I->Target;
+        T->MemHi = (int64_t)I->Target + N > T->MemHi ? (int64_t)I->Target + N
+                                                      : T->MemHi;
+    }
+    useSlots(T, From, T->K);
+
+    // a value computed just before it is stored is computed straight into
+    // memory, unless something still needs what is there now
+    Operand Top = *slot(T, T->K - 1);
+    int Fold = N == 1 && Top.Base == IR_REG && T->LastDef == T->NumOps - 1 &&
+               sameOperand(T->Ops[T->LastDef].Dst, Top);
+    for (int k = T->SlotLo; Fold && k < T->SlotHi; ++k) {
+        Operand O = *slot(T, k);
+        if ((k != T->K - 1 && sameOperand(O, Top)) ||
+            mayAlias(O, Base, Off, N)) {
+            Fold = 0;
+        }
+    }
+    if (Fold) {
+        T->Ops[T->LastDef].Dst = operand(Base, Off);
+        *slot(T, T->K - 1) = operand(Base, Off);
+        T->LastDef = -1;
+        T->K = From;
+        return 1;
+    }
+
+    protect(T, Base, Off, N);
+    for (int i = 0; i < N; ++i) {
+        IROp *Mov = emit(T, IR_MOV);
+        Mov->Dst = operand(Base, Off + i);
+        Mov->A = *slot(T, From + i);
+    }
+    T->K = From;
+    return 1;
+}
+
+/// Translate a primitive that reads the top `Args` words and replaces them
+/// with one.
+static int translatePrimitive(Translator *T, int Prim) {
+    static const uint8_t Ops[] = {
+        [2] = IR_NOT,  [3] = IR_AND,   [4] = IR_OR,   [5] = IR_SUCC,
+        [6] = IR_PRED, [7] = IR_NEG,   [8] = IR_ADD,  [9] = IR_SUB,
+        [10] = IR_MULT, [11] = IR_DIV, [12] = IR_MOD, [13] = IR_LT,
+        [14] = IR_LE,  [15] = IR_GE,   [16] = IR_GE,
+    };
+    int Unary = Prim == 2 || (Prim >= 5 && Prim <= 7);
+    int Args = Unary ? 1 : 2;
+    if (!slotsInRange(T->K - Args, T->K)) {
+        return 0;
+    }
+    useSlots(T, T->K - Args, T->K);
+    Operand Arg1 = *slot(T, T->K - 1);
+    Operand Arg2 = *slot(T, T->K - Args);
+    Operand Result;
+
+    int Divides = Prim == 11 || Prim == 12;
+    if (Divides && Arg2.Base == IR_CONST && !T->Consts[Arg2.Off]) {
+        return 0; // left for the interpreter to report
+    }
+    if (Arg1.Base == IR_CONST && Arg2.Base == IR_CONST) {
+        DATA_W A = T->Consts[Arg1.Off], B = T->Consts[Arg2.Off];
+        Result = constant(T, Unary ? unaryPrimitive(Prim, A)
+                                   : binaryPrimitive(Prim, A, B));
+    } else if (Divides && Arg2.Base != IR_CONST) {
+        int Stub = sideExit(T);
+        Result = emitDef(T, Ops[Prim], Arg1, Arg2);
+        T->Ops[T->NumOps - 1].Imm = Stub;
+    } else {
+        Result = emitDef(T, Ops[Prim], Arg1, Arg2);
+    }
+    T->K -= Args - 1;
+    *slot(T, T->K - 1) = Result;
+    return 1;
+}
+
+/// Translate eq or neq, when they compare single words.
+static int translateCompare(Translator *T, int Equal) {
+    if (!slotsInRange(T->K - 3, T->K)) {
+        return 0;
+    }
+    Operand Size = *slot(T, T->K - 1);
+    if (Size.Base != IR_CONST || T->Consts[Size.Off] != 1) {
+        return 0;
+    }
+    useSlots(T, T->K - 3, T->K);
+    Operand Y = *slot(T, T->K - 2), X = *slot(T, T->K - 3);
+    Operand Result;
+    if (X.Base == IR_CONST && Y.Base == IR_CONST) {
+        Result = constant(T, (T->Consts[X.Off] == T->Consts[Y.Off]) == Equal);
+    } else {
+        Result = emitDef(T, Equal ? IR_EQ : IR_NEQ, Y, X);
+    }
+    T->K -= 2;
+    *slot(T, T->K - 1) = Result;
+    return 1;
+}
+
+/// Translate an instruction that writes the top word and pops it.
+static int translateOutput(Translator *T, int Op, int Args) {
+    if (!slotsInRange(T->K - Args, T->K)) {
+        return 0;
+    }
+    useSlots(T, T->K - Args, T->K);
+    IROp *Out = emit(T, Op);
+    Out->A = *slot(T, T->K - 1);
+    T->K -= Args;
+    return 1;
+}
+
+/// Translate one instruction.
+/// @return 1 if it was translated, 0 if the block must end before it
+static int translateInstruction(Translator *T, const Instruction *I) {
+    ADDRESS Pc = T->Start + T->Len;
+    Handler H = selectHandler(I);
+    IROp *O;
+    switch (H) {
+    case H_LOAD:
+    case H_LOAD_DYN:
+        return translateLoad(T, I);
+
+    case H_LOADA:
+    case H_LOADL:
+        if (!slotsInRange(T->K, T->K + 1)) {
+            return 0;
+        }
+        *slot(T, T->K) =
+            constant(T, H == H_LOADL ? (DATA_W)I->D : (DATA_W)I->Target);
+        useSlots(T, T->K, T->K + 1);
+        needRoom(T, ++T->K);
+        return 1;
+
+    case H_LOADA_DYN:
+        if (!slotsInRange(T->K, T->K + 1)) {
+            return 0;
+        }
+        O = emit(T, IR_ADDR);
+        O->Dst = newReg(T);
+        O->Link = I->R;
+        O->Imm = I->R == ST ? T->K + I->D : I->D;
+        *slot(T, T->K) = O->Dst;
+        useSlots(T, T->K, T->K + 1);
+        needRoom(T, ++T->K);
+        return 1;
+
+    case H_LOADI:
+        if (I->N != 1 || !slotsInRange(T->K - 1, T->K)) {
+            return 0;
+        }
+        useSlots(T, T->K - 1, T->K);
+        needRoom(T, T->K);
+        O = emit(T, IR_LOADI);
+        O->Imm = sideExit(T);
+        O->Dst = newReg(T);
+        O->A = *slot(T, T->K - 1);
+        *slot(T, T->K - 1) = O->Dst;
+        return 1;
+
+    case H_STORE:
+    case H_STORE_DYN:
+        return translateStore(T, I);
+
+    case H_STOREI:
+        if (I->N != 1 || !slotsInRange(T->K - 2, T->K)) {
+            return 0;
+        }
+        useSlots(T, T->K - 2, T->K);
+        protect(T, 0, 0, 0);
+        O = emit(T, IR_STOREI);
+        O->Imm = sideExit(T);
+        O->A = *slot(T, T->K - 2);
+        O->B = *slot(T, T->K - 1);
+        T->K -= 2;
+        return 1;
+
+    case H_PUSH:
+        if (I->D < 0 || !slotsInRange(T->K, T->K + I->D)) {
+            return 0;
+        }
+        T->K += I->D;
+        needRoom(T, T->K + 1);
+        return 1;
+
+    case H_POP: {
+        int N = I->N, D = I->D < 0 ? 0 : I->D;
+        if (N > IR_MAX_WORDS || !slotsInRange(T->K - N - D, T->K)) {
+            return 0;
+        }
+        useSlots(T, T->K - N - D, T->K);
+        for (int i = 0; i < N && D; ++i) {
+            *slot(T, T->K - N - D + i) = *slot(T, T->K - N + i);
+        }
+        T->K -= D;
+        return 1;
+    }
+
+    case H_ID:
+        return 1;
+    case H_NOT:
+    case H_AND:
+    case H_OR:
+    case H_SUCC:
+    case H_PRED:
+    case H_NEG:
+    case H_ADD:
+    case H_SUB:
+    case H_MULT:
+    case H_DIV:
+    case H_MOD:
+    case H_LT:
+    case H_LE:
+    case H_GE:
+    case H_GT:
+        return translatePrimitive(T, H - H_ID + 1);
+    case H_EQ:
+    case H_NEQ:
+        return translateCompare(T, H == H_EQ);
+    case H_PUT:
+        return translateOutput(T, IR_PUT, 1);
+    case H_PUTEOL:
+        emit(T, IR_PUTEOL);
+        return 1;
+    case H_PUTINT:
+        return translateOutput(T, IR_PUTINT, 1);
+
+    case H_CALL: {
+        if (I->Target >= (ADDRESS)T->Size || !slotsInRange(T->K, T->K + 3)) {
+            return 0;
+        }
+        needRoom(T, T->K + 3);
+        Operand Link = operand(IR_CONST, 0);
+        int Reg = IR_LINK_CONST;
+        if (I->N == ST || I->N == HT || I->N == LB) {
+            Reg = I->N;
+        } else {
+            Link = constant(T, (DATA_W)(I->N == CP   ? Pc + 1
+                                        : I->N < 16 ? T->Registers[I->N]
+                                                    : 0));
+        }
+        O = finish(T, IR_CALL);
+        O->Link = Reg;
+        O->A = Link;
+        O->Imm = I->Target;
+        return 1;
+    }
+
+    case H_RETURN:
+        O = finish(T, IR_RETURN);
+        O->Imm = I->N;
+        O->Arg = I->D < 0 ? 0 : I->D;
+        return 1;
+
+    case H_JUMP:
+        if (I->Target >= (ADDRESS)T->Size) {
+            return 0;
+        }
+        finish(T, IR_GOTO)->Imm = I->Target;
+        return 1;
+
+    case H_JUMPIF: {
+        if (I->Target >= (ADDRESS)T->Size || !slotsInRange(T->K - 1, T->K)) {
+            return 0;
+        }
+        useSlots(T, T->K - 1, T->K);
+        Operand Cond = *slot(T, T->K - 1);
+        if (Cond.Base == IR_CONST) {
+            O = finish(T, IR_GOTO);
+            O->Imm = T->Consts[Cond.Off] == I->N ? I->Target : Pc + 1;
+        } else {
+            Cond = beforeSpill(T, Cond);
+            O = finish(T, IR_BRANCH);
+            O->A = Cond;
+            O->Arg = I->N;
+            O->Imm = I->Target;
+        }
+        --O->K;
+        return 1;
+    }
+
+    case H_JUMPI: {
+        if (!slotsInRange(T->K - 1, T->K)) {
+            return 0;
+        }
+        useSlots(T, T->K - 1, T->K);
+        Operand Target = beforeSpill(T, *slot(T, T->K - 1));
+        finish(T, IR_JUMPI)->A = Target;
+        return 1;
+    }
+
+    case H_HALT:
+        finish(T, IR_HALT);
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/// Check whether a translated instruction ended the block.
+static int endedBlock(const Translator *T) {
+    return T->NumOps && T->Ops[T->NumOps - 1].Op >= IR_GOTO;
+}
+
+/// @brief Translate the block starting at an address.
+/// @param IR translations of the program
+/// @param Start address of the first instruction
+/// @param Length length of the basic block starting there
+/// @return the translated block, `&Untranslatable` if not even its first
+/// instruction could be translated, or null if allocation failed
+static IRBlock *translateBlock(TamIR *IR, ADDRESS Start, int Length) {
+    Translator *T = IR->Scratch;
+    const Instruction *Code = IR->Program->Code;
+    T->Code = Code;
+    T->Registers = IR->Registers;
+    T->Size = IR->Size;
+    T->Start = Start;
+    T->Len = 0;
+    T->K = 0;
+    T->Depth = IR->Program->Depth[Start];
+    T->UseDepth = 0;
+    T->SlotLo = T->SlotHi = 0;
+    T->NumRegs = T->NumOps = T->NumStubs = T->NumConsts = 0;
+    T->LastDef = -1;
+    T->MinK = T->MaxK = T->Need = T->UsesLb = 0;
+    T->LbLo = INT32_MAX;
+    T->LbHi = INT32_MIN;
+    T->MemHi = 0;
+    for (int K = -IR_SLOT_BIAS; K < IR_SLOT_BIAS; ++K) {
+        *slot(T, K) = operand(IR_ST, K);
+    }
+
+    // leave room for the worst an instruction can add: copying every slot
+    // to a register, a side exit and the final write back
+    while (T->Len < min(Length, IR_MAX_BLOCK) && !endedBlock(T)) {
+        int Slots = T->SlotHi - T->SlotLo + IR_MAX_WORDS + 3;
+        if (T->NumOps + T->NumStubs + 6 * Slots + 16 > IR_MAX_OPS ||
+            T->NumConsts + 4 > IR_MAX_CONSTS ||
+            !translateInstruction(T, Code + Start + T->Len)) {
+            break;
+        }
+        ++T->Len;
+    }
+    if (!T->Len) {
+        return &Untranslatable;
+    }
+    if (!endedBlock(T)) {
+        finish(T, IR_GOTO)->Imm = Start + T->Len;
+    }
+
+    int Count = T->NumOps + T->NumStubs;
+    IRBlock *B = malloc(sizeof(IRBlock) + Count * sizeof(IROp) +
+                        T->NumConsts * sizeof(DATA_W));
+    if (!B) {
+        return NULL;
+    }
+    B->Start = Start;
+    B->Len = T->Len;
+    B->MinK = T->MinK;
+    B->MaxK = T->MaxK;
+    B->Need = T->Need;
+    B->Depth = T->UseDepth ? T->Depth : DEPTH_UNKNOWN;
+    B->MemHi = T->MemHi;
+    B->UsesLb = T->UsesLb;
+    B->LbLo = T->LbLo;
+    B->LbHi = T->LbHi;
+    B->Consts = (DATA_W *)(B->Ops + Count);
+    memcpy(B->Consts, T->Consts, T->NumConsts * sizeof(DATA_W));
+    memcpy(B->Ops, T->Ops, T->NumOps * sizeof(IROp));
+    memcpy(B->Ops + T->NumOps, T->Stubs, T->NumStubs * sizeof(IROp));
+    for (int i = 0; i < T->NumOps; ++i) {
+        int Op = B->Ops[i].Op;
+        if (Op == IR_DIV || Op == IR_MOD || Op == IR_LOADI || Op == IR_STOREI) {
+            B->Ops[i].Imm += T->NumOps;
+        }
+    }
+    return B;
+}
+
+/// @brief State shared by runEmulatorIR() and execBlocks().
+typedef struct IRState {
+    DATA_W *Mem;              ///< The emulator's data store
+    DATA_W *Regs;             ///< Virtual registers
+    TamIO *IO;                ///< The emulator's I/O streams
+    IRBlock *const *Blocks;   ///< Translated block at each address, if any
+    const atomic_int *TimeUp; ///< The emulator's `TimeUp` flag
+    uint64_t Budget;          ///< Steps left
+    ADDRESS St;               ///< ST
+    ADDRESS Lb;               ///< LB
+    ADDRESS Ht;               ///< HT
+    ADDRESS Cp;               ///< CP
+    ADDRESS StHigh;           ///< Highest value ST may have reached
+    ADDRESS Ct;               ///< End of the program
+} IRState;
+
+/// @brief Run translated blocks, starting with one and going on to the
+/// next for as long as it has been translated and the checks on entering
+/// it pass.
+/// @param B block to start with
+/// @param[in,out] S registers and budget, updated as the blocks leave them
+/// @return why the last block returned
+static int execBlocks(const IRBlock *B, IRState *S) {
+    DATA_W *const Mem = S->Mem;
+    const ADDRESS Ht = S->Ht;
+    ADDRESS St0 = S->St, Lb = S->Lb, Cp, St, Addr;
+    uint64_t Budget = S->Budget;
+    int64_t Low;
+    DATA_W Value;
+    const IROp *Op;
+    DATA_W *Bases[IR_NUM_BASES], *Slots;
+    Bases[IR_REG] = S->Regs;
+    Bases[IR_MEM] = Mem;
+
+#define V(O) Bases[(O).Base][(O).Off]
+#define UNARY(O, Prim)                                                         \
+    OP(O) {                                                                    \
+        V(Op->Dst) = unaryPrimitive(Prim, V(Op->A));                           \
+        NEXT();                                                                \
+    }
+#define BINARY(O, Prim)                                                        \
+    OP(O) {                                                                    \
+        V(Op->Dst) = binaryPrimitive(Prim, V(Op->A), V(Op->B));                \
+        NEXT();                                                                \
+    }
+#define DIVIDE(O, Prim)                                                        \
+    OP(O) {                                                                    \
+        if (!V(Op->B)) {                                                       \
+            GOTO_OP(Op->Imm);                                                  \
+        }                                                                      \
+        V(Op->Dst) = binaryPrimitive(Prim, V(Op->A), V(Op->B));                \
+        NEXT();                                                                \
+    }
+#define RETURN(Reason)                                                         \
+    do {                                                                       \
+        S->St = St0;                                                           \
+        S->Lb = Lb;                                                            \
+        S->Cp = Cp;                                                            \
+        S->Budget = Budget;                                                    \
+        return (Reason);                                                       \
+    } while (0)
+// hand the instruction at `Index` to the interpreter, with its steps and
+// everything after it in the block given back
+#define INTERPRET()                                                            \
+    do {                                                                       \
+        Budget += B->Len - Op->Index;                                          \
+        St0 += Op->K;                                                          \
+        Cp = B->Start + Op->Index;                                             \
+        RETURN(IR_INTERPRET);                                                  \
+    } while (0)
+#define LEAVE(To, Top)                                                         \
+    do {                                                                       \
+        Cp = (To);                                                             \
+        St0 += (Top);                                                          \
+        goto chain;                                                            \
+    } while (0)
+
+#ifdef TAM_THREADED
+    static const void *const Routines[IR_NUM_OPS] = {
+        [IR_MOV] = &&R_IR_MOV,       [IR_SPILL] = &&R_IR_SPILL,
+        [IR_NOT] = &&R_IR_NOT,
+        [IR_SUCC] = &&R_IR_SUCC,     [IR_PRED] = &&R_IR_PRED,
+        [IR_NEG] = &&R_IR_NEG,       [IR_AND] = &&R_IR_AND,
+        [IR_OR] = &&R_IR_OR,         [IR_ADD] = &&R_IR_ADD,
+        [IR_SUB] = &&R_IR_SUB,       [IR_MULT] = &&R_IR_MULT,
+        [IR_DIV] = &&R_IR_DIV,       [IR_MOD] = &&R_IR_MOD,
+        [IR_LT] = &&R_IR_LT,         [IR_LE] = &&R_IR_LE,
+        [IR_GE] = &&R_IR_GE,         [IR_EQ] = &&R_IR_EQ,
+        [IR_NEQ] = &&R_IR_NEQ,       [IR_ADDR] = &&R_IR_ADDR,
+        [IR_LOADI] = &&R_IR_LOADI,   [IR_STOREI] = &&R_IR_STOREI,
+        [IR_PUT] = &&R_IR_PUT,       [IR_PUTEOL] = &&R_IR_PUTEOL,
+        [IR_PUTINT] = &&R_IR_PUTINT, [IR_GOTO] = &&R_IR_GOTO,
+        [IR_BRANCH] = &&R_IR_BRANCH, [IR_JUMPI] = &&R_IR_JUMPI,
+        [IR_CALL] = &&R_IR_CALL,     [IR_RETURN] = &&R_IR_RETURN,
+        [IR_HALT] = &&R_IR_HALT,     [IR_EXIT] = &&R_IR_EXIT,
+    };
+#define OP(O) R_##O:
+#define NEXT() goto *Routines[(++Op)->Op]
+#define GOTO_OP(I)                                                             \
+    do {                                                                       \
+        Op = B->Ops + (I);                                                     \
+        goto *Routines[Op->Op];                                                \
+    } while (0)
+#else
+#define OP(O) case O:
+#define NEXT() continue
+#define GOTO_OP(I)                                                             \
+    do {                                                                       \
+        Op = B->Ops + (I);                                                     \
+        goto dispatch;                                                         \
+    } while (0)
+#endif
+
+    Cp = B->Start;
+enter:
+    // `MemHi` is never negative, so this also keeps `Low` from being
+    Low = (int64_t)St0 + B->MinK;
+    if (Budget < B->Len || Low < B->MemHi || (int64_t)St0 + B->Need > Ht ||
+        (B->Depth != DEPTH_UNKNOWN && (int64_t)St0 - Lb != B->Depth) ||
+        (B->UsesLb &&
+         ((int64_t)Lb + B->LbLo < 0 || (int64_t)Lb + B->LbHi > Low))) {
+        RETURN(IR_INTERPRET);
+    }
+    Budget -= B->Len;
+    if ((int64_t)St0 + B->MaxK > S->StHigh) {
+        S->StHigh = St0 + B->MaxK;
+    }
+    Bases[IR_CONST] = B->Consts;
+    Bases[IR_LB] = Mem + Lb;
+    Bases[IR_ST] = Slots = Mem + St0;
+    Op = B->Ops;
+
+#ifdef TAM_THREADED
+    goto *Routines[Op->Op];
+#else
+    for (;; ++Op) {
+    dispatch:
+        switch (Op->Op) {
+#endif
+
+    OP(IR_MOV) {
+        V(Op->Dst) = V(Op->A);
+        NEXT();
+    }
+    OP(IR_SPILL) {
+        Slots[Op->Dst.Off] = V(Op->A);
+        NEXT();
+    }
+
+    UNARY(IR_NOT, 2)
+    UNARY(IR_SUCC, 5)
+    UNARY(IR_PRED, 6)
+    UNARY(IR_NEG, 7)
+    BINARY(IR_AND, 3)
+    BINARY(IR_OR, 4)
+    BINARY(IR_ADD, 8)
+    BINARY(IR_SUB, 9)
+    BINARY(IR_MULT, 10)
+    DIVIDE(IR_DIV, 11)
+    DIVIDE(IR_MOD, 12)
+    BINARY(IR_LT, 13)
+    BINARY(IR_LE, 14)
+    BINARY(IR_GE, 15)
+
+    OP(IR_EQ) {
+        V(Op->Dst) = V(Op->A) == V(Op->B);
+        NEXT();
+    }
+    OP(IR_NEQ) {
+        V(Op->Dst) = V(Op->A) != V(Op->B);
+        NEXT();
+    }
+
+    OP(IR_ADDR) {
+        Addr = Op->Link == ST ? St0 : Op->Link == LB ? Lb : Ht;
+        V(Op->Dst) = (DATA_W)(ADDRESS)(Addr + Op->Imm);
+        NEXT();
+    }
+
+    // the checks made on entry keep every slot the block uses at or above
+    // `Low`, so an address below it or above HT cannot be one of them
+    OP(IR_LOADI) {
+        Addr = (ADDRESS)V(Op->A);
+        if (Addr >= Low && Addr <= Ht) {
+            GOTO_OP(Op->Imm);
+        }
+        V(Op->Dst) = Mem[Addr];
+        NEXT();
+    }
+    OP(IR_STOREI) {
+        Addr = (ADDRESS)V(Op->A);
+        if (Addr >= Low && Addr <= Ht) {
+            GOTO_OP(Op->Imm);
+        }
+        Mem[Addr] = V(Op->B);
+        NEXT();
+    }
+
+    OP(IR_PUT) {
+        putChar(S->IO, V(Op->A));
+        NEXT();
+    }
+    OP(IR_PUTEOL) {
+        putChar(S->IO, '\n');
+        NEXT();
+    }
+    OP(IR_PUTINT) {
+        writeInt(S->IO, V(Op->A));
+        NEXT();
+    }
+
+    OP(IR_GOTO) { LEAVE(Op->Imm, Op->K); }
+
+    OP(IR_BRANCH) {
+        LEAVE(V(Op->A) == Op->Arg ? (ADDRESS)Op->Imm
+                                  : B->Start + Op->Index + 1,
+              Op->K);
+    }
+
+    OP(IR_JUMPI) {
+        Addr = (ADDRESS)V(Op->A);
+        if (Addr >= S->Ct) {
+            INTERPRET();
+        }
+        LEAVE(Addr, Op->K - 1);
+    }
+
+    OP(IR_CALL) {
+        St = St0 + Op->K;
+        switch (Op->Link) {
+        case ST:
+            Value = (DATA_W)St;
+            break;
+        case HT:
+            Value = (DATA_W)Ht;
+            break;
+        case LB:
+            Value = (DATA_W)Lb;
+            break;
+        default:
+            Value = V(Op->A);
+            break;
+        }
+        Mem[St] = Value;
+        Mem[St + 1] = (DATA_W)Lb;
+        Mem[St + 2] = (DATA_W)(B->Start + Op->Index + 1);
+        Lb = St;
+        LEAVE(Op->Imm, Op->K + 3);
+    }
+
+    OP(IR_RETURN) {
+        int N = Op->Imm, D = Op->Arg;
+        St = St0 + Op->K;
+        if (St < N || Lb < D ||
+            (N && (WIDE_W)(ADDRESS)(Lb - D) + N > Ht)) {
+            INTERPRET();
+        }
+        ADDRESS Result = St - N;
+        ADDRESS ReturnAddr = Mem[(ADDRESS)(Lb + 2)];
+        ADDRESS DynamicLink = Mem[(ADDRESS)(Lb + 1)];
+        St0 = Lb - D;
+        memmove(Mem + St0, Mem + Result, N * sizeof(DATA_W));
+        St0 += N;
+        if (St0 > S->StHigh) {
+            S->StHigh = St0;
+        }
+        Lb = DynamicLink;
+        Cp = ReturnAddr;
+        goto chain;
+    }
+
+    OP(IR_HALT) {
+        St0 += Op->K;
+        Cp = B->Start + Op->Index + 1;
+        RETURN(IR_HALTED);
+    }
+
+    OP(IR_EXIT) { INTERPRET(); }
+
+#ifndef TAM_THREADED
+        }
+    }
+#endif
+
+chain:
+    // a timeout is looked for on going backward or through a call, return
+    // or JUMPI, and left for runEmulatorIR() to report
+    if ((Cp < B->Start + B->Len || Op->Op >= IR_JUMPI) &&
+        atomic_load_explicit(S->TimeUp, memory_order_relaxed)) {
+        RETURN(IR_CONTINUE);
+    }
+    // go straight on to the next block if it has been translated
+    if (Cp < S->Ct && (B = S->Blocks[Cp]) && B != &Untranslatable) {
+        goto enter;
+    }
+    RETURN(IR_CONTINUE);
+
+#undef V
+#undef UNARY
+#undef BINARY
+#undef DIVIDE
+#undef RETURN
+#undef INTERPRET
+#undef LEAVE
+#undef OP
+#undef NEXT
+#undef GOTO_OP
+}
+
+/// @brief Set up translation for the program an emulator has loaded.
+/// @return the translations, or null if allocation failed
+static TamIR *newIR(const TamEmulator *Emulator) {
+    int Size = Emulator->Program->Size;
+    TamIR *IR = calloc(1, sizeof(TamIR));
+    if (!IR) {
+        return NULL;
+    }
+    IR->Program = retainProgram(Emulator->Program);
+    IR->Size = Size;
+    memcpy(IR->Registers, Emulator->Registers, sizeof(IR->Registers));
+    IR->Blocks = calloc(Size + 1, sizeof(IRBlock *));
+    IR->Regs = malloc(2 * IR_MAX_OPS * sizeof(DATA_W));
+    IR->Scratch = malloc(sizeof(Translator));
+    if (!IR->Blocks || !IR->Regs || !IR->Scratch) {
+        freeIR(IR);
+        return NULL;
+    }
+    return IR;
+}
+
+void freeIR(TamIR *IR) {
+    if (!IR) {
+        return;
+    }
+    if (IR->Blocks) {
+        for (int i = 0; i <= IR->Size; ++i) {
+            if (IR->Blocks[i] != &Untranslatable) {
+                free(IR->Blocks[i]);
+            }
+        }
+    }
+    releaseProgram(IR->Program);
+    free(IR->Blocks);
+    free(IR->Regs);
+    free(IR->Scratch);
+    free(IR);
+}
+
+int runEmulatorIR(TamEmulator *Emulator, uint64_t MaxSteps) {
+    assert(Emulator);
+    assert(Emulator->Program);
+
+    int ErrCode = fitStepBudget(Emulator, &MaxSteps);
+    if (ErrCode) {
+        return ErrCode;
+    }
+
+    TamIR *IR = Emulator->IR;
+    if (!IR || IR->Program != Emulator->Program) {
+        freeIR(IR);
+        if (!(IR = Emulator->IR = newIR(Emulator))) {
+            return runEmulator(Emulator, MaxSteps);
+        }
+    }
+    TamBlockCache *Cache = Emulator->Blocks;
+    if (!Cache || Cache->Program != Emulator->Program) {
+        freeBlockCache(Cache);
+        if (!(Cache = Emulator->Blocks = newBlockCache(Emulator->Program))) {
+            return runEmulator(Emulator, MaxSteps);
+        }
+    }
+
+    ADDRESS *Regs = Emulator->Registers;
+    IRState S;
+    S.Mem = Emulator->DataStore;
+    S.Regs = IR->Regs;
+    S.IO = &Emulator->IO;
+    S.Blocks = IR->Blocks;
+    S.TimeUp = &Emulator->TimeUp;
+    S.Ct = IR->Size;
+
+    uint64_t Budget = MaxSteps ? MaxSteps : UINT64_MAX;
+    int Interpret = 0;
+    for (;;) {
+        ADDRESS Cp = Regs[CP];
+        if (Cp >= IR->Size) {
+            ErrCode = Budget ? ErrCodeAccessViolation : ErrStepLimit;
+            break;
+        }
+        if (!Budget) {
+            ErrCode = ErrStepLimit;
+            break;
+        }
+        if (timeUp(Emulator)) {
+            ErrCode = ErrTimeout;
+            break;
+        }
+
+        BasicBlock *Blk = Cache->Blocks + Cp;
+        if (!Blk->Length) {
+            findBlock(Cache, IR->Program->Code, Blk);
+        }
+        IRBlock *B = IR->Blocks[Cp];
+        if (!Interpret && !B) {
+            B = IR->Blocks[Cp] = translateBlock(IR, Cp, Blk->Length);
+        }
+
+        if (!Interpret && B && B != &Untranslatable) {
+            S.St = Regs[ST];
+            S.Lb = Regs[LB];
+            S.Ht = Regs[HT];
+            S.Budget = Budget;
+            S.StHigh = Emulator->StHigh;
+            int Reason = execBlocks(B, &S);
+            Emulator->Steps += Budget - S.Budget;
+            Budget = S.Budget;
+            Regs[ST] = S.St;
+            Regs[LB] = S.Lb;
+            Regs[CP] = S.Cp;
+            Emulator->StHigh = S.StHigh;
+            if (Reason == IR_HALTED) {
+                ErrCode = OK;
+                break;
+            }
+            Interpret = Reason == IR_INTERPRET;
+            continue;
+        }
+
+        // interpret up to the end of the block, which runInterpreter()
+        // reports as running out of steps
+        Interpret = 0;
+        uint64_t Run = Blk->Length;
+        uint64_t Before = Emulator->Steps;
+        ErrCode =
+            runInterpreter(Emulator, Run < Budget ? Run : Budget, NULL);
+        Budget -= Emulator->Steps - Before;
+        if (ErrCode != ErrStepLimit) {
+            break;
+        }
+    }
+
+    flushOutput(&Emulator->IO);
+    return stepBudgetResult(Emulator, ErrCode);
+}
@@ -0,0 +1,1218 @@
+#include <tam/tam.h>
+
+#include "internal.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tam/error.h>
+
+// Use direct threading (one indirect jump at the end of every routine) where
+// the compiler supports computed goto, and a plain switch everywhere else.
+#if defined(__GNUC__) && !defined(TAM_SWITCH_DISPATCH)
+#define TAM_THREADED 1
+#endif
+
+Handler selectHandler(const Instruction *Instr) {
+    assert(Instr);
+    int Dynamic = isDynamicRegister(Instr->R);
+
+    switch (Instr->Op) {
+    case LOAD:
+        return Dynamic ? H_LOAD_DYN : H_LOAD;
+    case LOADA:
+        return Dynamic ? H_LOADA_DYN : H_LOADA;
+    case LOADI:
+        return H_LOADI;
+    case LOADL:
+        return H_LOADL;
+    case STORE:
+        return Dynamic ? H_STORE_DYN : H_STORE;
+    case STOREI:
+        return H_STOREI;
+    case CALL:
+        if (Instr->R == PB && Instr->D > 0 && Instr->D <= 18) {
+            return H_ID + (Instr->D - 1);
+        }
+        if (Instr->R == PB && Instr->D == 22) {
+            return H_PUT;
+        }
+        if (Instr->R == PB && Instr->D == 24) {
+            return H_PUTEOL;
+        }
+        if (Instr->R == PB && Instr->D == 26) {
+            return H_PUTINT;
+        }
+        if (Instr->R == PB && (Instr->D == 27 || Instr->D == 28)) {
+            return H_NEW + (Instr->D - 27);
+        }
+        if (Instr->R == PB && Instr->D > 0 && Instr->D < 29) {
+            return H_EXEC;
+        }
+        return Dynamic ? H_EXEC : H_CALL;
+    case RETURN:
+        return H_RETURN;
+    case PUSH:
+        return H_PUSH;
+    case POP:
+        return H_POP;
+    case JUMP:
+        return Dynamic ? H_EXEC : H_JUMP;
+    case JUMPI:
+        return H_JUMPI;
+    case JUMPIF:
+        return Dynamic ? H_EXEC : H_JUMPIF;
+    case HALT:
+        return H_HALT;
+    default:
+        return H_EXEC;
+    }
+}
+
+/// Check for a one-word LOAD or STORE that superinstructions can address.
+static int isSimpleAccess(const Instruction *Instr, Opcode Op) {
+    return Instr->Op == Op && Instr->N == 1 &&
+           (Instr->R == LB || !isDynamicRegister(Instr->R));
+}
+
+/// Check for a call to a primitive that pops two words and pushes one.
+static int isBinaryCall(const Instruction *Instr) {
+    return Instr->Op == CALL && Instr->R == PB &&
+           ((Instr->D >= 3 && Instr->D <= 4) ||
+            (Instr->D >= 8 && Instr->D <= 16));
+}
+
+/// Check for a call to a primitive that replaces the top word.
+static int isUnaryCall(const Instruction *Instr) {
+    return Instr->Op == CALL && Instr->R == PB &&
+           (Instr->D == 1 || Instr->D == 2 ||
+            (Instr->D >= 5 && Instr->D <= 7));
+}
+
+/// Check for a conditional jump to a resolved address.
+static int isStaticJumpif(const Instruction *Instr) {
+    return Instr->Op == JUMPIF && !isDynamicRegister(Instr->R);
+}
+
+void fuseInstructions(Instruction *Code, int Count) {
+    assert(Code);
+
+    for (int i = 0; i < Count; ++i) {
+        Instruction *I = Code + i;
+        int Left = Count - i - 1; // instructions after this one
+
+        if (isSimpleAccess(I, LOAD)) {
+            if (Left >= 2 && isSimpleAccess(I + 1, LOAD) &&
+                isBinaryCall(I + 2)) {
+                I->Handler = H_LOAD_LOAD_BINARY;
+            } else if (Left >= 2 && isBinaryCall(I + 1) &&
+                       isStaticJumpif(I + 2)) {
+                I->Handler = H_LOAD_BINARY_JUMPIF;
+            } else if (Left >= 1 && isBinaryCall(I + 1)) {
+                I->Handler = H_LOAD_BINARY;
+            } else if (Left >= 2 && isUnaryCall(I + 1) &&
+                       isSimpleAccess(I + 2, STORE)) {
+                I->Handler = H_LOAD_UNARY_STORE;
+            } else if (Left >= 1 && isStaticJumpif(I + 1)) {
+                I->Handler = H_LOAD_JUMPIF;
+            }
+        } else if (I->Op == LOADL) {
+            if (Left >= 2 && isBinaryCall(I + 1) && isStaticJumpif(I + 2)) {
+                I->Handler = H_LOADL_BINARY_JUMPIF;
+            } else if (Left >= 1 && isBinaryCall(I + 1)) {
+                I->Handler = H_LOADL_BINARY;
+            }
+        } else if (isBinaryCall(I)) {
+            if (Left >= 1 && isStaticJumpif(I + 1)) {
+                I->Handler = H_BINARY_JUMPIF;
+            }
+        }
+    }
+}
+
+int runInterpreter(TamEmulator *Emulator, uint64_t MaxSteps,
+                   const BlockProfile *Prof) {
+    assert(Emulator);
+    assert(Emulator->Code);
+
+    ADDRESS *Regs = Emulator->Registers;
+    DATA_W *Mem = Emulator->DataStore;
+    const Instruction *Code = Emulator->Code;
+    const ADDRESS Ct = Regs[CT];
+    const int32_t *Depth = Emulator->Program->Depth;
+
+    if (Regs[CP] >= Ct) {
+        return ErrCodeAccessViolation;
+    }
+
+    TamBlockCache *Cache = Emulator->Blocks;
+    if (!Cache || Cache->Program != Emulator->Program) {
+        freeBlockCache(Cache);
+        Cache = Emulator->Blocks = newBlockCache(Emulator->Program);
+    }
+    BasicBlock *Blocks = Cache ? Cache->Blocks : NULL;
+    BasicBlock *Blk = NULL; // block being run, null while stepping
+
+    // the registers that change are kept in locals and only written back
+    // when leaving the loop or calling out to execute()
+    const Instruction *Ip = Code + Regs[CP];
+    ADDRESS St = Regs[ST];
+    ADDRESS Ht = Regs[HT];
+    ADDRESS Lb = Regs[LB];
+    ADDRESS StHigh = Emulator->StHigh;
+    const atomic_int *TimeUp = &Emulator->TimeUp;
+
+    const uint64_t Limit = MaxSteps ? MaxSteps : UINT64_MAX;
+    uint64_t Budget = Limit;
+    uint64_t Fused = 0;
+    ADDRESS Base, Addr;
+    DATA_W Value;
+    WIDE_W Arg1, Arg2; // wide enough that arithmetic on them cannot overflow
+    int ErrCode = OK;
+
+#define PC ((ADDRESS)(Ip - Code))
+#define SPILL(Cp)                                                              \
+    (Regs[ST] = St, Regs[HT] = Ht, Regs[LB] = Lb, Regs[CP] = (Cp),             \
+     Emulator->StHigh = StHigh)
+#define RELOAD()                                                               \
+    (St = Regs[ST], Ht = Regs[HT], Lb = Regs[LB], StHigh = Emulator->StHigh)
+#define TOUCH(Top) (StHigh = (Top) > StHigh ? (Top) : StHigh)
+#define DYNAMIC_BASE(R) ((R) == LB ? Lb : (R) == ST ? St : Ht)
+#define INACCESSIBLE(A) ((A) >= St && (A) <= Ht)
+#define SIMPLE_ADDRESS(I) ((I)->R == LB ? (ADDRESS)(Lb + (I)->D) : (I)->Target)
+#define ACCOUNT(K) (Fused += (K) - 1)
+// Primitives take their operands from the data store and leave the result
+// there; the top of the stack is not kept in a local from one instruction
+// to the next. It would have to be written back before every LOAD, STORE,
+// call out to execute() and block exit, any of which may address it. The
+// operands of the common LOAD and LOADL sequences stay in locals inside
+// the superinstructions instead, and runEmulatorJit() and runEmulatorIR()
+// keep stack slots in host registers across whole blocks.
+#define UNARY_PRIMITIVE(H, Expr)                                               \
+    ROUTINE(H) {                                                               \
+        if (!St) {                                                             \
+            FAIL(ErrStackUnderflow);                                           \
+        }                                                                      \
+        goto H##_body;                                                         \
+    }                                                                          \
+    ROUTINE(H##_U) {                                                           \
+    H##_body:                                                                  \
+        Arg1 = Mem[St - 1];                                                    \
+        Mem[St - 1] = (Expr);                                                  \
+        ++Ip;                                                                  \
+        DISPATCH();                                                            \
+    }
+#define BINARY_PRIMITIVE(H, Expr)                                              \
+    ROUTINE(H) {                                                               \
+        if (St < 2) {                                                          \
+            FAIL(ErrStackUnderflow);                                           \
+        }                                                                      \
+        goto H##_body;                                                         \
+    }                                                                          \
+    ROUTINE(H##_U) {                                                           \
+    H##_body:                                                                  \
+        Arg1 = Mem[St - 1];                                                    \
+        Arg2 = Mem[St - 2];                                                    \
+        Mem[St - 2] = (Expr);                                                  \
+        --St;                                                                  \
+        ++Ip;                                                                  \
+        DISPATCH();                                                            \
+    }
+// A timeout is only looked for where control can go round a loop: on
+// going backward, into a call, or anywhere dynamic. The block before has
+// run to its end, so there is nothing to give back.
+#define POLL()                                                                 \
+    do {                                                                       \
+        if (atomic_load_explicit(TimeUp, memory_order_relaxed)) {              \
+            goto stopped;                                                      \
+        }                                                                      \
+    } while (0)
+// Instructions run a basic block at a time. Entering a block takes its
+// whole length from the budget, so nothing inside it counts steps, and
+// done gives back whatever a failure part way through leaves unrun. The
+// instruction that ends a block either chains to the static successor
+// its descriptor already points at, or lands wherever control went.
+//
+// Landing somewhere with ST - LB other than what verifyProgram() proved
+// there means no unchecked handler can be trusted, and a budget too small
+// for the whole block means steps must be counted one by one. Either way,
+// instructions are stepped one at a time through their checked routines,
+// looking again before each. Blocks not found yet, stepping and anything
+// else out of the ordinary go the long way round, through `land`.
+#define ENTER()                                                                \
+    do {                                                                       \
+        if (!Blk->Length || Budget < Blk->Length) {                            \
+            goto enter;                                                        \
+        }                                                                      \
+        Budget -= Blk->Length;                                                 \
+        COUNT_BLOCK();                                                         \
+        RUN(Ip->Handler);                                                      \
+    } while (0)
+#define CHAIN()                                                                \
+    do {                                                                       \
+        if (!Blk) {                                                            \
+            goto land;                                                         \
+        }                                                                      \
+        if (Blocks + PC <= Blk) {                                              \
+            POLL();                                                            \
+        }                                                                      \
+        Blk = Blocks + PC;                                                     \
+        ENTER();                                                               \
+    } while (0)
+#define LAND()                                                                 \
+    do {                                                                       \
+        POLL();                                                                \
+        if (!Blk ||                                                            \
+            (Depth[PC] != DEPTH_UNKNOWN && (int64_t)St - Lb != Depth[PC])) {   \
+            goto land;                                                         \
+        }                                                                      \
+        Blk = Blocks + PC;                                                     \
+        ENTER();                                                               \
+    } while (0)
+#define FAIL(Err)                                                              \
+    do {                                                                       \
+        ErrCode = (Err);                                                       \
+        SPILL(PC);                                                             \
+        goto done;                                                             \
+    } while (0)
+// Profiling counts blocks as they are entered and reports routines as they
+// are entered and left, with the steps taken so far; without a profile it
+// costs a test at each of those.
+#define STEPS() (Emulator->Steps + Limit - Budget)
+#define COUNT_BLOCK()                                                          \
+    do {                                                                       \
+        if (Prof) {                                                            \
+            ++Prof->Entries[Blk - Blocks];                                     \
+        }                                                                      \
+    } while (0)
+#define PROFILE_CALL(Routine)                                                  \
+    do {                                                                       \
+        if (Prof) {                                                            \
+            Prof->Profiler->Call(Prof->Profiler->Context, STEPS(), (Routine),  \
+                                 Lb);                                          \
+        }                                                                      \
+    } while (0)
+
+#ifdef TAM_THREADED
+    static const void *const Routines[NUM_HANDLERS] = {
+        [H_EXEC] = &&R_H_EXEC,           [H_LOAD] = &&R_H_LOAD,
+        [H_LOAD_DYN] = &&R_H_LOAD_DYN,   [H_LOADA] = &&R_H_LOADA,
+        [H_LOADA_DYN] = &&R_H_LOADA_DYN, [H_LOADI] = &&R_H_LOADI,
+        [H_LOADL] = &&R_H_LOADL,         [H_STORE] = &&R_H_STORE,
+        [H_STORE_DYN] = &&R_H_STORE_DYN, [H_STOREI] = &&R_H_STOREI,
+        [H_CALL] = &&R_H_CALL,           [H_RETURN] = &&R_H_RETURN,
+        [H_PUSH] = &&R_H_PUSH,           [H_POP] = &&R_H_POP,
+        [H_JUMP] = &&R_H_JUMP,           [H_JUMPI] = &&R_H_JUMPI,
+        [H_JUMPIF] = &&R_H_JUMPIF,       [H_HALT] = &&R_H_HALT,
+        [H_END] = &&R_H_END,
+        [H_ID] = &&R_H_ID,
+        [H_NOT] = &&R_H_NOT,
+        [H_AND] = &&R_H_AND,
+        [H_OR] = &&R_H_OR,
+        [H_SUCC] = &&R_H_SUCC,
+        [H_PRED] = &&R_H_PRED,
+        [H_NEG] = &&R_H_NEG,
+        [H_ADD] = &&R_H_ADD,
+        [H_SUB] = &&R_H_SUB,
+        [H_MULT] = &&R_H_MULT,
+        [H_DIV] = &&R_H_DIV,
+        [H_MOD] = &&R_H_MOD,
+        [H_LT] = &&R_H_LT,
+        [H_LE] = &&R_H_LE,
+        [H_GE] = &&R_H_GE,
+        [H_GT] = &&R_H_GT,
+        [H_EQ] = &&R_H_EQ,
+        [H_NEQ] = &&R_H_NEQ,
+        [H_PUT] = &&R_H_PUT,
+        [H_PUTEOL] = &&R_H_PUTEOL,
+        [H_PUTINT] = &&R_H_PUTINT,
+        [H_NEW] = &&R_H_NEW,
+        [H_DISPOSE] = &&R_H_DISPOSE,
+        [H_LOAD_LOAD_BINARY] = &&R_H_LOAD_LOAD_BINARY,
+        [H_LOAD_BINARY] = &&R_H_LOAD_BINARY,
+        [H_LOAD_BINARY_JUMPIF] = &&R_H_LOAD_BINARY_JUMPIF,
+        [H_LOADL_BINARY] = &&R_H_LOADL_BINARY,
+        [H_LOADL_BINARY_JUMPIF] = &&R_H_LOADL_BINARY_JUMPIF,
+        [H_BINARY_JUMPIF] = &&R_H_BINARY_JUMPIF,
+        [H_LOAD_UNARY_STORE] = &&R_H_LOAD_UNARY_STORE,
+        [H_LOAD_JUMPIF] = &&R_H_LOAD_JUMPIF,
+        [H_LOAD_U] = &&R_H_LOAD_U,
+        [H_LOAD_DYN_U] = &&R_H_LOAD_DYN_U,
+        [H_STORE_U] = &&R_H_STORE_U,
+        [H_STORE_DYN_U] = &&R_H_STORE_DYN_U,
+        [H_CALL_U] = &&R_H_CALL_U,
+        [H_POP_U] = &&R_H_POP_U,
+        [H_JUMP_U] = &&R_H_JUMP_U,
+        [H_JUMPIF_U] = &&R_H_JUMPIF_U,
+        [H_NOT_U] = &&R_H_NOT_U,
+        [H_AND_U] = &&R_H_AND_U,
+        [H_OR_U] = &&R_H_OR_U,
+        [H_SUCC_U] = &&R_H_SUCC_U,
+        [H_PRED_U] = &&R_H_PRED_U,
+        [H_NEG_U] = &&R_H_NEG_U,
+        [H_ADD_U] = &&R_H_ADD_U,
+        [H_SUB_U] = &&R_H_SUB_U,
+        [H_MULT_U] = &&R_H_MULT_U,
+        [H_DIV_U] = &&R_H_DIV_U,
+        [H_MOD_U] = &&R_H_MOD_U,
+        [H_LT_U] = &&R_H_LT_U,
+        [H_LE_U] = &&R_H_LE_U,
+        [H_GE_U] = &&R_H_GE_U,
+        [H_GT_U] = &&R_H_GT_U,
+    };
+    // while stepping, every routine goes on to `land` instead of the next
+    // instruction's routine
+    static const void *const Stepping[NUM_HANDLERS] = {
+        [0 ... NUM_HANDLERS - 1] = &&land,
+    };
+    const void *const *Table = Routines;
+#define ROUTINE(H) R_##H:
+#define DISPATCH() goto *Table[Ip->Handler]
+#define RUN(H) goto *Routines[H]
+
+    goto land;
+#else
+#define ROUTINE(H) case H:
+#define DISPATCH() continue
+#define RUN(H)                                                                 \
+    do {                                                                       \
+        Current = (H);                                                         \
+        goto redispatch;                                                       \
+    } while (0)
+
+    Handler Current;
+    goto land;
+    for (;;) {
+        if (!Blk) {
+            goto land;
+        }
+        Current = Ip->Handler;
+    redispatch:
+        switch (Current) {
+#endif
+#define UNFUSED() RUN(selectHandler(Ip))
+
+    ROUTINE(H_EXEC) {
+        // slow path: hand the registers back to execute() and pick up
+        // wherever it leaves CP
+        ADDRESS Here = PC;
+        SPILL(Here + 1);
+        if ((ErrCode = execute(Emulator, *Ip))) {
+            // an instruction waiting for input, or stopped while it
+            // waited, is not counted as run
+            if (ErrCode == ErrNeedsInput || ErrCode == ErrTimeout) {
+                ++Budget;
+                if (Prof) {
+                    --Prof->Profiler->Counts[Here];
+                }
+            }
+            Regs[CP] = Here;
+            goto done;
+        }
+        RELOAD();
+        if (Ip->Op == CALL && !(Ip->R == PB && Ip->D > 0 && Ip->D < 29)) {
+            PROFILE_CALL(Regs[CP]);
+        }
+        if (Regs[CP] >= Ct) {
+            ErrCode = Budget ? ErrCodeAccessViolation : ErrStepLimit;
+            goto done;
+        }
+        Ip = Code + Regs[CP];
+        LAND();
+    }
+
+    ROUTINE(H_LOAD_DYN) {
+        Base = DYNAMIC_BASE(Ip->R) + Ip->D;
+        goto load;
+    }
+    ROUTINE(H_LOAD) {
+        Base = Ip->Target;
+    load:
+        if (Ip->N == 1) {
+            if (INACCESSIBLE(Base)) {
+                FAIL(ErrDataAccessViolation);
+            }
+            if (St >= Ht) {
+                FAIL(ErrStackOverflow);
+            }
+            Mem[St++] = Mem[Base];
+            TOUCH(St);
+        } else {
+            if (!rangeAccessible(Base, Ip->N, St, Ht)) {
+                FAIL(ErrDataAccessViolation);
+            }
+            if ((WIDE_W)St + Ip->N > Ht) {
+                FAIL(ErrStackOverflow);
+            }
+            memcpy(Mem + St, Mem + Base, Ip->N * sizeof(DATA_W));
+            St += Ip->N;
+            TOUCH(St);
+        }
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_LOADA_DYN) {
+        Value = (DATA_W)(ADDRESS)(DYNAMIC_BASE(Ip->R) + Ip->D);
+        goto push;
+    }
+    ROUTINE(H_LOADA) {
+        Value = (DATA_W)Ip->Target;
+        goto push;
+    }
+    ROUTINE(H_LOADL) {
+        Value = Ip->D;
+    push:
+        if (St >= Ht) {
+            FAIL(ErrStackOverflow);
+        }
+        Mem[St++] = Value;
+        TOUCH(St);
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_LOADI) {
+        if (!St) {
+            FAIL(ErrStackUnderflow);
+        }
+        Base = Mem[--St];
+        goto load;
+    }
+
+    ROUTINE(H_STORE_DYN) {
+        if (St < Ip->N) {
+            FAIL(ErrStackUnderflow);
+        }
+        St -= Ip->N;
+        Base = DYNAMIC_BASE(Ip->R) + Ip->D;
+        goto store;
+    }
+    ROUTINE(H_STORE) {
+        if (St < Ip->N) {
+            FAIL(ErrStackUnderflow);
+        }
+        St -= Ip->N;
+        Base = Ip->Target;
+    store:
+        // the popped words are still in place just above ST
+        if (Ip->N == 1) {
+            if (INACCESSIBLE(Base)) {
+                FAIL(ErrDataAccessViolation);
+            }
+            Mem[Base] = Mem[St];
+        } else {
+            if (!rangeAccessible(Base, Ip->N, St, Ht)) {
+                FAIL(ErrDataAccessViolation);
+            }
+            memcpy(Mem + Base, Mem + St, Ip->N * sizeof(DATA_W));
+        }
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_STOREI) {
+        // the address word sits just below the words to store
+        if (St < Ip->N + 1) {
+            FAIL(ErrStackUnderflow);
+        }
+        St -= Ip->N + 1;
+        Base = Mem[St];
+        if (!rangeAccessible(Base, Ip->N, St, Ht)) {
+            FAIL(ErrDataAccessViolation);
+        }
+        memcpy(Mem + Base, Mem + St + 1, Ip->N * sizeof(DATA_W));
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_CALL) {
+        if (Ip->Target >= Ct) {
+            FAIL(ErrCodeAccessViolation);
+        }
+        if ((WIDE_W)St + 3 > Ht) {
+            FAIL(ErrStackOverflow);
+        }
+
+        ADDRESS StaticLink;
+        switch (Ip->N) {
+        case ST:
+            StaticLink = St;
+            break;
+        case HT:
+            StaticLink = Ht;
+            break;
+        case LB:
+            StaticLink = Lb;
+            break;
+        case CP:
+            StaticLink = PC + 1;
+            break;
+        default:
+            StaticLink = Ip->N < 16 ? Regs[Ip->N] : 0;
+            break;
+        }
+
+        Mem[St] = (DATA_W)StaticLink;
+        Mem[St + 1] = (DATA_W)Lb;
+        Mem[St + 2] = (DATA_W)(PC + 1);
+        Lb = St;
+        St += 3;
+        TOUCH(St);
+        Ip = Code + Ip->Target;
+        PROFILE_CALL(PC);
+        POLL();
+        CHAIN();
+    }
+
+    ROUTINE(H_RETURN) {
+        int N = Ip->N;
+        int D = Ip->D < 0 ? 0 : Ip->D;
+        if (St < N) {
+            FAIL(ErrStackUnderflow);
+        }
+
+        ADDRESS Result = St - N;
+        ADDRESS ReturnAddr = Mem[(ADDRESS)(Lb + 2)];
+        ADDRESS DynamicLink = Mem[(ADDRESS)(Lb + 1)];
+        if (Lb < D) {
+            FAIL(ErrStackUnderflow);
+        }
+        St = Lb - D;
+        if (N && (WIDE_W)St + N > Ht) {
+            FAIL(ErrStackOverflow);
+        }
+
+        memmove(Mem + St, Mem + Result, N * sizeof(DATA_W));
+        St += N;
+        TOUCH(St);
+        if (Prof) {
+            Prof->Profiler->Return(Prof->Profiler->Context, STEPS(), Lb);
+        }
+        Lb = DynamicLink;
+        if (ReturnAddr >= Ct) {
+            // reported when the next instruction is fetched
+            ErrCode = Budget ? ErrCodeAccessViolation : ErrStepLimit;
+            SPILL(ReturnAddr);
+            goto done;
+        }
+        Ip = Code + ReturnAddr;
+        LAND();
+    }
+
+    ROUTINE(H_PUSH) {
+        if ((WIDE_W)St + Ip->D >= Ht) {
+            FAIL(ErrStackOverflow);
+        }
+        St += Ip->D;
+        TOUCH(St);
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_POP) {
+        int N = Ip->N;
+        int D = Ip->D < 0 ? 0 : Ip->D;
+        if (St < N + D) {
+            FAIL(ErrStackUnderflow);
+        }
+        memmove(Mem + St - N - D, Mem + St - N, N * sizeof(DATA_W));
+        St -= D;
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_JUMP) {
+        if (Ip->Target >= Ct) {
+            FAIL(ErrCodeAccessViolation);
+        }
+        Ip = Code + Ip->Target;
+        CHAIN();
+    }
+
+    ROUTINE(H_JUMPI) {
+        if (!St) {
+            FAIL(ErrStackUnderflow);
+        }
+        Addr = Mem[--St];
+        if (Addr >= Ct) {
+            FAIL(ErrCodeAccessViolation);
+        }
+        Ip = Code + Addr;
+        LAND();
+    }
+
+    ROUTINE(H_JUMPIF) {
+        if (!St) {
+            FAIL(ErrStackUnderflow);
+        }
+        if (Mem[--St] != Ip->N) {
+            ++Ip;
+            CHAIN();
+        }
+        if (Ip->Target >= Ct) {
+            FAIL(ErrCodeAccessViolation);
+        }
+        Ip = Code + Ip->Target;
+        CHAIN();
+    }
+
+    ROUTINE(H_HALT) {
+        SPILL(PC + 1);
+        goto done;
+    }
+
+    ROUTINE(H_END) {
+        // fell off the end of the program: a fetch error, and not counted
+        if (!Blk) {
+            ++Budget;
+        }
+        Blk = NULL;
+        ErrCode = Budget ? ErrCodeAccessViolation : ErrStepLimit;
+        SPILL(PC);
+        goto done;
+    }
+
+    // Variants of the routines above for instructions where verifyProgram()
+    // has proved that a check cannot fail. Overflow checks stay, since HT
+    // is not fixed.
+
+    ROUTINE(H_LOAD_DYN_U) {
+        Base = DYNAMIC_BASE(Ip->R) + Ip->D;
+        goto loadUnchecked;
+    }
+    ROUTINE(H_LOAD_U) {
+        Base = Ip->Target;
+    loadUnchecked:
+        if (Ip->N == 1) {
+            if (St >= Ht) {
+                FAIL(ErrStackOverflow);
+            }
+            Mem[St++] = Mem[Base];
+        } else {
+            if ((WIDE_W)St + Ip->N > Ht) {
+                FAIL(ErrStackOverflow);
+            }
+            memcpy(Mem + St, Mem + Base, Ip->N * sizeof(DATA_W));
+            St += Ip->N;
+        }
+        TOUCH(St);
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_STORE_DYN_U) {
+        St -= Ip->N;
+        Base = DYNAMIC_BASE(Ip->R) + Ip->D;
+        goto storeUnchecked;
+    }
+    ROUTINE(H_STORE_U) {
+        St -= Ip->N;
+        Base = Ip->Target;
+    storeUnchecked:
+        if (Ip->N == 1) {
+            Mem[Base] = Mem[St];
+        } else {
+            memcpy(Mem + Base, Mem + St, Ip->N * sizeof(DATA_W));
+        }
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_CALL_U) {
+        if ((WIDE_W)St + 3 > Ht) {
+            FAIL(ErrStackOverflow);
+        }
+
+        ADDRESS StaticLink;
+        switch (Ip->N) {
+        case ST:
+            StaticLink = St;
+            break;
+        case HT:
+            StaticLink = Ht;
+            break;
+        case LB:
+            StaticLink = Lb;
+            break;
+        case CP:
+            StaticLink = PC + 1;
+            break;
+        default:
+            StaticLink = Ip->N < 16 ? Regs[Ip->N] : 0;
+            break;
+        }
+
+        Mem[St] = (DATA_W)StaticLink;
+        Mem[St + 1] = (DATA_W)Lb;
+        Mem[St + 2] = (DATA_W)(PC + 1);
+        Lb = St;
+        St += 3;
+        TOUCH(St);
+        Ip = Code + Ip->Target;
+        PROFILE_CALL(PC);
+        POLL();
+        CHAIN();
+    }
+
+    ROUTINE(H_POP_U) {
+        int N = Ip->N;
+        int D = Ip->D < 0 ? 0 : Ip->D;
+        memmove(Mem + St - N - D, Mem + St - N, N * sizeof(DATA_W));
+        St -= D;
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_JUMP_U) {
+        Ip = Code + Ip->Target;
+        CHAIN();
+    }
+
+    ROUTINE(H_JUMPIF_U) {
+        Ip = Mem[--St] == Ip->N ? Code + Ip->Target : Ip + 1;
+        CHAIN();
+    }
+
+    // Primitives. Each checks the stack depth once, reads its operands into
+    // locals and writes its result straight back into the data store.
+
+    ROUTINE(H_ID) {
+        ++Ip;
+        DISPATCH();
+    }
+
+    UNARY_PRIMITIVE(H_NOT, Arg1 ? 0 : 1)
+    BINARY_PRIMITIVE(H_AND, Arg1 * Arg2 ? 1 : 0)
+    BINARY_PRIMITIVE(H_OR, Arg1 + Arg2 ? 1 : 0)
+    UNARY_PRIMITIVE(H_SUCC, Arg1 + 1)
+    UNARY_PRIMITIVE(H_PRED, Arg1 - 1)
+    UNARY_PRIMITIVE(H_NEG, -Arg1)
+    BINARY_PRIMITIVE(H_ADD, Arg1 + Arg2)
+    BINARY_PRIMITIVE(H_SUB, Arg1 - Arg2)
+    BINARY_PRIMITIVE(H_MULT, Arg1 * Arg2)
+
+    // div and mod divide the top word by the one below it, and fail rather
+    // than trap when that is zero
+    ROUTINE(H_DIV) {
+        if (St < 2) {
+            FAIL(ErrStackUnderflow);
+        }
+        goto divide;
+    }
+    ROUTINE(H_DIV_U) {
+    divide:
+        if (!Mem[St - 2]) {
+            FAIL(ErrDivisionByZero);
+        }
+        Mem[St - 2] = (WIDE_W)Mem[St - 1] / Mem[St - 2];
+        --St;
+        ++Ip;
+        DISPATCH();
+    }
+    ROUTINE(H_MOD) {
+        if (St < 2) {
+            FAIL(ErrStackUnderflow);
+        }
+        goto modulo;
+    }
+    ROUTINE(H_MOD_U) {
+    modulo:
+        if (!Mem[St - 2]) {
+            FAIL(ErrDivisionByZero);
+        }
+        Mem[St - 2] = (WIDE_W)Mem[St - 1] % Mem[St - 2];
+        --St;
+        ++Ip;
+        DISPATCH();
+    }
+
+    BINARY_PRIMITIVE(H_LT, Arg1 < Arg2 ? 1 : 0)
+    BINARY_PRIMITIVE(H_LE, Arg1 <= Arg2 ? 1 : 0)
+    BINARY_PRIMITIVE(H_GE, Arg1 >= Arg2 ? 1 : 0)
+    BINARY_PRIMITIVE(H_GT, Arg1 >= Arg2 ? 1 : 0)
+
+    ROUTINE(H_EQ) {
+        Value = 1;
+        goto compare;
+    }
+    ROUTINE(H_NEQ) {
+        Value = 0;
+    compare:
+        if (!St) {
+            FAIL(ErrStackUnderflow);
+        }
+        Arg1 = Mem[St - 1];
+        WIDE_W Size = Arg1 < 0 ? 0 : Arg1;
+        if (St - 1 < 2 * Size) {
+            FAIL(ErrStackUnderflow);
+        }
+        if (memcmp(Mem + St - 1 - Size, Mem + St - 1 - 2 * Size,
+                   Size * sizeof(DATA_W))) {
+            Value = !Value;
+        }
+        St -= 2 * Size;
+        Mem[St - 1] = Value;
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_PUT) {
+        if (!St) {
+            FAIL(ErrStackUnderflow);
+        }
+        putChar(&Emulator->IO, Mem[--St]);
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_PUTEOL) {
+        putChar(&Emulator->IO, '\n');
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_PUTINT) {
+        if (!St) {
+            FAIL(ErrStackUnderflow);
+        }
+        writeInt(&Emulator->IO, Mem[--St]);
+        ++Ip;
+        DISPATCH();
+    }
+
+    // the heap primitives leave the stack as it was if they fail
+    ROUTINE(H_NEW) {
+        if (!St) {
+            FAIL(ErrStackUnderflow);
+        }
+        ADDRESS NewHt = Ht;
+        int Err = primitiveNew(&Emulator->Heap, Mem, St - 1, &NewHt,
+                               Mem[St - 1], &Addr);
+        if (Err) {
+            FAIL(Err);
+        }
+        Ht = NewHt;
+        if (Ht < Emulator->HtLow) {
+            Emulator->HtLow = Ht;
+        }
+        Mem[St - 1] = (DATA_W)Addr;
+        ++Ip;
+        DISPATCH();
+    }
+
+    ROUTINE(H_DISPOSE) {
+        if (St < 2) {
+            FAIL(ErrStackUnderflow);
+        }
+        ADDRESS NewHt = Ht;
+        int Err = primitiveDispose(&Emulator->Heap, Mem, &NewHt, Mem[St - 2],
+                                   (ADDRESS)Mem[St - 1]);
+        if (Err) {
+            FAIL(Err);
+        }
+        Ht = NewHt;
+        St -= 2;
+        ++Ip;
+        DISPATCH();
+    }
+
+    // Superinstructions. Each one checks up front everything that could make
+    // its sequence fail, and falls back to running the sequence one
+    // instruction at a time if anything would. A sequence never crosses the
+    // end of a block, so its steps are always paid for, and they are never
+    // run while stepping. Words that the plain sequence would leave just
+    // above ST are written too, so the data store ends up exactly the same.
+
+    ROUTINE(H_LOAD_LOAD_BINARY) {
+        Addr = SIMPLE_ADDRESS(Ip);
+        Base = SIMPLE_ADDRESS(Ip + 1);
+        if (INACCESSIBLE(Addr) || (WIDE_W)St + 1 >= Ht ||
+            (Base >= (WIDE_W)St + 1 && Base <= Ht) ||
+            dividesByZero(Ip[2].D, Mem[Addr])) {
+            UNFUSED();
+        }
+        Mem[St] = Mem[Addr];
+        Mem[St + 1] = Mem[Base];
+        TOUCH(St + 2);
+        Mem[St] = binaryPrimitive(Ip[2].D, Mem[St + 1], Mem[St]);
+        ++St;
+        ACCOUNT(3);
+        Ip += 3;
+        DISPATCH();
+    }
+
+    ROUTINE(H_LOAD_BINARY) {
+        Addr = SIMPLE_ADDRESS(Ip);
+        if (!St || INACCESSIBLE(Addr) || St >= Ht ||
+            dividesByZero(Ip[1].D, Mem[St - 1])) {
+            UNFUSED();
+        }
+        Mem[St] = Mem[Addr];
+        TOUCH(St + 1);
+        Mem[St - 1] = binaryPrimitive(Ip[1].D, Mem[St], Mem[St - 1]);
+        ACCOUNT(2);
+        Ip += 2;
+        DISPATCH();
+    }
+
+    ROUTINE(H_LOAD_BINARY_JUMPIF) {
+        Addr = SIMPLE_ADDRESS(Ip);
+        if (!St || INACCESSIBLE(Addr) || St >= Ht ||
+            Ip[2].Target >= Ct || dividesByZero(Ip[1].D, Mem[St - 1])) {
+            UNFUSED();
+        }
+        Mem[St] = Mem[Addr];
+        TOUCH(St + 1);
+        Value = binaryPrimitive(Ip[1].D, Mem[St], Mem[St - 1]);
+        Mem[--St] = Value;
+        ACCOUNT(3);
+        Ip = Value == Ip[2].N ? Code + Ip[2].Target : Ip + 3;
+        CHAIN();
+    }
+
+    ROUTINE(H_LOADL_BINARY) {
+        if (!St || St >= Ht ||
+            dividesByZero(Ip[1].D, Mem[St - 1])) {
+            UNFUSED();
+        }
+        Mem[St] = Ip->D;
+        TOUCH(St + 1);
+        Mem[St - 1] = binaryPrimitive(Ip[1].D, Mem[St], Mem[St - 1]);
+        ACCOUNT(2);
+        Ip += 2;
+        DISPATCH();
+    }
+
+    ROUTINE(H_LOADL_BINARY_JUMPIF) {
+        if (!St || St >= Ht || Ip[2].Target >= Ct ||
+            dividesByZero(Ip[1].D, Mem[St - 1])) {
+            UNFUSED();
+        }
+        Mem[St] = Ip->D;
+        TOUCH(St + 1);
+        Value = binaryPrimitive(Ip[1].D, Mem[St], Mem[St - 1]);
+        Mem[--St] = Value;
+        ACCOUNT(3);
+        Ip = Value == Ip[2].N ? Code + Ip[2].Target : Ip + 3;
+        CHAIN();
+    }
+
+    ROUTINE(H_BINARY_JUMPIF) {
+        if (St < 2 || Ip[1].Target >= Ct ||
+            dividesByZero(Ip->D, Mem[St - 2])) {
+            UNFUSED();
+        }
+        Value = binaryPrimitive(Ip->D, Mem[St - 1], Mem[St - 2]);
+        St -= 2;
+        Mem[St] = Value;
+        ACCOUNT(2);
+        Ip = Value == Ip[1].N ? Code + Ip[1].Target : Ip + 2;
+        CHAIN();
+    }
+
+    ROUTINE(H_LOAD_UNARY_STORE) {
+        Addr = SIMPLE_ADDRESS(Ip);
+        Base = SIMPLE_ADDRESS(Ip + 2);
+        if (INACCESSIBLE(Addr) || St >= Ht ||
+            INACCESSIBLE(Base)) {
+            UNFUSED();
+        }
+        Value = unaryPrimitive(Ip[1].D, Mem[Addr]);
+        Mem[St] = Value;
+        TOUCH(St + 1);
+        Mem[Base] = Value;
+        ACCOUNT(3);
+        Ip += 3;
+        DISPATCH();
+    }
+
+    ROUTINE(H_LOAD_JUMPIF) {
+        Addr = SIMPLE_ADDRESS(Ip);
+        if (INACCESSIBLE(Addr) || St >= Ht ||
+            Ip[1].Target >= Ct) {
+            UNFUSED();
+        }
+        Value = Mem[Addr];
+        Mem[St] = Value;
+        TOUCH(St + 1);
+        ACCOUNT(2);
+        Ip = Value == Ip[1].N ? Code + Ip[1].Target : Ip + 2;
+        CHAIN();
+    }
+
+#ifndef TAM_THREADED
+        default:
+            FAIL(ErrUnrecognisedOpcode);
+        }
+    }
+#endif
+
+land:
+#ifdef TAM_THREADED
+    Table = Routines;
+#endif
+    POLL();
+    if (!Blocks) {
+        goto step;
+    }
+    Blk = Blocks + PC;
+    if (Depth[PC] != DEPTH_UNKNOWN && (int64_t)St - Lb != Depth[PC]) {
+        goto step;
+    }
+enter:
+    if (!Blk->Length) {
+        findBlock(Cache, Code, Blk);
+    }
+    if (Budget < Blk->Length) {
+        goto step;
+    }
+    Budget -= Blk->Length;
+    COUNT_BLOCK();
+    RUN(Ip->Handler);
+
+step:
+    Blk = NULL;
+    if (!Budget) {
+        goto outOfSteps;
+    }
+    --Budget;
+    if (Prof && PC < Ct) {
+        ++Prof->Profiler->Counts[PC];
+    }
+#ifdef TAM_THREADED
+    Table = Stepping;
+#endif
+    RUN(isPlainHandler(Ip->Handler) ? Ip->Handler : selectHandler(Ip));
+
+outOfSteps:
+    ErrCode = ErrStepLimit;
+    SPILL(PC);
+    goto done;
+
+stopped:
+    Blk = NULL;
+    ErrCode = ErrTimeout;
+    SPILL(PC);
+
+done:
+    if (Blk) {
+        // the rest of the block was paid for but never run
+        ADDRESS End = (Blk - Blocks) + Blk->Length;
+        Budget += End - PC - 1;
+        for (ADDRESS A = PC + 1; Prof && A < End; ++A) {
+            --Prof->Profiler->Counts[A];
+        }
+    }
+    Emulator->Steps += Limit - Budget;
+    Emulator->Fused += Fused;
+    return ErrCode;
+
+#undef PC
+#undef SPILL
+#undef RELOAD
+#undef TOUCH
+#undef DYNAMIC_BASE
+#undef INACCESSIBLE
+#undef FAIL
+#undef SIMPLE_ADDRESS
+#undef ACCOUNT
+#undef ENTER
+#undef STEPS
+#undef COUNT_BLOCK
+#undef PROFILE_CALL
+#undef UNARY_PRIMITIVE
+#undef BINARY_PRIMITIVE
+#undef ROUTINE
+#undef DISPATCH
+#undef UNFUSED
+#undef RUN
+#undef CHAIN
+#undef LAND
+#undef POLL
+}
+
+int runEmulator(TamEmulator *Emulator, uint64_t MaxSteps) {
+    int ErrCode = fitStepBudget(Emulator, &MaxSteps);
+    if (ErrCode) {
+        return ErrCode;
+    }
+    ErrCode = runInterpreter(Emulator, MaxSteps, NULL);
+    flushOutput(&Emulator->IO);
+    return stepBudgetResult(Emulator, ErrCode);
+}
+
+/// Body of runEmulatorTraced(), which flushes output however this returns.
+static int traceLoop(TamEmulator *Emulator, uint64_t MaxSteps,
+                     TamTraceFn Trace, void *Context) {
+    Instruction Instr;
+    int ErrCode;
+    for (uint64_t Step = 0; !MaxSteps || Step < MaxSteps; ++Step) {
+        // this is slow enough already to look for a timeout every time
+        if (timeUp(Emulator)) {
+            return ErrTimeout;
+        }
+        if ((ErrCode = fetchDecode(Emulator, &Instr))) {
+            return ErrCode;
+        }
+
+        ADDRESS Addr = Emulator->Registers[CP] - 1;
+        Trace(Context, Emulator, Addr, Instr);
+        Emulator->Steps++;
+
+        if (Instr.Op == HALT) {
+            return OK;
+        }
+
+        if ((ErrCode = execute(Emulator, Instr))) {
+            Emulator->Steps -=
+                ErrCode == ErrNeedsInput || ErrCode == ErrTimeout;
+            Emulator->Registers[CP] = Addr;
+            return ErrCode;
+        }
+    }
+    return ErrStepLimit;
+}
+
+int runEmulatorTraced(TamEmulator *Emulator, uint64_t MaxSteps,
+                      TamTraceFn Trace, void *Context) {
+    assert(Emulator);
+    assert(Trace);
+
+    int ErrCode = fitStepBudget(Emulator, &MaxSteps);
+    if (ErrCode) {
+        return ErrCode;
+    }
+    ErrCode = traceLoop(Emulator, MaxSteps, Trace, Context);
+    flushOutput(&Emulator->IO);
+    return stepBudgetResult(Emulator, ErrCode);
+}
+
+int runEmulatorProfiled(TamEmulator *Emulator, uint64_t MaxSteps,
+                        TamProfiler *Profiler) {
+    assert(Emulator);
+    assert(Profiler && Profiler->Counts);
+
+    int ErrCode = fitStepBudget(Emulator, &MaxSteps);
+    if (ErrCode) {
+        return ErrCode;
+    }
+    int Size = Emulator->Program->Size;
+    BlockProfile Prof = {.Profiler = Profiler,
+                         .Entries = calloc(Size + 1, sizeof(uint64_t))};
+    if (!Prof.Entries) {
+        return -1;
+    }
+    ErrCode = runInterpreter(Emulator, MaxSteps, &Prof);
+    flushOutput(&Emulator->IO);
+
+    // every block entered has been found, so its length is known
+    const TamBlockCache *Cache = Emulator->Blocks;
+    for (int Start = 0; Cache && Start < Size; ++Start) {
+        uint64_t Entries = Prof.Entries[Start];
+        for (uint32_t i = 0; Entries && i < Cache->Blocks[Start].Length; ++i) {
+            Profiler->Counts[Start + i] += Entries;
+        }
+    }
+    free(Prof.Entries);
+    return stepBudgetResult(Emulator, ErrCode);
+}
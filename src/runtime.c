@@ -0,0 +1,28 @@
+#include <tam/runtime.h>
+
+#include "internal.h"
+#include <stdio.h>
+#include <tam/error.h>
+
+DATA_W primitiveEol(TamIO *IO) { return peekChar(IO) == '\n' ? 1 : 0; }
+
+DATA_W primitiveEof(TamIO *IO) { return peekChar(IO) < 0 ? 1 : 0; }
+
+DATA_W primitiveGet(TamIO *IO) { return (char)getChar(IO); }
+
+void primitiveGetEol(TamIO *IO) {
+    int C;
+    while ((C = getChar(IO)) >= 0 && C != '\n') {
+        // pass
+    }
+}
+
+DATA_W primitiveGetInt(TamIO *IO) { return readInt(IO); }
+
+void primitivePut(TamIO *IO, DATA_W C) { putChar(IO, C); }
+
+void primitivePutInt(TamIO *IO, DATA_W Value) { writeInt(IO, Value); }
+
+void reportError(int ErrCode, ADDRESS Cp) {
+    fprintf(stderr, "%s at loc %04x\n", errorMessage(ErrCode), Cp);
+}
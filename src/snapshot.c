@@ -0,0 +1,204 @@
+#include <tam/tam.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tam/error.h>
+#include <unistd.h>
+
+/// Version of the snapshot format written and read.
+#define SNAPSHOT_VERSION 3
+/// Number of code words converted at a time on their way to the file.
+#define ENCODE_WORDS 1024
+
+static const char Magic[4] = {'T', 'A', 'M', 'S'};
+
+/// @brief The start of a snapshot file, in the byte order of the host that
+/// wrote it.
+///
+/// The header is followed by the state of the heap allocator as a native
+/// TamHeap, then the program as big-endian words, exactly as a TAM binary
+/// holds it, then the words of the data store below StHigh and those above
+/// HtLow, as native words.
+typedef struct SnapshotHeader {
+    char Magic[4];         ///< `TAMS`
+    uint8_t Version;       ///< SNAPSHOT_VERSION
+    uint8_t WordSize;      ///< sizeof(DATA_W) on the host that wrote it
+    uint16_t ByteOrder;    ///< 0x0102 as written by that host
+    uint32_t CodeSize;     ///< Number of instructions
+    uint32_t StackSize;    ///< Number of words below StHigh
+    uint32_t HeapSize;     ///< Number of words above HtLow
+    uint64_t Steps;        ///< As in TamEmulator
+    uint64_t Fused;        ///< As in TamEmulator
+    ADDRESS Registers[16]; ///< Every register, including CP
+} SnapshotHeader;
+
+int saveSnapshot(const TamEmulator *Emulator, const char *Filename) {
+    assert(Emulator);
+    assert(Emulator->Program);
+    assert(Filename);
+
+    const TamProgram *Program = Emulator->Program;
+    const ADDRESS *Regs = Emulator->Registers;
+    // the words between ST and HT that the program has used may still be
+    // read, after PUSH moves ST back over them without writing
+    ADDRESS StHigh = Emulator->StHigh > Regs[ST] ? Emulator->StHigh : Regs[ST];
+    ADDRESS HtLow = Emulator->HtLow < Regs[HT] ? Emulator->HtLow : Regs[HT];
+    SnapshotHeader Header = {.Version = SNAPSHOT_VERSION,
+                             .WordSize = sizeof(DATA_W),
+                             .ByteOrder = 0x0102,
+                             .CodeSize = Program->Size,
+                             .StackSize = StHigh,
+                             .HeapSize = MEMORY_SIZE - 1 - HtLow,
+                             .Steps = Emulator->Steps,
+                             .Fused = Emulator->Fused};
+    memcpy(Header.Magic, Magic, sizeof(Magic));
+    memcpy(Header.Registers, Regs, sizeof(Header.Registers));
+
+    FILE *Out = fopen(Filename, "wb");
+    if (!Out) {
+        return ErrFileWrite;
+    }
+    int Failed = fwrite(&Header, sizeof(Header), 1, Out) != 1 ||
+                 fwrite(&Emulator->Heap, sizeof(TamHeap), 1, Out) != 1;
+
+    uint8_t Buf[ENCODE_WORDS * sizeof(CODE_W)];
+    for (int i = 0; i < Program->Size && !Failed; i += ENCODE_WORDS) {
+        int Count = Program->Size - i;
+        Count = Count < ENCODE_WORDS ? Count : ENCODE_WORDS;
+        for (int j = 0; j < Count; ++j) {
+            CODE_W Word = Program->CodeStore[i + j];
+            Buf[4 * j] = Word >> 24;
+            Buf[4 * j + 1] = Word >> 16;
+            Buf[4 * j + 2] = Word >> 8;
+            Buf[4 * j + 3] = Word;
+        }
+        Failed = fwrite(Buf, sizeof(CODE_W), Count, Out) != (size_t)Count;
+    }
+
+    // everything between StHigh and HtLow has never been written
+    if (!Failed) {
+        Failed = fwrite(Emulator->DataStore, sizeof(DATA_W), Header.StackSize,
+                        Out) != Header.StackSize ||
+                 fwrite(Emulator->DataStore + HtLow + 1, sizeof(DATA_W),
+                        Header.HeapSize, Out) != Header.HeapSize;
+    }
+    if (fclose(Out) || Failed) {
+        return ErrFileWrite;
+    }
+    return OK;
+}
+
+/// @brief Check whether a program image holds exactly the given code.
+/// @param Program image to check
+/// @param Code big-endian instruction words
+/// @param Size number of instructions in `Code`
+/// @return 1 if the image was loaded from the same code, 0 otherwise
+static int sameCode(const TamProgram *Program, const uint8_t *Code,
+                    uint32_t Size) {
+    if ((uint32_t)Program->Size != Size) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < Size; ++i) {
+        const uint8_t *Buf = Code + 4 * i;
+        CODE_W Word =
+            (CODE_W)Buf[0] << 24 | Buf[1] << 16 | Buf[2] << 8 | Buf[3];
+        if (Word != Program->CodeStore[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int loadSnapshotFromMemory(TamEmulator *Emulator, const void *Data,
+                           size_t Size) {
+    assert(Emulator);
+    assert(Data || !Size);
+
+    SnapshotHeader Header;
+    if (Size < sizeof(Header)) {
+        return ErrFileLength;
+    }
+    memcpy(&Header, Data, sizeof(Header));
+    if (memcmp(Header.Magic, Magic, sizeof(Magic)) ||
+        Header.Version != SNAPSHOT_VERSION ||
+        Header.WordSize != sizeof(DATA_W) || Header.ByteOrder != 0x0102) {
+        return ErrFileRead;
+    }
+
+    const ADDRESS *Regs = Header.Registers;
+    uint64_t StackSize = Header.StackSize;
+    uint64_t HeapSize = Header.HeapSize;
+    if (Header.CodeSize > CODE_SIZE || Regs[CT] != Header.CodeSize ||
+        Regs[ST] > Regs[HT] || StackSize < Regs[ST] ||
+        HeapSize < MEMORY_SIZE - 1u - Regs[HT] ||
+        StackSize + HeapSize > MEMORY_SIZE ||
+        Size != sizeof(Header) + sizeof(TamHeap) +
+                    Header.CodeSize * sizeof(CODE_W) +
+                    (StackSize + HeapSize) * sizeof(DATA_W)) {
+        return ErrFileLength;
+    }
+    const uint8_t *Allocator = (const uint8_t *)Data + sizeof(Header);
+    const uint8_t *Code = Allocator + sizeof(TamHeap);
+    const uint8_t *Stack = Code + Header.CodeSize * sizeof(CODE_W);
+    const uint8_t *Heap = Stack + StackSize * sizeof(DATA_W);
+
+    // restoring the program the emulator already has keeps its decoded
+    // image, and any blocks found and code compiled for it
+    TamProgram *Program = Emulator->Program;
+    if (Program && sameCode(Program, Code, Header.CodeSize)) {
+        retainProgram(Program);
+    } else {
+        int ErrCode = loadProgramImageFromMemory(
+            Code, Header.CodeSize * sizeof(CODE_W), &Program);
+        if (ErrCode) {
+            return ErrCode;
+        }
+    }
+    attachProgram(Emulator, Program);
+    releaseProgram(Program);
+
+    memcpy(Emulator->Registers, Regs, sizeof(Header.Registers));
+    memcpy(Emulator->DataStore, Stack, StackSize * sizeof(DATA_W));
+    memcpy(Emulator->DataStore + MEMORY_SIZE - HeapSize, Heap,
+           HeapSize * sizeof(DATA_W));
+    memcpy(&Emulator->Heap, Allocator, sizeof(TamHeap));
+    Emulator->StHigh = StackSize;
+    Emulator->HtLow = MEMORY_SIZE - 1 - HeapSize;
+    Emulator->Steps = Header.Steps;
+    Emulator->Fused = Header.Fused;
+    return OK;
+}
+
+int loadSnapshot(TamEmulator *Emulator, const char *Filename) {
+    assert(Emulator);
+    assert(Filename);
+
+    int Fd = open(Filename, O_RDONLY);
+    if (Fd < 0) {
+        return ErrFileNotFound;
+    }
+    struct stat Info;
+    if (fstat(Fd, &Info) != 0) {
+        close(Fd);
+        return ErrFileRead;
+    }
+    if ((size_t)Info.st_size < sizeof(SnapshotHeader)) {
+        close(Fd);
+        return ErrFileLength;
+    }
+
+    size_t Size = Info.st_size;
+    void *Data = mmap(NULL, Size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, Fd, 0);
+    close(Fd);
+    if (Data == MAP_FAILED) {
+        return ErrFileRead;
+    }
+
+    int ErrCode = loadSnapshotFromMemory(Emulator, Data, Size);
+    munmap(Data, Size);
+    return ErrCode;
+}
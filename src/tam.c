@@ -1,53 +1,308 @@
 #include <tam/tam.h>
 
+#include "internal.h"
 #include <assert.h>
-#include <stdio.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <tam/error.h>
+#include <unistd.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// Set the registers that stay fixed while a program runs.
+/// @param[out] Registers register file to set, all other registers untouched
+/// @param ProgSize number of instructions in the program
+static void setStaticRegisters(ADDRESS *Registers, int ProgSize) {
+    Registers[CT] = ProgSize;
+    Registers[HB] = MEMORY_SIZE - 1;
+    Registers[HT] = MEMORY_SIZE - 1;
+    Registers[PB] = Registers[CT];
+    Registers[PT] = Registers[PB] + 29;
+}
 
-int loadProgram(TamEmulator *Emulator, const char *Filename) {
-    assert(Emulator);
-    assert(Filename);
-
-    memset(Emulator->CodeStore, 0, MEMORY_SIZE * sizeof(CODE_W));
-    memset(Emulator->DataStore, 0, MEMORY_SIZE * sizeof(DATA_W));
-    memset(Emulator->Registers, 0, 16 * sizeof(ADDRESS));
+/// Decode a raw code word, resolving its address operand where possible.
+/// @param Registers static registers for the program being decoded
+/// @param Addr address of the instruction in the code store
+/// @param Code raw instruction word
+/// @return the decoded instruction
+static Instruction decodeInstruction(const ADDRESS *Registers, ADDRESS Addr,
+                                     CODE_W Code) {
+    Instruction Instr = {.Op = (Code & 0xf0000000) >> 28,
+                         .R = (Code & 0x0f000000) >> 24,
+                         .N = (Code & 0x00ff0000) >> 16,
+                         .D = (Code & 0x0000ffff)};
+
+    // CP is one past the instruction while it executes, so it is as good as
+    // static here; ST, HT and LB are the only registers that move at run time
+    if (Instr.R == CP) {
+        Instr.Target = Addr + 1 + Instr.D;
+    } else if (!isDynamicRegister(Instr.R)) {
+        Instr.Target = Registers[Instr.R] + Instr.D;
+    }
+    Instr.Handler = selectHandler(&Instr);
+    return Instr;
+}
 
-    FILE *File = fopen(Filename, "rb");
-    if (!File) {
-        return ErrFileNotFound;
+/// Largest binary, in words, that loadProgram() reads instead of mapping.
+#define SMALL_PROGRAM_SIZE 4096
+
+/// @brief Copy big-endian words into native-endian ones.
+/// @param[out] Dst destination words
+/// @param Src source bytes, with no alignment requirement
+/// @param Count number of words to copy
+static void copyBigEndian(CODE_W *Dst, const uint8_t *Src, int Count) {
+    int i = 0;
+#if defined(__SSSE3__)
+    const __m128i Swap =
+        _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 4 <= Count; i += 4) {
+        __m128i Words = _mm_loadu_si128((const __m128i *)(Src + 4 * i));
+        _mm_storeu_si128((__m128i *)(Dst + i), _mm_shuffle_epi8(Words, Swap));
+    }
+#elif defined(__SSE2__)
+    // swap the bytes of each half-word, then the half-words of each word
+    for (; i + 4 <= Count; i += 4) {
+        __m128i Words = _mm_loadu_si128((const __m128i *)(Src + 4 * i));
+        Words =
+            _mm_or_si128(_mm_slli_epi16(Words, 8), _mm_srli_epi16(Words, 8));
+        Words = _mm_shufflelo_epi16(Words, _MM_SHUFFLE(2, 3, 0, 1));
+        Words = _mm_shufflehi_epi16(Words, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *)(Dst + i), Words);
     }
+#endif
+    for (; i < Count; ++i) {
+        const uint8_t *Buf = Src + 4 * i;
+        Dst[i] = (CODE_W)Buf[0] << 24 | Buf[1] << 16 | Buf[2] << 8 | Buf[3];
+    }
+}
 
-    // get file length
-    int FileLength, ProgSize;
-    fseek(File, 0, SEEK_END);
-    FileLength = ftell(File);
-    ProgSize = FileLength / 4;
-    rewind(File);
+int loadProgramImageFromMemory(const void *Data, size_t Size,
+                               TamProgram **Program) {
+    assert(Data || !Size);
+    assert(Program);
 
-    if (FileLength % 4 != 0) {
+    if (Size % 4 != 0 || Size / 4 > CODE_SIZE) {
         return ErrFileLength;
     }
+    int ProgSize = Size / 4;
+
+    // one block holds the image, its decoded instructions and their
+    // sentinel, the raw words and the verifier's depths
+    TamProgram *Image = malloc(sizeof(TamProgram) +
+                               (ProgSize + 1) * sizeof(Instruction) +
+                               ProgSize * sizeof(CODE_W) +
+                               (ProgSize + 1) * sizeof(int32_t));
+    if (!Image) {
+        return ErrFileRead;
+    }
+    Instruction *Code = (Instruction *)(Image + 1);
+    CODE_W *CodeStore = (CODE_W *)(Code + ProgSize + 1);
+    int32_t *Depth = (int32_t *)(CodeStore + ProgSize);
+    copyBigEndian(CodeStore, Data, ProgSize);
+
+    ADDRESS Registers[16] = {0};
+    setStaticRegisters(Registers, ProgSize);
+    for (int i = 0; i < ProgSize; ++i) {
+        Code[i] = decodeInstruction(Registers, i, CodeStore[i]);
+    }
+    Code[ProgSize] = (Instruction){.Handler = H_END};
+    fuseInstructions(Code, ProgSize);
+    verifyProgram(Code, Depth, ProgSize);
+
+    atomic_init(&Image->Refs, 1);
+    Image->Size = ProgSize;
+    Image->CodeStore = CodeStore;
+    Image->Code = Code;
+    Image->Depth = Depth;
+    *Program = Image;
+    return OK;
+}
+
+int loadProgramImage(const char *Filename, TamProgram **Program) {
+    assert(Filename);
+    assert(Program);
+
+    int Fd = open(Filename, O_RDONLY);
+    if (Fd < 0) {
+        return ErrFileNotFound;
+    }
 
-    if (ProgSize > MEMORY_SIZE) {
+    struct stat Info;
+    if (fstat(Fd, &Info) != 0) {
+        close(Fd);
+        return ErrFileRead;
+    }
+    if (Info.st_size % 4 != 0 || Info.st_size / 4 > CODE_SIZE) {
+        close(Fd);
         return ErrFileLength;
     }
 
-    // read bytes
-    uint8_t Buf[4];
-    for (int i = 0; i < ProgSize; ++i) {
-        fread(Buf, 4, 1, File);
-        Emulator->CodeStore[i] =
-            Buf[0] << 24 | Buf[1] << 16 | Buf[2] << 8 | Buf[3];
+    // small binaries are cheaper to read than to map
+    size_t Size = Info.st_size;
+    if (Size <= sizeof(CODE_W) * SMALL_PROGRAM_SIZE) {
+        uint8_t Buf[sizeof(CODE_W) * SMALL_PROGRAM_SIZE];
+        ssize_t Read = Size ? read(Fd, Buf, Size) : 0;
+        close(Fd);
+        if (Read < 0 || (size_t)Read != Size) {
+            return ErrFileRead;
+        }
+        return loadProgramImageFromMemory(Buf, Size, Program);
+    }
+
+    void *Data = mmap(NULL, Size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, Fd, 0);
+    close(Fd);
+    if (Data == MAP_FAILED) {
+        return ErrFileRead;
+    }
+
+    int ErrCode = loadProgramImageFromMemory(Data, Size, Program);
+    munmap(Data, Size);
+    return ErrCode;
+}
+
+TamProgram *retainProgram(TamProgram *Program) {
+    assert(Program);
+    atomic_fetch_add_explicit(&Program->Refs, 1, memory_order_relaxed);
+    return Program;
+}
+
+void releaseProgram(TamProgram *Program) {
+    if (Program &&
+        atomic_fetch_sub_explicit(&Program->Refs, 1, memory_order_acq_rel) ==
+            1) {
+        free(Program);
     }
-    Emulator->Registers[CT] = ProgSize;
+}
 
-    // set registers
-    Emulator->Registers[HB] = MEMORY_SIZE - 1;
-    Emulator->Registers[HT] = MEMORY_SIZE - 1;
-    Emulator->Registers[PB] = Emulator->Registers[CT];
-    Emulator->Registers[PT] = Emulator->Registers[PB] + 29;
+#if TAM_WORD_BITS != 16
+/// Smallest run of pages that clearWords() hands back rather than zeroes.
+#define RELEASE_PAGES 16
 
+DATA_W *reserveDataStore(void) {
+    void *Store = mmap(NULL, MEMORY_SIZE * sizeof(DATA_W),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return Store == MAP_FAILED ? NULL : Store;
+}
+
+void releaseDataStore(DATA_W *Store) {
+    if (Store) {
+        munmap(Store, MEMORY_SIZE * sizeof(DATA_W));
+    }
+}
+#endif
+
+/// @brief Zero a run of words in a data store.
+///
+/// In a reserved store, whole pages inside a long run are handed back to
+/// the system instead, so that they cost nothing until touched again.
+/// @param[out] Words first word to zero
+/// @param Count number of words
+static void clearWords(DATA_W *Words, size_t Count) {
+#if TAM_WORD_BITS != 16
+    uintptr_t Page = sysconf(_SC_PAGESIZE);
+    uintptr_t First = (uintptr_t)Words;
+    uintptr_t Last = (uintptr_t)(Words + Count);
+    uintptr_t Start = (First + Page - 1) & ~(Page - 1);
+    uintptr_t End = Last & ~(Page - 1);
+    if (End >= Start + RELEASE_PAGES * Page &&
+        madvise((void *)Start, End - Start, MADV_DONTNEED) == 0) {
+        memset(Words, 0, Start - First);
+        memset((void *)End, 0, Last - End);
+        return;
+    }
+#endif
+    memset(Words, 0, Count * sizeof(DATA_W));
+}
+
+/// @brief Zero everything the previous program could have changed.
+///
+/// That is the registers, and the data store below the highest ST and above
+/// the lowest HT seen since the last clear.
+/// @param[in,out] Emulator emulator to clear
+static void clearUsedMemory(TamEmulator *Emulator) {
+    // on a fresh emulator StHigh is 0 and HtLow the top of memory
+    int64_t HtLow = Emulator->HtLow;
+    clearWords(Emulator->DataStore, Emulator->StHigh);
+    if (HtLow + 1 < MEMORY_SIZE) {
+        clearWords(Emulator->DataStore + HtLow + 1, MEMORY_SIZE - HtLow - 1);
+    }
+    Emulator->StHigh = 0;
+    Emulator->HtLow = MEMORY_SIZE - 1;
+
+    memset(Emulator->Registers, 0, 16 * sizeof(ADDRESS));
+    memset(&Emulator->Heap, 0, sizeof(TamHeap));
+}
+
+void resetEmulator(TamEmulator *Emulator) {
+    assert(Emulator);
+    clearUsedMemory(Emulator);
+    releaseProgram(Emulator->Program);
+    Emulator->Program = NULL;
+    Emulator->Code = NULL;
+    Emulator->Steps = 0;
+    Emulator->Fused = 0;
+    Emulator->StepBudget = 0;
+    atomic_store_explicit(&Emulator->TimeUp, 0, memory_order_relaxed);
+
+    flushOutput(&Emulator->IO);
+    setInputFd(&Emulator->IO, 0);
+    setOutputFd(&Emulator->IO, 1);
+}
+
+void attachProgram(TamEmulator *Emulator, TamProgram *Program) {
+    assert(Emulator);
+    assert(Program);
+
+    // retain first, in case the emulator holds the only other reference
+    retainProgram(Program);
+    if (Program != Emulator->Program) {
+        freeJit(Emulator->Jit);
+        Emulator->Jit = NULL;
+        freeIR(Emulator->IR);
+        Emulator->IR = NULL;
+        freeBlockCache(Emulator->Blocks);
+        Emulator->Blocks = NULL;
+    }
+    releaseProgram(Emulator->Program);
+    clearUsedMemory(Emulator);
+    setStaticRegisters(Emulator->Registers, Program->Size);
+    Emulator->Program = Program;
+    Emulator->Code = Program->Code;
+    Emulator->Steps = 0;
+    Emulator->Fused = 0;
+    // a stop meant for the last program is not one for this
+    atomic_store_explicit(&Emulator->TimeUp, 0, memory_order_relaxed);
+}
+
+int loadProgramFromMemory(TamEmulator *Emulator, const void *Data,
+                          size_t Size) {
+    assert(Emulator);
+    TamProgram *Program;
+    int ErrCode = loadProgramImageFromMemory(Data, Size, &Program);
+    if (ErrCode) {
+        return ErrCode;
+    }
+    attachProgram(Emulator, Program);
+    releaseProgram(Program);
+    return OK;
+}
+
+int loadProgram(TamEmulator *Emulator, const char *Filename) {
+    assert(Emulator);
+    TamProgram *Program;
+    int ErrCode = loadProgramImage(Filename, &Program);
+    if (ErrCode) {
+        return ErrCode;
+    }
+    attachProgram(Emulator, Program);
+    releaseProgram(Program);
     return OK;
 }
 
@@ -55,14 +310,12 @@ int fetchDecode(TamEmulator *Emulator, Instruction *Instr) {
     assert(Emulator);
     assert(Instr);
 
-    uint16_t Idx = Emulator->Registers[CP];
+    ADDRESS Idx = Emulator->Registers[CP];
     if (Idx >= Emulator->Registers[CT]) {
         return ErrCodeAccessViolation;
     }
 
-    uint32_t Code = Emulator->CodeStore[Idx];
-    *Instr = (Instruction){(Code & 0xf0000000) >> 28, (Code & 0x0f000000) >> 24,
-                           (Code & 0x00ff0000) >> 16, (Code & 0x0000ffff)};
+    *Instr = Emulator->Code[Idx];
     Emulator->Registers[CP]++;
     return OK;
 }
@@ -113,25 +366,55 @@ static int popData(TamEmulator *Emulator, DATA_W *Datum) {
 
 static ADDRESS calcAddress(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
-    return Emulator->Registers[Instr.R] + Instr.D;
+    if (isDynamicRegister(Instr.R)) {
+        return Emulator->Registers[Instr.R] + Instr.D;
+    }
+    return Instr.Target;
 }
 
-static int execLoad(TamEmulator *Emulator, Instruction Instr) {
+/// Push a run of words onto the stack, checking the whole run at once.
+/// @param Emulator emulator to use
+/// @param Base address of the first word to push
+/// @param N number of words
+static int loadWords(TamEmulator *Emulator, ADDRESS Base, int N) {
     assert(Emulator);
-    ADDRESS BaseAddr = calcAddress(Emulator, Instr);
-    for (int i = 0; i < Instr.N; ++i) {
-        ADDRESS Addr = BaseAddr + i;
-        if (Addr >= Emulator->Registers[ST] &&
-            Addr <= Emulator->Registers[HT]) {
-            return ErrDataAccessViolation;
-        }
+    ADDRESS *Regs = Emulator->Registers;
+    if (!rangeAccessible(Base, N, Regs[ST], Regs[HT])) {
+        return ErrDataAccessViolation;
+    }
+    if ((WIDE_W)Regs[ST] + N > Regs[HT]) {
+        return ErrStackOverflow;
+    }
+
+    memcpy(Emulator->DataStore + Regs[ST], Emulator->DataStore + Base,
+           N * sizeof(DATA_W));
+    Regs[ST] += N;
+    return OK;
+}
 
-        DATA_W Data = Emulator->DataStore[Addr];
-        PUSH(Emulator, Data);
+/// Copy words that have just been popped to their destination.
+/// @param Emulator emulator to use
+/// @param Base address to store the first word at
+/// @param Src address of the first popped word, at or above ST
+/// @param N number of words
+static int storeWords(TamEmulator *Emulator, ADDRESS Base, ADDRESS Src,
+                      int N) {
+    assert(Emulator);
+    ADDRESS *Regs = Emulator->Registers;
+    if (!rangeAccessible(Base, N, Regs[ST], Regs[HT])) {
+        return ErrDataAccessViolation;
     }
+
+    memcpy(Emulator->DataStore + Base, Emulator->DataStore + Src,
+           N * sizeof(DATA_W));
     return OK;
 }
 
+static int execLoad(TamEmulator *Emulator, Instruction Instr) {
+    assert(Emulator);
+    return loadWords(Emulator, calcAddress(Emulator, Instr), Instr.N);
+}
+
 static int execLoada(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
     ADDRESS Addr = calcAddress(Emulator, Instr);
@@ -142,18 +425,7 @@ static int execLoadi(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
     ADDRESS BaseAddr;
     POP(Emulator, (DATA_W *)&BaseAddr);
-
-    for (int i = 0; i < Instr.N; ++i) {
-        ADDRESS Addr = BaseAddr + i;
-        if (Addr >= Emulator->Registers[ST] &&
-            Addr <= Emulator->Registers[HT]) {
-            return ErrDataAccessViolation;
-        }
-
-        DATA_W Data = Emulator->DataStore[Addr];
-        PUSH(Emulator, Data);
-    }
-    return OK;
+    return loadWords(Emulator, BaseAddr, Instr.N);
 }
 
 static int execLoadl(TamEmulator *Emulator, Instruction Instr) {
@@ -163,58 +435,35 @@ static int execLoadl(TamEmulator *Emulator, Instruction Instr) {
 
 static int execStore(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
-
-    // pop value
-    DATA_W Value[Instr.N];
-    for (int i = 0; i < Instr.N; ++i) {
-        POP(Emulator, Value + i)
-    }
-
-    // store
-    ADDRESS BaseAddr = calcAddress(Emulator, Instr);
-    for (int i = 0; i < Instr.N; ++i) {
-        ADDRESS Addr = BaseAddr + i;
-        if (Addr >= Emulator->Registers[ST] &&
-            Addr <= Emulator->Registers[HT]) {
-            return ErrDataAccessViolation;
-        }
-
-        Emulator->DataStore[Addr] = Value[Instr.N - i - 1];
+    if (Emulator->Registers[ST] < Instr.N) {
+        return ErrStackUnderflow;
     }
 
-    return OK;
+    // the popped words stay where they are until they are copied
+    Emulator->Registers[ST] -= Instr.N;
+    return storeWords(Emulator, calcAddress(Emulator, Instr),
+                      Emulator->Registers[ST], Instr.N);
 }
 
 static int execStorei(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
-
-    // pop value
-    DATA_W Value[Instr.N];
-    for (int i = 0; i < Instr.N; ++i) {
-        POP(Emulator, Value + i);
-    }
-
-    // store
-    ADDRESS BaseAddr;
-    POP(Emulator, (DATA_W *)&BaseAddr);
-
-    for (int i = 0; i < Instr.N; ++i) {
-        ADDRESS Addr = BaseAddr + i;
-        if (Addr >= Emulator->Registers[ST] &&
-            Addr <= Emulator->Registers[HT]) {
-            return ErrDataAccessViolation;
-        }
-
-        Emulator->DataStore[Addr] = Value[Instr.N - i - 1];
+    if (Emulator->Registers[ST] < Instr.N + 1) {
+        return ErrStackUnderflow;
     }
 
-    return OK;
+    // the address sits just below the words to store
+    Emulator->Registers[ST] -= Instr.N + 1;
+    ADDRESS BaseAddr = Emulator->DataStore[Emulator->Registers[ST]];
+    return storeWords(Emulator, BaseAddr, Emulator->Registers[ST] + 1,
+                      Instr.N);
 }
 
 static int execCall(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
 
-    ADDRESS StaticLink = Emulator->Registers[Instr.N];
+    // there are only 16 registers; anything past them links to 0, as in
+    // runEmulator()
+    ADDRESS StaticLink = Instr.N < 16 ? Emulator->Registers[Instr.N] : 0;
     ADDRESS DynamicLink = Emulator->Registers[LB];
     ADDRESS ReturnAddress = Emulator->Registers[CP];
 
@@ -232,13 +481,37 @@ static int execCall(TamEmulator *Emulator, Instruction Instr) {
     return OK;
 }
 
+/// Take the note that a timeout ended a wait for input, if there is one.
+static int inputStopped(TamIO *IO) {
+    int Stopped = IO->InStopped;
+    IO->InStopped = 0;
+    return Stopped;
+}
+
 static int execCallPrimitive(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
 
     DATA_W Arg1, Arg2;
     DATA_W *WArg1, *WArg2;
-    char C;
+    ADDRESS Addr;
+    int ErrCode;
+
+    // a primitive short of input is not started, so that it runs afresh
+    // once there is more; the same goes for one whose wait for its first
+    // byte is cut short by a timeout
+    if (Instr.D == 19 || Instr.D == 20 || Instr.D == 21 || Instr.D == 23 ||
+        Instr.D == 25) {
+        if (!inputReady(&Emulator->IO, Instr.D)) {
+            return ErrNeedsInput;
+        }
+        peekChar(&Emulator->IO);
+        if (inputStopped(&Emulator->IO)) {
+            return ErrTimeout;
+        }
+    }
 
+    // arithmetic is done in WIDE_W and only then cut down to a word, so it
+    // wraps instead of overflowing
     switch (Instr.D) {
     case 1: // id
         break;
@@ -249,49 +522,55 @@ static int execCallPrimitive(TamEmulator *Emulator, Instruction Instr) {
     case 3: // and
         POP(Emulator, &Arg1);
         POP(Emulator, &Arg2);
-        PUSH(Emulator, Arg1 * Arg2 ? 1 : 0);
+        PUSH(Emulator, (WIDE_W)Arg1 * Arg2 ? 1 : 0);
         break;
     case 4: // or
         POP(Emulator, &Arg1);
         POP(Emulator, &Arg2);
-        PUSH(Emulator, Arg1 + Arg2 ? 1 : 0);
+        PUSH(Emulator, (WIDE_W)Arg1 + Arg2 ? 1 : 0);
         break;
     case 5: // succ
         POP(Emulator, &Arg1);
-        PUSH(Emulator, Arg1 + 1);
+        PUSH(Emulator, (WIDE_W)Arg1 + 1);
         break;
     case 6: // pred
         POP(Emulator, &Arg1);
-        PUSH(Emulator, Arg1 - 1);
+        PUSH(Emulator, (WIDE_W)Arg1 - 1);
         break;
     case 7: // neg
         POP(Emulator, &Arg1);
-        PUSH(Emulator, -Arg1);
+        PUSH(Emulator, -(WIDE_W)Arg1);
         break;
     case 8: // add
         POP(Emulator, &Arg1);
         POP(Emulator, &Arg2);
-        PUSH(Emulator, Arg1 + Arg2);
+        PUSH(Emulator, (WIDE_W)Arg1 + Arg2);
         break;
     case 9: // sub
         POP(Emulator, &Arg1);
         POP(Emulator, &Arg2);
-        PUSH(Emulator, Arg1 - Arg2);
+        PUSH(Emulator, (WIDE_W)Arg1 - Arg2);
         break;
     case 10: // mult
         POP(Emulator, &Arg1);
         POP(Emulator, &Arg2);
-        PUSH(Emulator, Arg1 * Arg2);
+        PUSH(Emulator, (WIDE_W)Arg1 * Arg2);
         break;
     case 11: // div
         POP(Emulator, &Arg1);
         POP(Emulator, &Arg2);
-        PUSH(Emulator, Arg1 / Arg2);
+        if (!Arg2) {
+            return ErrDivisionByZero;
+        }
+        PUSH(Emulator, (WIDE_W)Arg1 / Arg2);
         break;
     case 12: // mod
         POP(Emulator, &Arg1);
         POP(Emulator, &Arg2);
-        PUSH(Emulator, Arg1 % Arg2);
+        if (!Arg2) {
+            return ErrDivisionByZero;
+        }
+        PUSH(Emulator, (WIDE_W)Arg1 % Arg2);
         break;
     case 13: // lt
         POP(Emulator, &Arg1);
@@ -314,125 +593,120 @@ static int execCallPrimitive(TamEmulator *Emulator, Instruction Instr) {
         PUSH(Emulator, Arg1 >= Arg2 ? 1 : 0);
         break;
     case 17: // eq
-        POP(Emulator, &Arg1);
-
-        WArg1 = (DATA_W *)malloc(sizeof(DATA_W) * Arg1);
-        for (int I = 0; I < Arg1; ++I) {
-            POP(Emulator, WArg1 + I);
-        }
-
-        WArg2 = (DATA_W *)malloc(sizeof(DATA_W) * Arg1);
-        for (int I = 0; I < Arg1; ++I) {
-            POP(Emulator, WArg2 + I);
-        }
-
-        Arg2 = strncmp((char *)WArg1, (char *)WArg2, Arg1 * sizeof(DATA_W)) ? 0
-                                                                            : 1;
-        PUSH(Emulator, Arg2);
-        free(WArg1);
-        free(WArg2);
-        break;
     case 18: // neq
         POP(Emulator, &Arg1);
-
-        WArg1 = (DATA_W *)malloc(sizeof(DATA_W) * Arg1);
-        for (int I = 0; I < Arg1; ++I) {
-            POP(Emulator, WArg1 + I);
+        if (Arg1 < 0) {
+            Arg1 = 0;
         }
-
-        WArg2 = (DATA_W *)malloc(sizeof(DATA_W) * Arg1);
-        for (int I = 0; I < Arg1; ++I) {
-            POP(Emulator, WArg2 + I);
+        if (Emulator->Registers[ST] < 2 * (WIDE_W)Arg1) {
+            return ErrStackUnderflow;
         }
 
-        Arg2 = strncmp((char *)WArg1, (char *)WArg2, Arg1 * sizeof(DATA_W)) ? 1
-                                                                            : 0;
-        PUSH(Emulator, Arg2);
-        free(WArg1);
-        free(WArg2);
+        Emulator->Registers[ST] -= 2 * Arg1;
+        WArg1 = Emulator->DataStore + Emulator->Registers[ST] + Arg1;
+        WArg2 = Emulator->DataStore + Emulator->Registers[ST];
+        Arg2 = memcmp(WArg1, WArg2, Arg1 * sizeof(DATA_W)) == 0;
+        PUSH(Emulator, Instr.D == 17 ? Arg2 : !Arg2);
         break;
     case 19: // eol
-        C = getc(stdin);
-        PUSH(Emulator, C == '\n' ? 1 : 0);
-        putc(C, stdin);
+        PUSH(Emulator, primitiveEol(&Emulator->IO));
         break;
     case 20: // eof
-        C = getc(stdin);
-        PUSH(Emulator, C == EOF ? 1 : 0);
-        putc(C, stdin);
+        PUSH(Emulator, primitiveEof(&Emulator->IO));
         break;
     case 21: // get
         POP(Emulator, &Arg1);
-        if (Arg1 >= Emulator->Registers[ST] &&
-            Arg1 <= Emulator->Registers[HT]) {
+        Addr = Arg1;
+        if (Addr >= Emulator->Registers[ST] &&
+            Addr <= Emulator->Registers[HT]) {
             return ErrDataAccessViolation;
         }
 
-        C = getc(stdin);
-        Emulator->DataStore[Arg1] = C;
+        Emulator->DataStore[Addr] = primitiveGet(&Emulator->IO);
         break;
     case 22: // put
         POP(Emulator, &Arg1);
-        putc(Arg1, stdout);
+        primitivePut(&Emulator->IO, Arg1);
         break;
     case 23: // geteol
-        while ((C = getc(stdin)) != '\n') {
-            // pass
-        }
+        primitiveGetEol(&Emulator->IO);
         break;
     case 24: // puteol
-        putc('\n', stdout);
+        primitivePut(&Emulator->IO, '\n');
         break;
     case 25: // getint
         POP(Emulator, &Arg1);
-        if (Arg1 >= Emulator->Registers[ST] &&
-            Arg1 <= Emulator->Registers[HT]) {
+        Addr = Arg1;
+        if (Addr >= Emulator->Registers[ST] &&
+            Addr <= Emulator->Registers[HT]) {
             return ErrDataAccessViolation;
         }
 
-        fscanf(stdin, "%hd", &Arg2);
-        Emulator->DataStore[Arg1] = Arg2 & 0xffff;
+        Emulator->DataStore[Addr] = primitiveGetInt(&Emulator->IO);
         break;
     case 26: // putint
         POP(Emulator, &Arg1);
-        fprintf(stdout, "%hd", Arg1);
+        primitivePutInt(&Emulator->IO, Arg1);
         break;
+    case 27: // new
+        POP(Emulator, &Arg1);
+        ErrCode = primitiveNew(&Emulator->Heap, Emulator->DataStore,
+                               Emulator->Registers[ST],
+                               &Emulator->Registers[HT], Arg1, &Addr);
+        if (ErrCode) {
+            return ErrCode;
+        }
+        PUSH(Emulator, (DATA_W)Addr);
+        break;
+    case 28: // dispose
+        POP(Emulator, &Arg1);
+        POP(Emulator, &Arg2);
+        return primitiveDispose(&Emulator->Heap, Emulator->DataStore,
+                                &Emulator->Registers[HT], Arg2, Arg1);
     }
-    return OK;
+    // a timeout part way through leaves the primitive with what input had
+    // arrived, and stops the run there
+    return inputStopped(&Emulator->IO) ? ErrTimeout : OK;
 }
 
 static int execReturn(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
+    ADDRESS *Regs = Emulator->Registers;
+    int N = Instr.N;
+    int D = Instr.D < 0 ? 0 : Instr.D;
 
     // pop result
-    DATA_W Result[Instr.N];
-    for (int i = 0; i < Instr.N; ++i) {
-        POP(Emulator, Result + i);
+    if (Regs[ST] < N) {
+        return ErrStackUnderflow;
     }
+    ADDRESS ResultAddr = Regs[ST] - N;
 
     // pop frame and arguments
-    ADDRESS ReturnAddrAddr = Emulator->Registers[LB] + 2;
+    ADDRESS ReturnAddrAddr = Regs[LB] + 2;
     ADDRESS ReturnAddr = Emulator->DataStore[ReturnAddrAddr];
-    ADDRESS DynamicLinkAddr = Emulator->Registers[LB] + 1;
+    ADDRESS DynamicLinkAddr = Regs[LB] + 1;
     ADDRESS DynamicLink = Emulator->DataStore[DynamicLinkAddr];
 
-    Emulator->Registers[ST] = Emulator->Registers[LB];
-    for (int i = 0; i < Instr.D; ++i) {
-        POP(Emulator, NULL);
+    if (Regs[LB] < D) {
+        return ErrStackUnderflow;
     }
+    Regs[ST] = Regs[LB] - D;
 
     // push result and update registers
-    for (int i = Instr.N - 1; i >= 0; --i) {
-        PUSH(Emulator, Result[i]);
+    if (N && (WIDE_W)Regs[ST] + N > Regs[HT]) {
+        return ErrStackOverflow;
     }
-    Emulator->Registers[LB] = DynamicLink;
-    Emulator->Registers[CP] = ReturnAddr;
+    memmove(Emulator->DataStore + Regs[ST], Emulator->DataStore + ResultAddr,
+            N * sizeof(DATA_W));
+    Regs[ST] += N;
+    Regs[LB] = DynamicLink;
+    Regs[CP] = ReturnAddr;
     return OK;
 }
 
 static int execPush(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
-    if (Emulator->Registers[ST] + Instr.D >= Emulator->Registers[HT]) {
+    if ((WIDE_W)Emulator->Registers[ST] + Instr.D >= Emulator->Registers[HT]) {
         return ErrStackOverflow;
     }
 
@@ -442,22 +716,17 @@ static int execPush(TamEmulator *Emulator, Instruction Instr) {
 
 static int execPop(TamEmulator *Emulator, Instruction Instr) {
     assert(Emulator);
-    // pop value
-    DATA_W Value[Instr.N];
-    for (int i = 0; i < Instr.N; ++i) {
-        POP(Emulator, Value + i);
-    }
-
-    // pop spares
-    for (int i = 0; i < Instr.D; ++i) {
-        POP(Emulator, NULL);
-    }
+    ADDRESS *Regs = Emulator->Registers;
+    int N = Instr.N;
+    int D = Instr.D < 0 ? 0 : Instr.D;
 
-    // push value
-    for (int i = Instr.N - 1; i >= 0; --i) {
-        PUSH(Emulator, Value[i]);
+    // slide the top N words down over the D below them
+    if (Regs[ST] < N + D) {
+        return ErrStackUnderflow;
     }
-
+    memmove(Emulator->DataStore + Regs[ST] - N - D,
+            Emulator->DataStore + Regs[ST] - N, N * sizeof(DATA_W));
+    Regs[ST] -= D;
     return OK;
 }
 
@@ -503,8 +772,7 @@ static int execJumpif(TamEmulator *Emulator, Instruction Instr) {
     return OK;
 }
 
-int execute(TamEmulator *Emulator, Instruction Instr) {
-    assert(Emulator);
+static int execInstruction(TamEmulator *Emulator, Instruction Instr) {
     switch (Instr.Op) {
     case LOAD:
         return execLoad(Emulator, Instr);
@@ -543,3 +811,18 @@ int execute(TamEmulator *Emulator, Instruction Instr) {
 
     return OK;
 }
+
+int execute(TamEmulator *Emulator, Instruction Instr) {
+    assert(Emulator);
+    int ErrCode = execInstruction(Emulator, Instr);
+
+    // no instruction writes above the higher of ST before and after it, or
+    // below the lower of HT before and after it
+    if (Emulator->Registers[ST] > Emulator->StHigh) {
+        Emulator->StHigh = Emulator->Registers[ST];
+    }
+    if (Emulator->Registers[HT] < Emulator->HtLow) {
+        Emulator->HtLow = Emulator->Registers[HT];
+    }
+    return ErrCode;
+}
@@ -0,0 +1,80 @@
+#include "optimize.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tam/error.h>
+
+/// @brief Write code words to a file as a TAM binary, big-endian.
+/// @return 0 on success, -1 if the file could not be written
+static int writeBinary(const char *Filename, const CODE_W *Code, int Size) {
+    FILE *Out = fopen(Filename, "wb");
+    if (!Out) {
+        return -1;
+    }
+    int Failed = 0;
+    for (int i = 0; i < Size && !Failed; ++i) {
+        uint8_t Buf[4] = {Code[i] >> 24, Code[i] >> 16, Code[i] >> 8,
+                          Code[i]};
+        Failed = fwrite(Buf, 1, sizeof(Buf), Out) != sizeof(Buf);
+    }
+    return fclose(Out) || Failed ? -1 : 0;
+}
+
+int main(int argc, const char **argv) {
+    int Verbose = 0;
+    int Arg = 1;
+    for (; Arg < argc && argv[Arg][0] == '-'; ++Arg) {
+        if (strcmp("-v", argv[Arg]) == 0 ||
+            strcmp("--verbose", argv[Arg]) == 0) {
+            Verbose = 1;
+        } else {
+            fprintf(stderr, "unrecognised option %s\n", argv[Arg]);
+            return 1;
+        }
+    }
+    if (Arg + 2 != argc) {
+        fprintf(stderr, "usage: tam-opt [-v] INPUT OUTPUT\n");
+        return 1;
+    }
+    const char *Input = argv[Arg], *Output = argv[Arg + 1];
+
+    TamProgram *Program;
+    int ErrCode = loadProgramImage(Input, &Program);
+    if (ErrCode) {
+        fprintf(stderr, "%s: %s\n", Input, errorMessage(ErrCode));
+        return ErrCode;
+    }
+
+    CODE_W *Code = NULL;
+    int Size;
+    OptStats Stats;
+    int Result = optimizeProgram(Program, &Code, &Size, &Stats);
+    if (Result < 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (Result > 0) {
+        fprintf(stderr,
+                "%s: uses code addresses that cannot be moved, left as it is\n",
+                Input);
+    }
+
+    const CODE_W *Words = Result ? Program->CodeStore : Code;
+    int Count = Result ? Program->Size : Size;
+    if (writeBinary(Output, Words, Count)) {
+        fprintf(stderr, "could not write %s\n", Output);
+        return 1;
+    }
+    if (Verbose) {
+        fprintf(stderr,
+                "%s: %d instructions, was %d: %d folded, %d jumps threaded, "
+                "%d simplified, %d unreachable\n",
+                Output, Count, Program->Size, Stats.Folded, Stats.Threaded,
+                Stats.Simplified, Stats.Unreachable);
+    }
+
+    free(Code);
+    releaseProgram(Program);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "disasm.h"
+#include "tracefile.h"
+#include <stdio.h>
+#include <string.h>
+
+/// Decode the fields of an instruction word that disassembly needs.
+static Instruction decodeWord(CODE_W Word) {
+    return (Instruction){.Op = (Word & 0xf0000000) >> 28,
+                         .R = (Word & 0x0f000000) >> 24,
+                         .N = (Word & 0x00ff0000) >> 16,
+                         .D = (Word & 0x0000ffff)};
+}
+
+int main(int argc, const char **argv) {
+    int ShowRegisters = 0;
+    int Arg = 1;
+    for (; Arg < argc && argv[Arg][0] == '-'; ++Arg) {
+        if (strcmp("-r", argv[Arg]) == 0 ||
+            strcmp("--registers", argv[Arg]) == 0) {
+            ShowRegisters = 1;
+        } else {
+            fprintf(stderr, "unrecognised option %s\n", argv[Arg]);
+            return 1;
+        }
+    }
+    if (Arg + 1 != argc) {
+        fprintf(stderr, "usage: tam-tracedump [-r] TRACEFILE\n");
+        return 1;
+    }
+
+    TraceReader Reader;
+    if (openTrace(&Reader, argv[Arg])) {
+        fprintf(stderr, "%s is not a trace file\n", argv[Arg]);
+        return 1;
+    }
+    if (ShowRegisters && !(Reader.Flags & TRACE_REGISTERS)) {
+        fprintf(stderr, "%s does not record registers\n", argv[Arg]);
+        ShowRegisters = 0;
+    }
+
+    TraceRecord Record;
+    int Result;
+    char Buf[32];
+    while ((Result = readTraceRecord(&Reader, &Record)) > 0) {
+        instructionString(decodeWord(Record.Word), Buf);
+        if (ShowRegisters) {
+            printf("0x%04x: %-24s ST=0x%04x LB=0x%04x\n", Record.Addr, Buf,
+                   Record.St, Record.Lb);
+        } else {
+            printf("0x%04x: %s\n", Record.Addr, Buf);
+        }
+    }
+    closeTrace(&Reader);
+
+    if (Result < 0) {
+        fprintf(stderr, "%s is truncated\n", argv[Arg]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include "tracefile.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Number of records a streaming trace buffers between writes.
+#define TRACE_BUFFER_RECORDS 65536
+/// Number of records encoded at a time on their way to the file.
+#define ENCODE_RECORDS 1024
+/// Size of the file header in bytes.
+#define HEADER_SIZE 8
+/// Size of a record in bytes, without and with registers.
+#define RECORD_SIZE 6
+#define RECORD_SIZE_REGISTERS (RECORD_SIZE + 2 * sizeof(ADDRESS))
+
+static const char Magic[4] = {'T', 'A', 'M', 'T'};
+
+struct TraceWriter {
+    char *Filename;       ///< File the trace goes to
+    FILE *Out;            ///< The open file, or null
+    int Registers;        ///< Nonzero to record ST and LB
+    int Stream;           ///< Nonzero to write every record, not the last
+    int Failed;           ///< Nonzero once a write has failed
+    int Wrapped;          ///< Nonzero once the ring has overwritten a record
+    size_t Capacity;      ///< Number of records the ring holds
+    size_t Next;          ///< Ring slot for the next record
+    ADDRESS St;           ///< ST in the last record written out
+    ADDRESS Lb;           ///< LB in the last record written out
+    TraceRecord *Records; ///< The ring
+};
+
+static void put16(uint8_t *P, uint16_t V) {
+    P[0] = V;
+    P[1] = V >> 8;
+}
+
+static uint16_t get16(const uint8_t *P) { return P[0] | P[1] << 8; }
+
+/// Store the change in a register, in as many bytes as an address has.
+static void putRegister(uint8_t *P, ADDRESS V) {
+    for (size_t i = 0; i < sizeof(ADDRESS); ++i) {
+        P[i] = V >> 8 * i;
+    }
+}
+
+static ADDRESS getRegister(const uint8_t *P) {
+    ADDRESS V = 0;
+    for (size_t i = 0; i < sizeof(ADDRESS); ++i) {
+        V |= (ADDRESS)P[i] << 8 * i;
+    }
+    return V;
+}
+
+/// Open the trace file and write its header.
+static int openOutput(TraceWriter *W) {
+    if (!(W->Out = fopen(W->Filename, "wb"))) {
+        return -1;
+    }
+    uint8_t Header[HEADER_SIZE] = {0};
+    memcpy(Header, Magic, sizeof(Magic));
+    Header[4] = TRACE_VERSION;
+    Header[5] = W->Registers ? TRACE_REGISTERS : 0;
+    Header[6] = sizeof(ADDRESS);
+    if (fwrite(Header, 1, sizeof(Header), W->Out) != sizeof(Header)) {
+        W->Failed = 1;
+    }
+    return 0;
+}
+
+/// Encode a run of records from the ring and write them to the file.
+static void writeRecords(TraceWriter *W, const TraceRecord *Records,
+                         size_t Count) {
+    uint8_t Buf[ENCODE_RECORDS * RECORD_SIZE_REGISTERS];
+    while (Count && !W->Failed) {
+        size_t Batch = Count < ENCODE_RECORDS ? Count : ENCODE_RECORDS;
+        uint8_t *P = Buf;
+        for (size_t i = 0; i < Batch; ++i) {
+            const TraceRecord *R = &Records[i];
+            put16(P, R->Addr);
+            put16(P + 2, R->Word);
+            put16(P + 4, R->Word >> 16);
+            P += RECORD_SIZE;
+            if (W->Registers) {
+                putRegister(P, R->St - W->St);
+                putRegister(P + sizeof(ADDRESS), R->Lb - W->Lb);
+                W->St = R->St;
+                W->Lb = R->Lb;
+                P += RECORD_SIZE_REGISTERS - RECORD_SIZE;
+            }
+        }
+        if (fwrite(Buf, 1, P - Buf, W->Out) != (size_t)(P - Buf)) {
+            W->Failed = 1;
+        }
+        Records += Batch;
+        Count -= Batch;
+    }
+}
+
+TraceWriter *newTraceWriter(const char *Filename, size_t Last, int Registers) {
+    assert(Filename);
+    TraceWriter *W = calloc(1, sizeof(TraceWriter));
+    if (!W) {
+        return NULL;
+    }
+    W->Registers = Registers;
+    W->Stream = Last == 0;
+    W->Capacity = Last ? Last : TRACE_BUFFER_RECORDS;
+    W->Filename = malloc(strlen(Filename) + 1);
+    W->Records = malloc(W->Capacity * sizeof(TraceRecord));
+    if (!W->Filename || !W->Records) {
+        freeTraceWriter(W);
+        return NULL;
+    }
+    strcpy(W->Filename, Filename);
+
+    if (W->Stream && openOutput(W)) {
+        freeTraceWriter(W);
+        return NULL;
+    }
+    return W;
+}
+
+void traceRecord(void *Context, const TamEmulator *Emulator, ADDRESS Addr,
+                 Instruction Instr) {
+    TraceWriter *W = Context;
+    TraceRecord *R = &W->Records[W->Next];
+    R->Addr = Addr;
+    R->Word = Emulator->Program->CodeStore[Addr];
+    R->St = Emulator->Registers[ST];
+    R->Lb = Emulator->Registers[LB];
+
+    if (++W->Next == W->Capacity) {
+        if (W->Stream) {
+            writeRecords(W, W->Records, W->Capacity);
+        } else {
+            W->Wrapped = 1;
+        }
+        W->Next = 0;
+    }
+}
+
+int finishTrace(TraceWriter *W, int Keep) {
+    assert(W);
+    if (W->Stream) {
+        writeRecords(W, W->Records, W->Next);
+    } else if (Keep) {
+        if (openOutput(W)) {
+            return -1;
+        }
+        // the oldest record is the one the ring would overwrite next
+        if (W->Wrapped) {
+            writeRecords(W, W->Records + W->Next, W->Capacity - W->Next);
+        }
+        writeRecords(W, W->Records, W->Next);
+    }
+    W->Next = 0;
+    W->Wrapped = 0;
+
+    if (W->Out && fclose(W->Out)) {
+        W->Failed = 1;
+    }
+    W->Out = NULL;
+    return W->Failed ? -1 : 0;
+}
+
+void freeTraceWriter(TraceWriter *W) {
+    if (!W) {
+        return;
+    }
+    if (W->Out) {
+        fclose(W->Out);
+    }
+    free(W->Filename);
+    free(W->Records);
+    free(W);
+}
+
+int openTrace(TraceReader *R, const char *Filename) {
+    assert(R);
+    assert(Filename);
+    if (!(R->In = fopen(Filename, "rb"))) {
+        return -1;
+    }
+    uint8_t Header[HEADER_SIZE];
+    if (fread(Header, 1, sizeof(Header), R->In) != sizeof(Header) ||
+        memcmp(Header, Magic, sizeof(Magic)) != 0 ||
+        Header[4] != TRACE_VERSION ||
+        (Header[6] ? Header[6] : 2) != sizeof(ADDRESS)) {
+        fclose(R->In);
+        R->In = NULL;
+        return -1;
+    }
+    R->Flags = Header[5];
+    R->St = R->Lb = 0;
+    return 0;
+}
+
+int readTraceRecord(TraceReader *R, TraceRecord *Record) {
+    assert(R);
+    assert(Record);
+    uint8_t Buf[RECORD_SIZE_REGISTERS];
+    size_t Size =
+        R->Flags & TRACE_REGISTERS ? RECORD_SIZE_REGISTERS : RECORD_SIZE;
+    size_t Read = fread(Buf, 1, Size, R->In);
+    if (Read != Size) {
+        return Read ? -1 : 0;
+    }
+
+    Record->Addr = get16(Buf);
+    Record->Word = get16(Buf + 2) | (CODE_W)get16(Buf + 4) << 16;
+    if (R->Flags & TRACE_REGISTERS) {
+        R->St += getRegister(Buf + RECORD_SIZE);
+        R->Lb += getRegister(Buf + RECORD_SIZE + sizeof(ADDRESS));
+    }
+    Record->St = R->St;
+    Record->Lb = R->Lb;
+    return 1;
+}
+
+void closeTrace(TraceReader *R) {
+    assert(R);
+    if (R->In) {
+        fclose(R->In);
+    }
+    R->In = NULL;
+}
@@ -0,0 +1,97 @@
+#ifndef TAM_TRACEFILE_H__
+#define TAM_TRACEFILE_H__
+
+#include <stdio.h>
+#include <tam/tam.h>
+
+/// @file
+/// A binary trace is an 8-byte header followed by one record per executed
+/// instruction, in the order they ran, all little-endian.
+///
+/// The header is the magic bytes `TAMT`, a version byte, a flags byte, the
+/// size of an address in bytes and an unused byte. Each record holds the
+/// address of the instruction as 2 bytes and the instruction word as it was
+/// loaded as 4 bytes. If the header has `TRACE_REGISTERS` set, the record
+/// goes on with the changes in ST and LB since the record before it, each
+/// the size of an address and modulo the number of values one can hold.
+/// Both registers count as 0 before the first record, so the first record
+/// holds their values outright. Traces are only read back by a build with
+/// the same size of address; one that leaves the size as 0 is from a build
+/// with 2-byte addresses.
+
+/// Version of the trace format written and read.
+#define TRACE_VERSION 1
+/// Header flag: records carry ST and LB.
+#define TRACE_REGISTERS 1
+
+/// @brief One executed instruction, as the trace stores it.
+typedef struct TraceRecord {
+    ADDRESS Addr; ///< Address of the instruction
+    CODE_W Word;  ///< The instruction as it was loaded
+    ADDRESS St;   ///< ST before the instruction ran
+    ADDRESS Lb;   ///< LB before the instruction ran
+} TraceRecord;
+
+/// @brief Collects trace records in a ring buffer and writes them out.
+typedef struct TraceWriter TraceWriter;
+
+/// @brief Start a binary trace.
+///
+/// A streaming trace opens its file straight away and writes the buffer to
+/// it whenever it fills up. A trace of the last `Last` instructions only
+/// keeps that many, overwriting the oldest, and opens its file when
+/// finishTrace() is asked to write them.
+/// @param Filename file to write the trace to
+/// @param Last number of instructions to keep, or 0 to stream every one
+/// @param Registers nonzero to record ST and LB
+/// @return the new writer, or null if the file could not be opened or
+/// memory ran out
+TraceWriter *newTraceWriter(const char *Filename, size_t Last, int Registers);
+
+/// @brief Record one instruction. This is a TamTraceFn, to be passed to
+/// runEmulatorTraced() with the writer as its context.
+/// @param Context the writer
+/// @param Emulator emulator about to execute the instruction
+/// @param Addr address of the instruction
+/// @param Instr the instruction
+void traceRecord(void *Context, const TamEmulator *Emulator, ADDRESS Addr,
+                 Instruction Instr);
+
+/// @brief Write out whatever a trace still holds and close its file.
+/// @param W the writer
+/// @param Keep for a trace of the last instructions, nonzero to write them
+/// out; a streaming trace always writes everything
+/// @return 0 on success, -1 if the file could not be written
+int finishTrace(TraceWriter *W, int Keep);
+
+/// @brief Free a trace writer, closing its file if finishTrace() has not.
+/// @param W writer to free, may be null
+void freeTraceWriter(TraceWriter *W);
+
+/// @brief Reads the records of a binary trace back.
+typedef struct TraceReader {
+    FILE *In;   ///< The trace file
+    int Flags;  ///< Flags from the header
+    ADDRESS St; ///< ST in the last record read
+    ADDRESS Lb; ///< LB in the last record read
+} TraceReader;
+
+/// @brief Open a binary trace and check its header.
+/// @param[out] R reader to set up
+/// @param Filename trace file
+/// @return 0 on success, -1 if the file could not be opened or is not a
+/// trace
+int openTrace(TraceReader *R, const char *Filename);
+
+/// @brief Read the next record of a trace.
+/// @param[in,out] R the reader
+/// @param[out] Record the record; ST and LB are 0 unless the trace has them
+/// @return 1 if a record was read, 0 at the end of the trace, -1 if the
+/// trace ends part way through a record
+int readTraceRecord(TraceReader *R, TraceRecord *Record);
+
+/// @brief Close a trace opened by openTrace().
+/// @param R the reader
+void closeTrace(TraceReader *R);
+
+#endif
@@ -0,0 +1,258 @@
+#include "internal.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+/// Depth of an instruction no path has reached yet.
+#define DEPTH_UNREACHED INT32_MAX
+
+/// @brief State of the verifier while it follows the control flow graph.
+typedef struct Verifier {
+    const Instruction *Code;
+    int32_t *Depth;
+    int Count;
+    int *Work;       ///< Instructions whose successors need updating
+    int Pending;     ///< Number of entries in `Work`
+    uint8_t *Queued; ///< Nonzero for instructions in `Work`
+} Verifier;
+
+static int isPrimitiveCall(const Instruction *I) {
+    return I->Op == CALL && I->R == PB && I->D > 0 && I->D < 29;
+}
+
+/// @brief Change in ST made by a primitive.
+/// @param Prim primitive number
+/// @return the change, or DEPTH_UNKNOWN if it depends on the data
+static int32_t primitiveEffect(int Prim) {
+    switch (Prim) {
+    case 3:  // and
+    case 4:  // or
+    case 8:  // add
+    case 9:  // sub
+    case 10: // mult
+    case 11: // div
+    case 12: // mod
+    case 13: // lt
+    case 14: // le
+    case 15: // ge
+    case 16: // gt
+    case 21: // get
+    case 22: // put
+    case 25: // getint
+    case 26: // putint
+        return -1;
+    case 17: // eq
+    case 18: // neq
+        return DEPTH_UNKNOWN;
+    case 19: // eol
+    case 20: // eof
+        return 1;
+    case 28: // dispose
+        return -2;
+    default: // id, not, succ, pred, neg, geteol, puteol, new and the rest
+        return 0;
+    }
+}
+
+/// Merge what one path says about an instruction into what is known.
+static void flow(Verifier *V, int To, int32_t Depth) {
+    if (To >= V->Count) {
+        return;
+    }
+    // ST - LB can never be further from zero than this, so anything
+    // further has come from a path that cannot run
+    if (Depth != DEPTH_UNKNOWN &&
+        (Depth > MEMORY_SIZE || Depth < -MEMORY_SIZE)) {
+        Depth = DEPTH_UNKNOWN;
+    }
+
+    int32_t Old = V->Depth[To];
+    int32_t New = Old == DEPTH_UNREACHED || Old == Depth ? Depth
+                                                          : DEPTH_UNKNOWN;
+    if (New != Old) {
+        V->Depth[To] = New;
+        if (!V->Queued[To]) {
+            V->Queued[To] = 1;
+            V->Work[V->Pending++] = To;
+        }
+    }
+}
+
+/// Pass the depth before an instruction on to each of its successors.
+static void flowFrom(Verifier *V, int At) {
+    const Instruction *I = V->Code + At;
+    int32_t K = V->Depth[At];
+    int Known = K != DEPTH_UNKNOWN;
+    int Dynamic = isDynamicRegister(I->R);
+    int32_t Delta;
+
+    switch (I->Op) {
+    case LOAD:
+        Delta = I->N;
+        break;
+    case LOADA:
+    case LOADL:
+        Delta = 1;
+        break;
+    case LOADI:
+        Delta = I->N - 1;
+        break;
+    case STORE:
+        Delta = -I->N;
+        break;
+    case STOREI:
+        Delta = -I->N - 1;
+        break;
+    case CALL:
+        if (isPrimitiveCall(I)) {
+            Delta = primitiveEffect(I->D);
+            Known = Known && Delta != DEPTH_UNKNOWN;
+            break;
+        }
+        // a call leaves LB three words below ST however it was reached;
+        // control only comes back through RETURN
+        if (!Dynamic) {
+            flow(V, I->Target, 3);
+        }
+        return;
+    case PUSH:
+        // a negative PUSH can wrap ST round if it goes below zero
+        Delta = I->D;
+        Known = Known && K + Delta >= 0;
+        break;
+    case POP:
+        Delta = I->D < 0 ? 0 : -I->D;
+        break;
+    case JUMP:
+        if (!Dynamic) {
+            flow(V, I->Target, K);
+        }
+        return;
+    case JUMPIF:
+        if (!Dynamic) {
+            flow(V, I->Target, Known ? K - 1 : DEPTH_UNKNOWN);
+        }
+        Delta = -1;
+        break;
+    default:
+        // RETURN, JUMPI, HALT and unrecognised opcodes go nowhere the
+        // verifier can follow
+        return;
+    }
+    flow(V, At + 1, Known ? K + Delta : DEPTH_UNKNOWN);
+}
+
+/// Follow the control flow graph until nothing more changes.
+static void propagate(Verifier *V) {
+    while (V->Pending) {
+        int At = V->Work[--V->Pending];
+        V->Queued[At] = 0;
+        flowFrom(V, At);
+    }
+}
+
+/// @brief Pick the unchecked variant of an instruction's handler, if the
+/// depth before it proves the checks unnecessary.
+/// @param I instruction, with its handler chosen by selectHandler() or
+/// fuseInstructions()
+/// @param K ST - LB before the instruction, or DEPTH_UNKNOWN
+/// @param Count number of instructions in the program
+/// @return the handler to use
+static Handler uncheckedHandler(const Instruction *I, int32_t K, int Count) {
+    int Known = K != DEPTH_UNKNOWN;
+    int N = I->N;
+    int D = I->D;
+
+    // ST is at least K, since LB cannot be negative, so anything wholly
+    // below K is below ST. Accesses relative to LB or ST are judged the
+    // same way, from where they lie relative to ST.
+    switch (I->Handler) {
+    case H_LOAD:
+        return Known && I->Target + N <= K ? H_LOAD_U : H_LOAD;
+    case H_LOAD_DYN:
+        if (Known && ((I->R == LB && D >= 0 && D + N <= K) ||
+                      (I->R == ST && D + N <= 0 && K + D >= 0))) {
+            return H_LOAD_DYN_U;
+        }
+        return H_LOAD_DYN;
+    case H_STORE:
+        return Known && N <= K && I->Target + N <= K - N ? H_STORE_U
+                                                          : H_STORE;
+    case H_STORE_DYN:
+        if (Known && N <= K &&
+            ((I->R == LB && D >= 0 && D + N <= K - N) ||
+             (I->R == ST && D + N <= 0 && K - N + D >= 0))) {
+            return H_STORE_DYN_U;
+        }
+        return H_STORE_DYN;
+    case H_CALL:
+        return I->Target < Count ? H_CALL_U : H_CALL;
+    case H_POP:
+        return Known && N + (D < 0 ? 0 : D) <= K ? H_POP_U : H_POP;
+    case H_JUMP:
+        return I->Target < Count ? H_JUMP_U : H_JUMP;
+    case H_JUMPIF:
+        return Known && K >= 1 && I->Target < Count ? H_JUMPIF_U : H_JUMPIF;
+    case H_NOT:
+    case H_SUCC:
+    case H_PRED:
+    case H_NEG:
+        return Known && K >= 1 ? H_NOT_U + (I->Handler - H_NOT) : I->Handler;
+    case H_AND:
+    case H_OR:
+    case H_ADD:
+    case H_SUB:
+    case H_MULT:
+    case H_DIV:
+    case H_MOD:
+    case H_LT:
+    case H_LE:
+    case H_GE:
+    case H_GT:
+        return Known && K >= 2 ? H_NOT_U + (I->Handler - H_NOT) : I->Handler;
+    default:
+        // superinstructions already make their checks once for the whole
+        // sequence, and everything else keeps its checks
+        return I->Handler;
+    }
+}
+
+void verifyProgram(Instruction *Code, int32_t *Depth, int Count) {
+    assert(Code);
+    assert(Depth);
+
+    Verifier V = {.Code = Code, .Depth = Depth, .Count = Count};
+    V.Work = malloc(Count * sizeof(int));
+    V.Queued = calloc(Count + 1, 1);
+    if (!V.Work || !V.Queued) {
+        // without the proof, every instruction just keeps its checks
+        for (int i = 0; i <= Count; ++i) {
+            Depth[i] = DEPTH_UNKNOWN;
+        }
+        free(V.Work);
+        free(V.Queued);
+        return;
+    }
+
+    for (int i = 0; i < Count; ++i) {
+        Depth[i] = DEPTH_UNREACHED;
+    }
+    Depth[Count] = DEPTH_UNKNOWN;
+    flow(&V, 0, 0);
+    propagate(&V);
+
+    // anything no static path reaches can still be reached by a return or
+    // a computed jump, with any depth at all, and so can what follows it
+    for (int i = 0; i < Count; ++i) {
+        if (Depth[i] == DEPTH_UNREACHED) {
+            flow(&V, i, DEPTH_UNKNOWN);
+        }
+    }
+    propagate(&V);
+
+    for (int i = 0; i < Count; ++i) {
+        Code[i].Handler = uncheckedHandler(&Code[i], Depth[i], Count);
+    }
+    free(V.Work);
+    free(V.Queued);
+}